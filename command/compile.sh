@@ -45,7 +45,10 @@ fi
 BIN="prog_no_arg"
 CFLAGS="-m32 -Wall -c -fno-builtin -W -Wstrict-prototypes \
       -Wmissing-prototypes -Wsystem-headers -fno-stack-protector"
-LIB="../lib/"
+LIB="-I ../lib/ -I ../lib/user/ -I ../lib/kernel/ -I ../kernel/ -I ../device/ \
+     -I ../thread/ -I ../userprog/ -I ../fs/"
+#syscall.h要包含fs.h、vma.h、timer.h，所以要跟Makefile一樣把各目錄都加進搜尋路徑，
+#只加-I ../lib/的話，#include "syscall.h"會找到主機的/usr/include/syscall.h
 OBJS="../build/string.o ../build/syscall.o \
       ../build/stdio.o ../build/assert.o"
 #OBJS="../build/main.o ../build/init.o ../build/interrupt.o \
@@ -62,7 +65,7 @@ OBJS="../build/string.o ../build/syscall.o \
 DD_IN=$BIN
 DD_OUT="hd3M.img" 
 
-gcc $CFLAGS -I $LIB -o $BIN".o" $BIN".c"
+gcc $CFLAGS $LIB -o $BIN".o" $BIN".c"
 ld -melf_i386 -Ttext 0x8008000 -e main $BIN".o" $OBJS -o $BIN
 SEC_CNT=$(ls -l $BIN|awk '{printf("%d", ($5+511)/512)}')
 #用ls -l prog_no_arg標準輸出prog_no_arg檔案的詳細資訊到管線內，
@@ -1,7 +1,8 @@
 #include "stdio.h"
+#include "syscall.h"
 
 int main(void) {
   printf("prog_no_arg from disk\n"); 
-  while(1);
+  exit(0);
   return 0;
 }
@@ -137,13 +137,14 @@ static void write2sector(struct disk* hd, void* buf, uint8_t sec_cnt) {
 /* 等待30秒 */
 static bool busy_wait(struct disk* hd) {
    struct ide_channel* channel = hd->my_channel;
-   uint16_t time_limit = 30 * 1000;	     // 可以等待30000毫秒
-   while (time_limit -= 10 >= 0) {
+   int32_t time_limit = 30 * 1000;	     // 可以等待30000毫秒
+   while (time_limit > 0) {
       if (!(inb(reg_status(channel)) & BIT_STAT_BSY)) {
 		return (inb(reg_status(channel)) & BIT_STAT_DRQ);
       } 
 	  else {
-		mtime_sleep(10);		     // 睡眠10毫秒
+		mtime_sleep(10);		     // 睡眠10毫秒,期间阻塞在定时器上,不占cpu
+		time_limit -= 10;
       }
    }
    return false;
@@ -280,7 +281,7 @@ static void identify_disk(struct disk* hd) {
 
 /* 扫描硬盘hd中地址为ext_lba的扇区中的所有分区 */
 static void partition_scan(struct disk* hd, uint32_t ext_lba) {
-   struct boot_sector* bs = sys_malloc(sizeof(struct boot_sector));
+   struct boot_sector* bs = kmalloc_nozero(sizeof(struct boot_sector));
    ide_read(hd, ext_lba, bs, 1);
    uint8_t part_idx = 0;
    struct partition_table_entry* p = bs->partition_table;
@@ -321,7 +322,7 @@ static void partition_scan(struct disk* hd, uint32_t ext_lba) {
       } 
       p++;
    }
-   sys_free(bs);
+   kfree(bs);
 }
 
 /* 打印分区信息 */
@@ -471,4 +472,4 @@ struct boot_sector {
 ###	通道結構、硬碟結構、分區結構 均有一項"往回指"，原因是partition_scan函數每次掃瞄一顆硬碟，所以傳進partition_scan函數的是struct disk hd，
 ###	在partition_scan函數內會進入ide_read函數，ide_read函數會需要去struct ide_channel獲取uint16_t port_base(即0x1fX)，
 ###	有"往回指"才能藉由hd->my_channel->port_base去獲得。
-*/  																					 
\ No newline at end of file
+*/  																					 
\ No newline at end of file
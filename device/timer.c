@@ -9,12 +9,19 @@
 
 #define IRQ0_FREQUENCY	   100
 #define INPUT_FREQUENCY	   1193180
-#define COUNTER0_VALUE	   INPUT_FREQUENCY / IRQ0_FREQUENCY
+#define COUNTER0_VALUE	   (INPUT_FREQUENCY / IRQ0_FREQUENCY)
 #define CONTRER0_PORT	   0x40
 #define COUNTER0_NO	   	   0
 #define COUNTER_MODE	   2
 #define READ_WRITE_LATCH   3
 #define PIT_CONTROL_PORT   0x43
+#define ONESHOT_MODE	   0	// 计数到0时发一次中断,之后不再发
+#define ONESHOT_MAX_TICKS  (0xffff / COUNTER0_VALUE)	// 16位计数器单次最多能跨过的嘀嗒数
+#define CONTRER2_PORT	   0x42
+#define COUNTER2_NO	   	   2
+#define PIT_GATE_PORT	   0x61	// 第0位是计数器2的门控,第1位接扬声器,第5位是计数器2的OUT
+#define CALIBRATE_MS	   10	// 校准tsc时让计数器2数的毫秒数
+#define TSC_SHIFT	   	   22	// 纳秒数 = tsc差值 * tsc_mult >> TSC_SHIFT
 
 //~~~~~~~~~~~~~~~~~~~第13章~~~~~~~~~~~~~~~~~
 #define mil_seconds_per_intr (1000 / IRQ0_FREQUENCY)
@@ -23,6 +30,14 @@
 
 //~~~~~~~~~~~~~~~~~~~第9章c~~~~~~~~~~~~~~~~~
 uint32_t ticks;          // ticks是内核自中断开启以来总共的嘀嗒数
+
+static struct list timer_wheel[TIMER_WHEEL_SLOTS];	 // 第i个槽挂着到期ticks对TIMER_WHEEL_SLOTS取余为i的定时器
+static bool tickless;		 // 8253处于单次触发模式,idle期间不再每个嘀嗒都发中断
+static uint32_t oneshot_ticks;	 // 单次触发要跨过的嘀嗒数
+static uint32_t next_age_tick;	 // 下次老化的ticks,ticks可能一次跳过好几个,不能用取余判断
+static uint32_t tsc_khz;	 // 校准出的tsc频率,0表示没有可用的tsc,只能用ticks计时
+static uint32_t tsc_mult;
+static uint64_t tsc_base;	 // 校准完成时的tsc,作为单调时钟的0点
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
 /* 把操作的计数器counter_no、读写锁属性rwl、计数器模式counter_mode写入模式控制寄存器并赋予初始值counter_value */
@@ -38,7 +53,167 @@ static void frequency_set(uint8_t counter_port, \
    outb(counter_port, (uint8_t)counter_value);
 
 /* 再写入counter_value的高8位 */
-   outb(counter_port, (uint8_t)counter_value >> 8);
+   outb(counter_port, (uint8_t)(counter_value >> 8));
+}
+
+/* 读时间戳计数器 */
+static inline uint64_t rdtsc(void) {
+   uint32_t low, high;
+   asm volatile ("rdtsc" : "=a" (low), "=d" (high));
+   return ((uint64_t)high << 32) | low;
+}
+
+/* 用8253的计数器2数CALIBRATE_MS毫秒,看这段时间tsc走了多少,得出tsc的频率 */
+static void tsc_calibrate(void) {
+   uint32_t eax = 1, ebx, ecx, edx;
+   asm volatile ("cpuid" : "+a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx));
+   if (!(edx & (1 << 4))) {	 // cpuid.1:edx的第4位表示支持rdtsc
+      return;
+   }
+
+   /* 打开计数器2的门控并关掉扬声器,计数器2数到0时OUT变高 */
+   outb(PIT_GATE_PORT, (inb(PIT_GATE_PORT) & ~0x02) | 0x01);
+   frequency_set(CONTRER2_PORT, COUNTER2_NO, READ_WRITE_LATCH, ONESHOT_MODE, INPUT_FREQUENCY / 1000 * CALIBRATE_MS);
+   uint64_t start = rdtsc();
+   while (!(inb(PIT_GATE_PORT) & 0x20));
+   uint64_t cycles = rdtsc() - start;
+
+   tsc_khz = div_u64_rem(cycles, CALIBRATE_MS, NULL);
+   if (tsc_khz < 1000) {	 // 不到1MHz时tsc_mult装不下,也没有意义
+      tsc_khz = 0;
+      return;
+   }
+   tsc_mult = div_u64_rem((uint64_t)1000000 << TSC_SHIFT, tsc_khz, NULL);
+   tsc_base = rdtsc();
+}
+
+/* 返回开机后单调递增的纳秒数.没有tsc时退回以ticks计 */
+uint64_t ktime_ns(void) {
+   if (tsc_khz == 0) {
+      return (uint64_t)ticks * (1000000000 / IRQ0_FREQUENCY);
+   }
+   /* tsc差值按高低32位分开乘,免得乘积超过64位 */
+   uint64_t delta = rdtsc() - tsc_base;
+   return (((uint64_t)(uint32_t)delta * tsc_mult) >> TSC_SHIFT) + \
+          (((uint64_t)(uint32_t)(delta >> 32) * tsc_mult) << (32 - TSC_SHIFT));
+}
+
+/* clock_gettime系统调用,成功返回0,不支持的时钟返回-1 */
+int32_t sys_clock_gettime(uint32_t clock_id, struct timespec* tp) {
+   if (clock_id != CLOCK_MONOTONIC) {
+      return -1;
+   }
+   uint32_t nsec;
+   tp->tv_sec = div_u64_rem(ktime_ns(), 1000000000, &nsec);
+   tp->tv_nsec = nsec;
+   return 0;
+}
+
+/* 初始化定时器t,到期时调用func(arg) */
+void timer_setup(struct timer* t, void (*func)(void*), void* arg) {
+   t->func = func;
+   t->arg = arg;
+   t->pending = false;
+}
+
+/* 让定时器t在ticks到达expires时到期,t不能已在时间轮中 */
+void timer_add(struct timer* t, uint32_t expires) {
+   enum intr_status old_status = intr_disable();
+   ASSERT(!t->pending);
+   if ((int32_t)(expires - ticks) <= 0) {	 // 已过期的放到下一个嘀嗒,否则要等时间轮转一圈
+      expires = ticks + 1;
+   }
+   t->expires = expires;
+   t->pending = true;
+   list_append(&timer_wheel[expires & (TIMER_WHEEL_SLOTS - 1)], &t->timer_tag);
+   intr_set_status(old_status);
+}
+
+/* 取消定时器t,t还未到期时返回true */
+bool timer_del(struct timer* t) {
+   enum intr_status old_status = intr_disable();
+   bool pending = t->pending;
+   if (pending) {
+      list_remove(&t->timer_tag);
+      t->pending = false;
+   }
+   intr_set_status(old_status);
+   return pending;
+}
+
+/* 处理本嘀嗒对应的槽.槽里还有转一圈以上才到期的定时器,只取出已到期的 */
+static void timer_wheel_run(void) {
+   struct list* slot = &timer_wheel[ticks & (TIMER_WHEEL_SLOTS - 1)];
+   struct list_elem* elem = slot->head.next;
+   while (elem != &slot->tail) {
+      struct timer* t = elem2entry(struct timer, timer_tag, elem);
+      elem = elem->next;	 // func可能重新加入t,先取下一个
+      if ((int32_t)(ticks - t->expires) >= 0) {
+	 list_remove(&t->timer_tag);
+	 t->pending = false;
+	 t->func(t->arg);
+      }
+   }
+}
+
+/* 槽中有在tick时或之前到期的定时器时返回true */
+static bool timer_slot_due(uint32_t tick) {
+   struct list* slot = &timer_wheel[tick & (TIMER_WHEEL_SLOTS - 1)];
+   struct list_elem* elem = slot->head.next;
+   while (elem != &slot->tail) {
+      struct timer* t = elem2entry(struct timer, timer_tag, elem);
+      if ((int32_t)(tick - t->expires) >= 0) {
+	 return true;
+      }
+      elem = elem->next;
+   }
+   return false;
+}
+
+/* 锁存并读出计数器0的当前计数值 */
+static uint16_t pit_count_read(void) {
+   outb(PIT_CONTROL_PORT, (uint8_t)(COUNTER0_NO << 6));
+   uint16_t low = inb(CONTRER0_PORT);
+   return low | ((uint16_t)inb(CONTRER0_PORT) << 8);
+}
+
+/* 从单次触发回到每个嘀嗒一次中断的周期模式 */
+static void tick_periodic_restore(void) {
+   frequency_set(CONTRER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, COUNTER_MODE, COUNTER0_VALUE);
+   tickless = false;
+}
+
+/* idle线程在关中断的状态下、hlt之前调用.
+ * 接下来几个嘀嗒都没有定时器到期时,把8253改成单次触发,到最近的到期时刻才来一次中断 */
+void timer_idle_enter(void) {
+   ASSERT(intr_get_status() == INTR_OFF && !tickless);
+   uint32_t delta = 1;
+   while (delta < ONESHOT_MAX_TICKS && !timer_slot_due(ticks + delta)) {
+      delta++;
+   }
+   if (delta <= 1) {
+      return;
+   }
+   oneshot_ticks = delta;
+   tickless = true;
+   frequency_set(CONTRER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, ONESHOT_MODE, delta * COUNTER0_VALUE);
+}
+
+/* idle线程从hlt醒来后调用.若是被别的中断提前唤醒,
+ * 补上已经过去的整嘀嗒数后恢复周期时钟,不足一个嘀嗒的零头舍去 */
+void timer_idle_exit(void) {
+   enum intr_status old_status = intr_disable();
+   if (tickless) {
+      uint32_t programmed = oneshot_ticks * COUNTER0_VALUE;
+      uint32_t count = pit_count_read();
+      if (count > programmed) {	 // 已数到0后回绕,时钟中断还没处理,最后一个嘀嗒留给它
+	 ticks += oneshot_ticks - 1;
+      } else {
+	 ticks += (programmed - count) / COUNTER0_VALUE;
+      }
+      tick_periodic_restore();
+   }
+   intr_set_status(old_status);
 }
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~第9章c~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -48,9 +223,19 @@ static void intr_timer_handler(void) {
 
    ASSERT(cur_thread->stack_magic == 0x19960927); // 检查栈是否溢出
 
-   cur_thread->elapsed_ticks++;	  	// 记录此线程占用的cpu时间嘀
+   if (tickless) {	 // 单次触发到期,补上跨过的嘀嗒,恢复周期时钟
+      ticks += oneshot_ticks - 1;
+      tick_periodic_restore();
+   }
    ticks++;	  						//从内核第一次处理时间中断后开始至今的滴哒数,内核态和用户态总共的嘀哒数
 
+   timer_wheel_run();	 // 到期的定时器在调度之前处理,被唤醒的任务能马上参与调度
+
+   if ((int32_t)(ticks - next_age_tick) >= 0) {	// 定期老化,把降到低级的任务提上来
+      next_age_tick = ticks + MLFQ_AGING_TICKS;
+      thread_age();
+   }
+
    if (cur_thread->ticks == 0) {	// 若进程时间片用完就开始调度新的进程上cpu
       schedule(); 
    } 
@@ -61,13 +246,24 @@ static void intr_timer_handler(void) {
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~第13章~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-// 以tick为单位的sleep,任何时间形式的sleep会转换此ticks形式
+/* 睡眠到期,唤醒睡眠的任务 */
+static void sleep_timeout(void* arg) {
+   thread_unblock((struct task_struct*)arg);
+}
+
+// 以tick为单位的sleep,任何时间形式的sleep会转换此ticks形式.
+// 挂上定时器后阻塞,到期时才被唤醒,睡眠期间不再被调度
 static void ticks_to_sleep(uint32_t sleep_ticks) {
-   uint32_t start_tick = ticks;
+   struct timer t;	 // 在自己的栈上,返回前必须从时间轮摘下
+   timer_setup(&t, sleep_timeout, running_thread());
 
-   while (ticks - start_tick < sleep_ticks) {	   // 若间隔的ticks数不够便让出cpu
-      thread_yield();
-   }
+   /* 关中断直到阻塞,免得定时器在阻塞之前到期 */
+   enum intr_status old_status = intr_disable();
+   timer_add(&t, ticks + sleep_ticks);
+   thread_block(TASK_BLOCKED);
+   /* 若是被别处提前唤醒,定时器还在时间轮上,不摘下的话返回后时间轮会指向已失效的栈帧 */
+   timer_del(&t);
+   intr_set_status(old_status);
 }
 
 // 以毫秒为单位的sleep   1秒= 1000毫秒
@@ -76,6 +272,15 @@ void mtime_sleep(uint32_t m_seconds) {
   ASSERT(sleep_ticks > 0);
   ticks_to_sleep(sleep_ticks); 
 }
+
+/* sleep系统调用,以毫秒为单位,为0时只让出cpu */
+void sys_sleep(uint32_t m_seconds) {
+   if (m_seconds == 0) {
+      thread_yield();
+      return;
+   }
+   mtime_sleep(m_seconds);
+}
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
 /* 初始化PIT8253 */
@@ -83,7 +288,13 @@ void timer_init() {
    put_str("timer_init start\n");
    /* 设置8253的定时周期,也就是发中断的周期 */
    frequency_set(CONTRER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, COUNTER_MODE, COUNTER0_VALUE);
+   tsc_calibrate();
    
+   uint32_t slot;
+   for (slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+      list_init(&timer_wheel[slot]);
+   }
+
    //~~~~~~~~~~~~~~第9章c~~~~~~~~~~~~~~~~
    register_handler(0x20, intr_timer_handler);
    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
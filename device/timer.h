@@ -1,7 +1,49 @@
 #ifndef __DEVICE_TIME_H
 #define __DEVICE_TIME_H
 #include "stdint.h"
+#include "list.h"
+
+#define TIMER_WHEEL_SLOTS 64	 // 时间轮的槽数,须是2的幂
+#define CLOCK_MONOTONIC 1	 // 开机后单调递增的时钟,clock_gettime目前只支持这一种
+
+struct timespec {
+   uint32_t tv_sec;
+   uint32_t tv_nsec;
+};
+
+/* 64位数n除以32位数d,返回商,余数存到rem(可为NULL).
+ * 内核不链接libgcc,64位除法要先除高32位,再用divl除余下的部分 */
+static inline uint64_t div_u64_rem(uint64_t n, uint32_t d, uint32_t* rem) {
+   uint32_t high = n >> 32, low = n, q_low, r;
+   uint32_t q_high = high / d;
+   high %= d;
+   asm ("divl %4" : "=a" (q_low), "=d" (r) : "a" (low), "d" (high), "rm" (d));
+   if (rem != NULL) {
+      *rem = r;
+   }
+   return ((uint64_t)q_high << 32) | q_low;
+}
+
+/* 内核定时器,到期时在时钟中断中以关中断的状态调用func(arg).
+ * 按到期的ticks散列到时间轮的槽中,每个嘀嗒只检查一个槽 */
+struct timer {
+   uint32_t expires;		 // 到期时的ticks
+   void (*func)(void* arg);
+   void* arg;
+   bool pending;		 // 已加入时间轮还未到期
+   struct list_elem timer_tag;	 // 挂在所在槽的链表上
+};
+
+extern uint32_t ticks;
 void timer_init(void);
 void mtime_sleep(uint32_t m_seconds);
+void timer_setup(struct timer* t, void (*func)(void*), void* arg);
+void timer_add(struct timer* t, uint32_t expires);
+bool timer_del(struct timer* t);
+void timer_idle_enter(void);
+void timer_idle_exit(void);
+void sys_sleep(uint32_t m_seconds);
+uint64_t ktime_ns(void);
+int32_t sys_clock_gettime(uint32_t clock_id, struct timespec* tp);
 #endif
 
@@ -12,6 +12,7 @@
 #include "super_block.h"
 
 struct dir root_dir;             // 根目录
+struct kmem_cache dir_cache;
 
 /* 打开根目录 */
 void open_root_dir(struct partition* part) {
@@ -21,7 +22,7 @@ void open_root_dir(struct partition* part) {
 
 /* 在分区part上打开i结点为inode_no的目录并返回目录指针 */
 struct dir* dir_open(struct partition* part, uint32_t inode_no) {
-   struct dir* pdir = (struct dir*)sys_malloc(sizeof(struct dir));
+   struct dir* pdir = (struct dir*)kmem_cache_alloc(&dir_cache);
    pdir->inode = inode_open(part, inode_no);
    pdir->dir_pos = 0;
    return pdir;
@@ -31,12 +32,12 @@ struct dir* dir_open(struct partition* part, uint32_t inode_no) {
  * 找到后返回true并将其目录项存入dir_e,否则返回false */
 bool search_dir_entry(struct partition* part, struct dir* pdir, \
 		     const char* name, struct dir_entry* dir_e) {
-   uint32_t block_cnt = 140;	 // 12个直接块+128个一级间接块=140块
+   uint32_t block_cnt = 12;	 // 有一级间接块表时为12个直接块+128个一级间接块=140块
 
-   /* 12个直接块大小+128个间接块,共560字节 */
-   uint32_t* all_blocks = (uint32_t*)sys_malloc(48 + 512);
+   /* all_blocks取自对象缓存,内容是上个使用者留下的,只看填过的项 */
+   uint32_t* all_blocks = (uint32_t*)kmem_cache_alloc(&blocks_cache);
    if (all_blocks == NULL) {
-      printk("search_dir_entry: sys_malloc for all_blocks failed");
+      printk("search_dir_entry: alloc all_blocks failed");
       return false;
    }
 
@@ -49,12 +50,13 @@ bool search_dir_entry(struct partition* part, struct dir* pdir, \
 
    if (pdir->inode->i_sectors[12] != 0) {	// 若含有一级间接块表
       ide_read(part->my_disk, pdir->inode->i_sectors[12], all_blocks + 12, 1);
+      block_cnt = 140;
    }
 /* 至此,all_blocks存储的是该文件或目录的所有扇区地址 */
 
    /* 写目录项的时候已保证目录项不跨扇区,
     * 这样读目录项时容易处理, 只申请容纳1个扇区的内存 */
-   uint8_t* buf = (uint8_t*)sys_malloc(SECTOR_SIZE);
+   uint8_t* buf = (uint8_t*)kmalloc_nozero(SECTOR_SIZE);	 // 每次都由ide_read整扇区填满,不用清0
    struct dir_entry* p_de = (struct dir_entry*)buf;	    // p_de为指向目录项的指针,值为buf起始地址
    uint32_t dir_entry_size = part->sb->dir_entry_size;
    uint32_t dir_entry_cnt = SECTOR_SIZE / dir_entry_size;   // 1扇区内可容纳的目录项个数
@@ -74,8 +76,8 @@ bool search_dir_entry(struct partition* part, struct dir* pdir, \
 		/* 若找到了,就直接复制整个目录项 */
 		if (!strcmp(p_de->filename, name)) {
 			memcpy(dir_e, p_de, dir_entry_size);
-			sys_free(buf);
-			sys_free(all_blocks);
+			kfree(buf);
+			kmem_cache_free(&blocks_cache, all_blocks);
 			return true;
 		}
 		dir_entry_idx++;
@@ -85,8 +87,8 @@ bool search_dir_entry(struct partition* part, struct dir* pdir, \
       p_de = (struct dir_entry*)buf;  // 此时p_de已经指向扇区内最后一个完整目录项了,需要恢复p_de指向为buf
       memset(buf, 0, SECTOR_SIZE);	  // 将buf清0,下次再用
    }
-   sys_free(buf);
-   sys_free(all_blocks);
+   kfree(buf);
+   kmem_cache_free(&blocks_cache, all_blocks);
    return false;
 }
 
@@ -100,7 +102,7 @@ void dir_close(struct dir* dir) {
       return;
    }
    inode_close(dir->inode);
-   sys_free(dir);
+   kmem_cache_free(&dir_cache, dir);
 }
 
 /* 在内存中初始化目录项p_de */
@@ -116,10 +118,9 @@ void create_dir_entry(char* filename, uint32_t inode_no, uint8_t file_type, stru
 /* 将目录项p_de写入父目录parent_dir中,io_buf由主调函数提供 */
 bool sync_dir_entry(struct dir* parent_dir, struct dir_entry* p_de, void* io_buf) {
    struct inode* dir_inode = parent_dir->inode;
-   uint32_t dir_size = dir_inode->i_size;
    uint32_t dir_entry_size = cur_part->sb->dir_entry_size;
 
-   ASSERT(dir_size % dir_entry_size == 0);	 // dir_size应该是dir_entry_size的整数倍
+   ASSERT(dir_inode->i_size % dir_entry_size == 0);	 // 目录大小应该是dir_entry_size的整数倍
 
    uint32_t dir_entrys_per_sec = (512 / dir_entry_size);       // 每扇区最大的目录项数目
    int32_t block_lba = -1;
@@ -392,7 +393,7 @@ int32_t dir_remove(struct dir* parent_dir, struct dir* child_dir) {
       ASSERT(child_dir_inode->i_sectors[block_idx] == 0);
       block_idx++;
    }
-   void* io_buf = sys_malloc(SECTOR_SIZE * 2);
+   void* io_buf = kmalloc(SECTOR_SIZE * 2);
    if (io_buf == NULL) {
       printk("dir_remove: malloc for io_buf failed\n");
       return -1;
@@ -403,6 +404,6 @@ int32_t dir_remove(struct dir* parent_dir, struct dir* child_dir) {
 
    /* 回收inode中i_secotrs中所占用的扇区,并同步inode_bitmap和block_bitmap */
    inode_release(cur_part, child_dir_inode->i_no);
-   sys_free(io_buf);
+   kfree(io_buf);
    return 0;
-}
\ No newline at end of file
+}
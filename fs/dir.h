@@ -23,6 +23,7 @@ struct dir_entry {
 };
 
 extern struct dir root_dir;             // 根目录
+extern struct kmem_cache dir_cache;	 // dir_open打开的目录都从这里分配
 void open_root_dir(struct partition* part);
 struct dir* dir_open(struct partition* part, uint32_t inode_no);
 void dir_close(struct dir* dir);
@@ -14,6 +14,7 @@
 
 /* 文件表 */
 struct file file_table[MAX_FILE_OPEN];
+struct kmem_cache blocks_cache;
 
 /* 从文件表file_table中获取一个空闲位,成功返回下标,失败返回-1 */
 int32_t get_free_slot_in_global(void) {
@@ -96,9 +97,9 @@ void bitmap_sync(struct partition* part, uint32_t bit_idx, uint8_t btmp_type) {
 /* 创建文件,若成功则返回文件描述符,否则返回-1 */
 int32_t file_create(struct dir* parent_dir, char* filename, uint8_t flag) {
    /* 后续操作的公共缓冲区 */
-   void* io_buf = sys_malloc(1024);
+   void* io_buf = kmalloc(1024);
    if (io_buf == NULL) {
-      printk("in file_creat: sys_malloc for io_buf failed\n");
+      printk("in file_creat: kmalloc for io_buf failed\n");
       return -1;
    }
 
@@ -113,9 +114,9 @@ int32_t file_create(struct dir* parent_dir, char* filename, uint8_t flag) {
 
 /* 此inode要从堆中申请内存,不可生成局部变量(函数退出时会释放)
  * 因为file_table数组中的文件描述符的inode指针要指向它.*/
-   struct inode* new_file_inode = (struct inode*)sys_malloc(sizeof(struct inode)); 
+   struct inode* new_file_inode = (struct inode*)kmem_cache_alloc(&inode_cache); 
    if (new_file_inode == NULL) {
-      printk("file_create: sys_malloc for inode failded\n");
+      printk("file_create: alloc inode failded\n");
       rollback_step = 1;
       goto rollback;
    }
@@ -162,7 +163,7 @@ int32_t file_create(struct dir* parent_dir, char* filename, uint8_t flag) {
    list_push(&cur_part->open_inodes, &new_file_inode->inode_tag);
    new_file_inode->i_open_cnts = 1;
 
-   sys_free(io_buf);
+   kfree(io_buf);
    return pcb_fd_install(fd_idx);
 
 /*创建文件需要创建相关的多个资源,若某步失败则会执行到下面的回滚步骤 */
@@ -172,13 +173,13 @@ rollback:
 		/* 失败时,将file_table中的相应位清空 */
 		memset(&file_table[fd_idx], 0, sizeof(struct file)); 
       case 2:
-		sys_free(new_file_inode);
+		kmem_cache_free(&inode_cache, new_file_inode);
       case 1:
 		/* 如果新文件的i结点创建失败,之前位图中分配的inode_no也要恢复 */
 		bitmap_set(&cur_part->inode_bitmap, inode_no, 0);
 		break;
    }
-   sys_free(io_buf);
+   kfree(io_buf);
    return -1;
 }
 
@@ -229,16 +230,17 @@ int32_t file_write(struct file* file, const void* buf, uint32_t count) {
       printk("exceed max file_size 71680 bytes, write file failed\n");
       return -1;
    }
-   uint8_t* io_buf = sys_malloc(BLOCK_SIZE);
+   uint8_t* io_buf = kmalloc(BLOCK_SIZE);
    if (io_buf == NULL) {
-      printk("file_write: sys_malloc for io_buf failed\n");
+      printk("file_write: kmalloc for io_buf failed\n");
       return -1;
    }
-   uint32_t* all_blocks = (uint32_t*)sys_malloc(BLOCK_SIZE + 48);	  // 用来记录文件所有的块地址
+   uint32_t* all_blocks = (uint32_t*)kmem_cache_alloc(&blocks_cache);	  // 用来记录文件所有的块地址
    if (all_blocks == NULL) {
-      printk("file_write: sys_malloc for all_blocks failed\n");
+      printk("file_write: alloc all_blocks failed\n");
       return -1;
    }
+   memset(all_blocks, 0, ALL_BLOCKS_SIZE);	 // 新建间接块表时会把all_blocks + 12整个写入硬盘,未用的项须为0
 
    const uint8_t* src = buf;	    // 用src指向buf中待写入的数据 
    uint32_t bytes_written = 0;	    // 用来记录已写入数据大小
@@ -411,8 +413,8 @@ int32_t file_write(struct file* file, const void* buf, uint32_t count) {
       size_left -= chunk_size;
    }
    inode_sync(cur_part, file->fd_inode, io_buf);
-   sys_free(all_blocks);
-   sys_free(io_buf);
+   kmem_cache_free(&blocks_cache, all_blocks);
+   kfree(io_buf);
    return bytes_written;
 }
 /*
@@ -455,13 +457,14 @@ int32_t file_read(struct file* file, void* buf, uint32_t count) {
       }
    }
 
-   uint8_t* io_buf = sys_malloc(BLOCK_SIZE);
+   /* io_buf每次都整块读入,all_blocks只会用到下面填过的项,都不必清0 */
+   uint8_t* io_buf = kmalloc_nozero(BLOCK_SIZE);
    if (io_buf == NULL) {
-      printk("file_read: sys_malloc for io_buf failed\n");
+      printk("file_read: kmalloc for io_buf failed\n");
    }
-   uint32_t* all_blocks = (uint32_t*)sys_malloc(BLOCK_SIZE + 48);	  // 用来记录文件所有的块地址
+   uint32_t* all_blocks = (uint32_t*)kmem_cache_alloc(&blocks_cache);	  // 用来记录文件所有的块地址
    if (all_blocks == NULL) {
-      printk("file_read: sys_malloc for all_blocks failed\n");
+      printk("file_read: alloc all_blocks failed\n");
       return -1;
    }
 
@@ -531,7 +534,73 @@ int32_t file_read(struct file* file, void* buf, uint32_t count) {
       bytes_read += chunk_size;
       size_left -= chunk_size;
    }
-   sys_free(all_blocks);
-   sys_free(io_buf);
+   kmem_cache_free(&blocks_cache, all_blocks);
+   kfree(io_buf);
    return bytes_read;
-}
\ No newline at end of file
+}
+
+/* 把buf中的count个字节覆盖写到文件的fd_pos处.与file_write不同,
+ * 只改写文件中已有的内容,超出文件大小的部分丢弃,不分配新块.
+ * 供共享映射把脏页写回文件用,返回写入的字节数,失败返回-1 */
+int32_t file_overwrite(struct file* file, const void* buf, uint32_t count) {
+   struct inode* inode = file->fd_inode;
+   if (file->fd_pos >= inode->i_size) {
+      return 0;
+   }
+   if (file->fd_pos + count > inode->i_size) {
+      count = inode->i_size - file->fd_pos;
+   }
+
+   uint8_t* io_buf = kmalloc_nozero(BLOCK_SIZE);
+   if (io_buf == NULL) {
+      printk("file_overwrite: kmalloc for io_buf failed\n");
+      return -1;
+   }
+   uint32_t* all_blocks = (uint32_t*)kmem_cache_alloc(&blocks_cache);	 // 用来记录文件所有的块地址
+   if (all_blocks == NULL) {
+      printk("file_overwrite: alloc all_blocks failed\n");
+      kfree(io_buf);
+      return -1;
+   }
+
+   /* 只收集要用到的块地址,涉及间接块时才读一级间接块表 */
+   uint32_t block_idx = file->fd_pos / BLOCK_SIZE;
+   uint32_t block_end_idx = (file->fd_pos + count - 1) / BLOCK_SIZE;
+   while (block_idx <= block_end_idx && block_idx < 12) {
+      all_blocks[block_idx] = inode->i_sectors[block_idx];
+      block_idx++;
+   }
+   if (block_end_idx >= 12) {
+      ASSERT(inode->i_sectors[12] != 0);
+      ide_read(cur_part->my_disk, inode->i_sectors[12], all_blocks + 12, 1);
+   }
+
+   const uint8_t* src = buf;
+   uint32_t sec_idx, sec_lba, sec_off_bytes, chunk_size;
+   uint32_t bytes_written = 0;
+   while (bytes_written < count) {
+      sec_idx = file->fd_pos / BLOCK_SIZE;
+      sec_lba = all_blocks[sec_idx];
+      sec_off_bytes = file->fd_pos % BLOCK_SIZE;
+      chunk_size = BLOCK_SIZE - sec_off_bytes;
+      if (chunk_size > count - bytes_written) {
+	 chunk_size = count - bytes_written;
+      }
+
+      if (chunk_size == BLOCK_SIZE) {
+	 ide_write(cur_part->my_disk, sec_lba, (void*)src, 1);	 // 整块直接写
+      } else {
+	 /* 不满一块的先读出来,改好再写回去 */
+	 ide_read(cur_part->my_disk, sec_lba, io_buf, 1);
+	 memcpy(io_buf + sec_off_bytes, src, chunk_size);
+	 ide_write(cur_part->my_disk, sec_lba, io_buf, 1);
+      }
+
+      src += chunk_size;
+      file->fd_pos += chunk_size;
+      bytes_written += chunk_size;
+   }
+   kmem_cache_free(&blocks_cache, all_blocks);
+   kfree(io_buf);
+   return bytes_written;
+}
@@ -27,7 +27,11 @@ enum bitmap_type {
 
 #define MAX_FILE_OPEN 32    // 系统可打开的最大文件数
 
+/* 记录文件所有块地址的all_blocks数组,12个直接块+128个一级间接块,共560字节 */
+#define ALL_BLOCKS_SIZE ((12 + 128) * 4)
+
 extern struct file file_table[MAX_FILE_OPEN];
+extern struct kmem_cache blocks_cache;	 // all_blocks数组都从这里分配
 int32_t inode_bitmap_alloc(struct partition* part);
 int32_t block_bitmap_alloc(struct partition* part);
 int32_t file_create(struct dir* parent_dir, char* filename, uint8_t flag);
@@ -38,4 +42,5 @@ int32_t file_open(uint32_t inode_no, uint8_t flag);
 int32_t file_close(struct file* file);
 int32_t file_write(struct file* file, const void* buf, uint32_t count);
 int32_t file_read(struct file* file, void* buf, uint32_t count);
+int32_t file_overwrite(struct file* file, const void* buf, uint32_t count);
 #endif
@@ -40,10 +40,10 @@ static bool mount_partition(struct list_elem* pelem, int arg) {
       struct disk* hd = cur_part->my_disk;
 
       /* sb_buf用来存储从硬盘上读入的超级块 */
-      struct super_block* sb_buf = (struct super_block*)sys_malloc(SECTOR_SIZE);
+      struct super_block* sb_buf = (struct super_block*)kmalloc_nozero(SECTOR_SIZE);
 
       /* 在内存中创建分区cur_part的超级块 */
-      cur_part->sb = (struct super_block*)sys_malloc(sizeof(struct super_block));
+      cur_part->sb = (struct super_block*)kmalloc(sizeof(struct super_block));
       if (cur_part->sb == NULL) {
 		PANIC("alloc memory failed!");
       }
@@ -56,23 +56,29 @@ static bool mount_partition(struct list_elem* pelem, int arg) {
       memcpy(cur_part->sb, sb_buf, sizeof(struct super_block)); 
 
       /**********     将硬盘上的块位图读入到内存    ****************/
-      cur_part->block_bitmap.bits = (uint8_t*)sys_malloc(sb_buf->block_bitmap_sects * SECTOR_SIZE);
+      uint32_t btmp_bytes_len = sb_buf->block_bitmap_sects * SECTOR_SIZE;
+      /* 位图之后再多申请摘要层的空间 */
+      cur_part->block_bitmap.bits = (uint8_t*)kmalloc(btmp_bytes_len + BITMAP_SUMMARY_BYTES(btmp_bytes_len));
       if (cur_part->block_bitmap.bits == NULL) {
 		PANIC("alloc memory failed!");
       }
-      cur_part->block_bitmap.btmp_bytes_len = sb_buf->block_bitmap_sects * SECTOR_SIZE;
+      cur_part->block_bitmap.btmp_bytes_len = btmp_bytes_len;
       /* 从硬盘上读入块位图到分区的block_bitmap.bits */
       ide_read(hd, sb_buf->block_bitmap_lba, cur_part->block_bitmap.bits, sb_buf->block_bitmap_sects);   
+      /* 位图内容来自硬盘,读入后再建摘要层 */
+      bitmap_attach_summary(&cur_part->block_bitmap, (uint32_t*)(cur_part->block_bitmap.bits + btmp_bytes_len));
       /*************************************************************/
 
       /**********     将硬盘上的inode位图读入到内存    ************/
-      cur_part->inode_bitmap.bits = (uint8_t*)sys_malloc(sb_buf->inode_bitmap_sects * SECTOR_SIZE);
+      btmp_bytes_len = sb_buf->inode_bitmap_sects * SECTOR_SIZE;
+      cur_part->inode_bitmap.bits = (uint8_t*)kmalloc(btmp_bytes_len + BITMAP_SUMMARY_BYTES(btmp_bytes_len));
       if (cur_part->inode_bitmap.bits == NULL) {
 		PANIC("alloc memory failed!");
       }
-      cur_part->inode_bitmap.btmp_bytes_len = sb_buf->inode_bitmap_sects * SECTOR_SIZE;
+      cur_part->inode_bitmap.btmp_bytes_len = btmp_bytes_len;
       /* 从硬盘上读入inode位图到分区的inode_bitmap.bits */
       ide_read(hd, sb_buf->inode_bitmap_lba, cur_part->inode_bitmap.bits, sb_buf->inode_bitmap_sects);   
+      bitmap_attach_summary(&cur_part->inode_bitmap, (uint32_t*)(cur_part->inode_bitmap.bits + btmp_bytes_len));
       /*************************************************************/
 
       list_init(&cur_part->open_inodes);
@@ -156,7 +162,7 @@ static void partition_format(struct partition* part) {
     /* 找出数据量最大的元信息,用其尺寸做存储缓冲区*/
     uint32_t buf_size = (sb.block_bitmap_sects >= sb.inode_bitmap_sects ? sb.block_bitmap_sects : sb.inode_bitmap_sects);
     buf_size = (buf_size >= sb.inode_table_sects ? buf_size : sb.inode_table_sects) * SECTOR_SIZE;
-    uint8_t* buf = (uint8_t*)sys_malloc(buf_size);	// 申请的内存由内存管理系统清0后返回
+    uint8_t* buf = (uint8_t*)kmalloc(buf_size);	// 申请的内存由内存管理系统清0后返回
 
     /**************************************
      * 2 将块位图初始化并写入sb.block_bitmap_lba *
@@ -227,7 +233,7 @@ static void partition_format(struct partition* part) {
 
     printk("   root_dir_lba:0x%x\n", sb.data_start_lba);
     printk("%s format done\n", part->name); //##該扇區的名字
-    sys_free(buf);
+    kfree(buf);
 }
 
 //~~~~~~~~~~~~~~~~~~~~~第14章c~~~~~~~~~~~~~~~~~~~~~
@@ -278,9 +284,8 @@ static int search_file(const char* pathname, struct path_search_record* searched
       return 0;
    }
 
-   uint32_t path_len = strlen(pathname);
    /* 保证pathname至少是这样的路径/x且小于最大长度 */
-   ASSERT(pathname[0] == '/' && path_len > 1 && path_len < MAX_PATH_LEN);
+   ASSERT(pathname[0] == '/' && strlen(pathname) > 1 && strlen(pathname) < MAX_PATH_LEN);
    char* sub_path = (char*)pathname;
    struct dir* parent_dir = &root_dir;	
    struct dir_entry dir_e;
@@ -555,7 +560,7 @@ int32_t sys_unlink(const char* pathname) {
    ASSERT(file_idx == MAX_FILE_OPEN);
    
    /* 为delete_dir_entry申请缓冲区 */
-   void* io_buf = sys_malloc(SECTOR_SIZE + SECTOR_SIZE);
+   void* io_buf = kmalloc(SECTOR_SIZE + SECTOR_SIZE);
    if (io_buf == NULL) {
       dir_close(searched_record.parent_dir);
       printk("sys_unlink: malloc for io_buf failed\n");
@@ -565,7 +570,7 @@ int32_t sys_unlink(const char* pathname) {
    struct dir* parent_dir = searched_record.parent_dir;  
    delete_dir_entry(cur_part, parent_dir, inode_no, io_buf);
    inode_release(cur_part, inode_no);
-   sys_free(io_buf);
+   kfree(io_buf);
    dir_close(searched_record.parent_dir);
    return 0;   // 成功删除文件 
 }
@@ -574,9 +579,9 @@ int32_t sys_unlink(const char* pathname) {
 /* 创建目录pathname,成功返回0,失败返回-1 */
 int32_t sys_mkdir(const char* pathname) {
    uint8_t rollback_step = 0;	       // 用于操作失败时回滚各资源状态
-   void* io_buf = sys_malloc(SECTOR_SIZE * 2);
+   void* io_buf = kmalloc(SECTOR_SIZE * 2);
    if (io_buf == NULL) {
-      printk("sys_mkdir: sys_malloc for io_buf failed\n");
+      printk("sys_mkdir: kmalloc for io_buf failed\n");
       return -1;
    }
 
@@ -668,7 +673,7 @@ int32_t sys_mkdir(const char* pathname) {
    /* 将inode位图同步到硬盘 */
    bitmap_sync(cur_part, inode_no, INODE_BITMAP);
 
-   sys_free(io_buf);
+   kfree(io_buf);
 
    /* 关闭所创建目录的父目录 */
    dir_close(searched_record.parent_dir);
@@ -684,7 +689,7 @@ rollback:	     // 因为某步骤操作失败而回滚
 		dir_close(searched_record.parent_dir);
 		break;
    }
-   sys_free(io_buf);
+   kfree(io_buf);
    return -1;
 }
 
@@ -830,7 +835,7 @@ char* sys_getcwd(char* buf, uint32_t size) {
    /* 确保buf不为空,若用户进程提供的buf为NULL,
    系统调用getcwd中要为用户进程通过malloc分配内存 */
    ASSERT(buf != NULL);
-   void* io_buf = sys_malloc(SECTOR_SIZE);
+   void* io_buf = kmalloc(SECTOR_SIZE);
    if (io_buf == NULL) {
       return NULL;
    }
@@ -855,7 +860,7 @@ char* sys_getcwd(char* buf, uint32_t size) {
    while ((child_inode_nr)) {
       parent_inode_nr = get_parent_dir_inode_nr(child_inode_nr, io_buf);
       if (get_child_dir_name(parent_inode_nr, child_inode_nr, full_path_reverse, io_buf) == -1) {	  // 或未找到名字,失败退出
-		sys_free(io_buf);
+		kfree(io_buf);
 		return NULL;
       }
       child_inode_nr = parent_inode_nr;
@@ -871,7 +876,7 @@ char* sys_getcwd(char* buf, uint32_t size) {
       /* 在full_path_reverse中添加结束字符,做为下一次执行strcpy中last_slash的边界 */
       *last_slash = 0;
    }
-   sys_free(io_buf);
+   kfree(io_buf);
    return buf;
 }
 
@@ -933,8 +938,13 @@ void sys_putchar(char char_asci) {
 void filesys_init() {
     uint8_t channel_no = 0, dev_no, part_idx = 0;
 
+    /* 文件系统中频繁申请释放的定长对象走各自的对象缓存 */
+    kmem_cache_init(&inode_cache, "inode", sizeof(struct inode), NULL);
+    kmem_cache_init(&dir_cache, "dir", sizeof(struct dir), NULL);
+    kmem_cache_init(&blocks_cache, "all_blocks", ALL_BLOCKS_SIZE, NULL);
+
     /* sb_buf用来存储从硬盘上读入的超级块 */
-    struct super_block* sb_buf = (struct super_block*)sys_malloc(SECTOR_SIZE);
+    struct super_block* sb_buf = (struct super_block*)kmalloc(SECTOR_SIZE);
 
     if (sb_buf == NULL) {
         PANIC("alloc memory failed!");
@@ -979,7 +989,7 @@ void filesys_init() {
         }
         channel_no++;	// 下一通道
     }
-    sys_free(sb_buf);
+    kfree(sb_buf);
 	
 //~~~~~~~~~~~~~~~~~~~~~~~第14章b~~~~~~~~~~~~~~~~~~~~~~~~~
 	/* 确定默认操作的分区 */
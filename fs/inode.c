@@ -10,6 +10,8 @@
 #include "string.h"
 #include "super_block.h"
 
+struct kmem_cache inode_cache;
+
 /* 用来存储inode位置 */
 struct inode_position {
    bool	 two_sec;	// inode是否跨扇区
@@ -93,26 +95,19 @@ struct inode* inode_open(struct partition* part, uint32_t inode_no) {
    /* inode位置信息会存入inode_pos, 包括inode所在扇区地址和扇区内的字节偏移量 */
    inode_locate(part, inode_no, &inode_pos);
 
-/* 为使通过sys_malloc创建的新inode被所有任务共享,
- * 需要将inode置于内核空间,故需要临时
- * 将cur_pbc->pgdir置为NULL */
-   struct task_struct* cur = running_thread();
-   uint32_t* cur_pagedir_bak = cur->pgdir;
-   cur->pgdir = NULL;
-   /* 以上三行代码完成后下面分配的内存将位于内核区 */
-   inode_found = (struct inode*)sys_malloc(sizeof(struct inode));
-   /* 恢复pgdir */
-   cur->pgdir = cur_pagedir_bak;
+   /* 新inode要被所有任务共享,从内核的inode对象缓存中分配.
+    * 下面会用硬盘上的内容整个覆盖它,不需要清0 */
+   inode_found = (struct inode*)kmem_cache_alloc(&inode_cache);
 
    char* inode_buf;
    if (inode_pos.two_sec) {	// 考虑跨扇区的情况
-      inode_buf = (char*)sys_malloc(1024);
+      inode_buf = (char*)kmalloc_nozero(1024);
 
    /* i结点表是被partition_format函数连续写入扇区的,
     * 所以下面可以连续读出来 */
       ide_read(part->my_disk, inode_pos.sec_lba, inode_buf, 2);
    } else {	// 否则,所查找的inode未跨扇区,一个扇区大小的缓冲区足够
-      inode_buf = (char*)sys_malloc(512);
+      inode_buf = (char*)kmalloc_nozero(512);
       ide_read(part->my_disk, inode_pos.sec_lba, inode_buf, 1);
    }
    memcpy(inode_found, inode_buf + inode_pos.off_size, sizeof(struct inode));
@@ -121,7 +116,7 @@ struct inode* inode_open(struct partition* part, uint32_t inode_no) {
    list_push(&part->open_inodes, &inode_found->inode_tag);
    inode_found->i_open_cnts = 1;
 
-   sys_free(inode_buf);
+   kfree(inode_buf);
    return inode_found;
 }
 
@@ -131,14 +126,7 @@ void inode_close(struct inode* inode) {
    enum intr_status old_status = intr_disable();
    if (--inode->i_open_cnts == 0) {
       list_remove(&inode->inode_tag);	  // 将I结点从part->open_inodes中去掉
-   /* inode_open时为实现inode被所有进程共享,
-    * 已经在sys_malloc为inode分配了内核空间,
-    * 释放inode时也要确保释放的是内核内存池 */
-      struct task_struct* cur = running_thread();
-      uint32_t* cur_pagedir_bak = cur->pgdir;
-      cur->pgdir = NULL;
-      sys_free(inode);
-      cur->pgdir = cur_pagedir_bak;
+      kmem_cache_free(&inode_cache, inode);
    }
    intr_set_status(old_status);
 }
@@ -218,9 +206,9 @@ void inode_release(struct partition* part, uint32_t inode_no) {
    * 此函数会在inode_table中将此inode清0,
    * 但实际上是不需要的,inode分配是由inode位图控制的,
    * 硬盘上的数据不需要清0,可以直接覆盖*/
-   void* io_buf = sys_malloc(1024);
+   void* io_buf = kmalloc(1024);
    inode_delete(part, inode_no, io_buf);
-   sys_free(io_buf);
+   kfree(io_buf);
    /***********************************************/
     
    inode_close(inode_to_del);
@@ -3,6 +3,7 @@
 #include "stdint.h"
 #include "list.h"
 #include "ide.h"
+#include "kmem_cache.h"
 
 /* inode结构 */
 struct inode {
@@ -20,6 +21,8 @@ struct inode {
    struct list_elem inode_tag;
 };
 
+extern struct kmem_cache inode_cache;	 // 内存中的inode都从这里分配
+
 struct inode* inode_open(struct partition* part, uint32_t inode_no);
 void inode_sync(struct partition* part, struct inode* inode, void* io_buf);
 void inode_init(uint32_t inode_no, struct inode* new_inode);
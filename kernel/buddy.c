@@ -0,0 +1,126 @@
+#include "buddy.h"
+#include "stdint.h"
+#include "global.h"
+#include "debug.h"
+#include "interrupt.h"
+#include "list.h"
+#include "bitmap.h"
+
+struct page* mem_map;	 // 物理页框描述符数组,由mem_init分配
+
+/* 返回能容纳pg_cnt个页框的最小阶 */
+uint32_t pages2order(uint32_t pg_cnt) {
+   return pg_cnt <= 1 ? 0 : bsr(pg_cnt - 1) + 1;
+}
+
+/* 将以块内序号idx开始的2^order个页框作为空闲块挂到对应阶的链表上 */
+static void free_area_add(struct buddy* bd, uint32_t idx, uint32_t order) {
+   struct page* pg = pfn2page(bd->pfn_start + idx);
+   pg->flags |= PG_BUDDY;
+   pg->order = order;
+   list_append(&bd->free_area[order].free_list, &pg->free_elem);
+   bd->free_area[order].nr_free++;
+}
+
+/* 将空闲块pg从所在阶的链表上摘下 */
+static void free_area_del(struct buddy* bd, struct page* pg) {
+   list_remove(&pg->free_elem);
+   bd->free_area[pg->order].nr_free--;
+   pg->flags &= ~PG_BUDDY;
+}
+
+/* 初始化管理[pfn_start, pfn_start + page_cnt)的伙伴系统,此时没有空闲块,
+ * 范围内实际可用的页框再用buddy_free_range加进来,其余的就是空洞 */
+void buddy_init(struct buddy* bd, uint32_t pfn_start, uint32_t page_cnt) {
+   bd->pfn_start = pfn_start;
+   bd->page_cnt = page_cnt;
+   bd->free_pages = 0;
+
+   uint32_t order;
+   for (order = 0; order < MAX_ORDER; order++) {
+      list_init(&bd->free_area[order].free_list);
+      bd->free_area[order].nr_free = 0;
+   }
+
+   uint32_t idx;
+   for (idx = 0; idx < page_cnt; idx++) {
+      struct page* pg = pfn2page(pfn_start + idx);
+      pg->order = 0;
+      pg->flags = 0;
+      pg->ref_cnt = 0;
+   }
+}
+
+/* 把[pfn, pfn + cnt)作为空闲页框加入伙伴系统,按对齐切成尽量大的块 */
+void buddy_free_range(struct buddy* bd, uint32_t pfn, uint32_t cnt) {
+   ASSERT(pfn >= bd->pfn_start && pfn + cnt <= bd->pfn_start + bd->page_cnt);
+   uint32_t idx = pfn - bd->pfn_start, end = idx + cnt;
+   while (idx < end) {
+      uint32_t order = MAX_ORDER - 1;
+      /* 块首须按块大小对齐,且不能超出给定的范围 */
+      while ((idx & ((1U << order) - 1)) || idx + (1U << order) > end) {
+	 order--;
+      }
+      buddy_free(bd, bd->pfn_start + idx, order);	 // 与相邻范围里已加入的块能合并就合并
+      idx += 1U << order;
+   }
+}
+
+/* 分配2^order个连续页框,成功返回首页框号,失败返回-1 */
+int32_t buddy_alloc(struct buddy* bd, uint32_t order) {
+   ASSERT(order < MAX_ORDER);
+   enum intr_status old_status = intr_disable();
+
+   /* 找到不小于order的最小非空阶 */
+   uint32_t cur_order = order;
+   while (cur_order < MAX_ORDER && list_empty(&bd->free_area[cur_order].free_list)) {
+      cur_order++;
+   }
+   if (cur_order == MAX_ORDER) {
+      intr_set_status(old_status);
+      return -1;
+   }
+
+   struct page* pg = elem2entry(struct page, free_elem, bd->free_area[cur_order].free_list.head.next);
+   free_area_del(bd, pg);
+   uint32_t idx = page2pfn(pg) - bd->pfn_start;
+
+   /* 大块逐级对半拆分,后一半还回低一阶的链表 */
+   while (cur_order > order) {
+      cur_order--;
+      free_area_add(bd, idx + (1U << cur_order), cur_order);
+   }
+   pg->order = order;
+   bd->free_pages -= 1U << order;
+
+   intr_set_status(old_status);
+   return bd->pfn_start + idx;
+}
+
+/* 回收以pfn开始的2^order个页框,并尽可能与伙伴合并 */
+void buddy_free(struct buddy* bd, uint32_t pfn, uint32_t order) {
+   ASSERT(pfn >= bd->pfn_start && pfn + (1U << order) <= bd->pfn_start + bd->page_cnt);
+   enum intr_status old_status = intr_disable();
+
+   ASSERT(!(pfn2page(pfn)->flags & PG_BUDDY));	 // 防止重复释放
+   bd->free_pages += 1U << order;
+
+   uint32_t idx = pfn - bd->pfn_start;
+   while (order < MAX_ORDER - 1) {
+      uint32_t buddy_idx = idx ^ (1U << order);
+      if (buddy_idx + (1U << order) > bd->page_cnt) {
+	 break;
+      }
+      struct page* buddy = pfn2page(bd->pfn_start + buddy_idx);
+      /* 伙伴不空闲或已被拆成更小的块就不能合并 */
+      if (!(buddy->flags & PG_BUDDY) || buddy->order != order) {
+	 break;
+      }
+      free_area_del(bd, buddy);
+      idx &= ~(1U << order);
+      order++;
+   }
+   free_area_add(bd, idx, order);
+
+   intr_set_status(old_status);
+}
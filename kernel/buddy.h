@@ -0,0 +1,45 @@
+#ifndef __KERNEL_BUDDY_H
+#define __KERNEL_BUDDY_H
+#include "stdint.h"
+#include "list.h"
+
+#define MAX_ORDER 11	   // 最大块为2^10页,即4M
+
+/* page.flags */
+#define PG_BUDDY   1	   // 此页是伙伴系统中某空闲块的首页
+#define PG_ZEROED  2	   // 此页已由idle线程清0,挂在zero_list上或刚从上面取下
+#define PG_USER    4	   // 已分配的页框记在user_pool名下,否则记在kernel_pool名下
+
+/* 物理页框描述符,每个物理页框一个,按页框号(pfn)索引mem_map */
+struct page {
+   struct list_elem free_elem;	 // 空闲时挂在free_area[order].free_list上
+   uint8_t order;		 // 空闲块的阶,仅对块首页有效
+   uint8_t flags;
+   uint16_t ref_cnt;		 // 写时复制时共享此页框的额外映射数,0表示只有一处映射
+   void* private;		 // 使用者的私有数据,堆中的页框用它指向所在arena
+};
+
+/* 某一阶的空闲块链表 */
+struct free_area {
+   struct list free_list;
+   uint32_t nr_free;		 // 本阶空闲块数
+};
+
+/* 伙伴系统,管理从pfn_start开始的page_cnt个连续页框 */
+struct buddy {
+   uint32_t pfn_start;
+   uint32_t page_cnt;		 // 管理范围的页框数,含空洞
+   uint32_t free_pages;		 // 空闲页框总数
+   struct free_area free_area[MAX_ORDER];
+};
+
+extern struct page* mem_map;
+#define pfn2page(pfn)   (&mem_map[(pfn)])
+#define page2pfn(pg)    ((uint32_t)((pg) - mem_map))
+
+void buddy_init(struct buddy* bd, uint32_t pfn_start, uint32_t page_cnt);
+int32_t buddy_alloc(struct buddy* bd, uint32_t order);
+void buddy_free(struct buddy* bd, uint32_t pfn, uint32_t order);
+void buddy_free_range(struct buddy* bd, uint32_t pfn, uint32_t cnt);
+uint32_t pages2order(uint32_t pg_cnt);
+#endif
@@ -0,0 +1,187 @@
+#include "kmem_cache.h"
+#include "stdint.h"
+#include "global.h"
+#include "debug.h"
+#include "interrupt.h"
+#include "memory.h"
+#include "string.h"
+#include "list.h"
+#include "fs.h"
+#include "file.h"
+#include "stdio.h"
+
+#define SLAB_FREE_END 0xffff	 // 空闲链表结束标记
+
+/* slab头,位于slab页的开头,其后紧跟next数组,再后面才是对象 */
+struct kmem_slab {
+   struct list_elem slab_tag;	 // 挂在所属cache的partial/full/empty链表上
+   struct kmem_cache* cache;
+   uint16_t free_idx;		 // 第一个空闲对象的序号
+   uint16_t inuse;		 // 已分配出去的对象数
+   uint16_t next[0];		 // next[i]为序号i的空闲对象之后下一个空闲对象的序号
+};
+
+static struct kmem_cache* caches[KMEM_CACHE_MAX];	 // 已建的对象缓存,供统计用
+static uint32_t cache_cnt;
+
+static void* slab_obj(struct kmem_cache* cache, struct kmem_slab* slab, uint32_t idx) {
+   return (uint8_t*)slab + cache->obj_offset + idx * cache->obj_size;
+}
+
+/* 初始化对象缓存cache,每个对象obj_size字节,ctor为对象构造函数,可为NULL */
+void kmem_cache_init(struct kmem_cache* cache, char* name, uint32_t obj_size, void (*ctor)(void*)) {
+   ASSERT(cache_cnt < KMEM_CACHE_MAX);
+   cache->name = name;
+   cache->obj_size = (obj_size + 3) & ~3;
+   ASSERT(cache->obj_size <= PG_SIZE / 4);	 // 太大的对象一页放不下几个,不如直接用kmalloc
+
+   /* 每个对象还要在next数组中占2字节,先粗算再逐个减到放得下为止 */
+   uint32_t objs = (PG_SIZE - sizeof(struct kmem_slab)) / (cache->obj_size + sizeof(uint16_t));
+   while (((sizeof(struct kmem_slab) + objs * sizeof(uint16_t) + 3) & ~3) + objs * cache->obj_size > PG_SIZE) {
+      objs--;
+   }
+   cache->objs_per_slab = objs;
+   cache->obj_offset = (sizeof(struct kmem_slab) + objs * sizeof(uint16_t) + 3) & ~3;
+   cache->ctor = ctor;
+
+   list_init(&cache->partial_list);
+   list_init(&cache->full_list);
+   list_init(&cache->empty_list);
+   cache->empty_cnt = 0;
+   cache->slab_cnt = 0;
+   cache->active_objs = 0;
+   cache->alloc_cnt = 0;
+   cache->grow_cnt = 0;
+   caches[cache_cnt++] = cache;
+}
+
+/* 为cache新建一个slab,所有对象串成空闲链表并各构造一次,失败返回NULL */
+static struct kmem_slab* slab_create(struct kmem_cache* cache) {
+   struct kmem_slab* slab = get_kernel_pages(1);
+   if (slab == NULL) {
+      return NULL;
+   }
+   slab->cache = cache;
+   slab->free_idx = 0;
+   slab->inuse = 0;
+
+   uint32_t idx;
+   for (idx = 0; idx < cache->objs_per_slab; idx++) {
+      slab->next[idx] = idx + 1 < cache->objs_per_slab ? idx + 1 : SLAB_FREE_END;
+      if (cache->ctor != NULL) {
+	 cache->ctor(slab_obj(cache, slab, idx));
+      }
+   }
+   return slab;
+}
+
+/* 从cache中分配一个对象,对象保持构造后或上次释放时的状态,失败返回NULL */
+void* kmem_cache_alloc(struct kmem_cache* cache) {
+   enum intr_status old_status = intr_disable();
+
+   /* 没有空闲对象时新建slab,申请页框可能阻塞,要放到关中断之外 */
+   if (list_empty(&cache->partial_list) && list_empty(&cache->empty_list)) {
+      intr_set_status(old_status);
+      struct kmem_slab* new_slab = slab_create(cache);
+      if (new_slab == NULL) {
+	 return NULL;
+      }
+      old_status = intr_disable();
+      list_push(&cache->empty_list, &new_slab->slab_tag);
+      cache->empty_cnt++;
+      cache->slab_cnt++;
+      cache->grow_cnt++;
+   }
+
+   /* 优先用部分已分配的slab,让空slab有机会被归还 */
+   struct list_elem* elem;
+   if (!list_empty(&cache->partial_list)) {
+      elem = cache->partial_list.head.next;
+   } else {
+      elem = cache->empty_list.head.next;
+      cache->empty_cnt--;
+   }
+   struct kmem_slab* slab = elem2entry(struct kmem_slab, slab_tag, elem);
+   ASSERT(slab->free_idx != SLAB_FREE_END);
+
+   void* obj = slab_obj(cache, slab, slab->free_idx);
+   slab->free_idx = slab->next[slab->free_idx];
+   slab->inuse++;
+   list_remove(&slab->slab_tag);
+   if (slab->inuse == cache->objs_per_slab) {
+      list_push(&cache->full_list, &slab->slab_tag);
+   } else {
+      list_push(&cache->partial_list, &slab->slab_tag);
+   }
+   cache->active_objs++;
+   cache->alloc_cnt++;
+
+   intr_set_status(old_status);
+   return obj;
+}
+
+/* 把obj还给cache,调用者应保证obj处于可以直接再分配出去的状态 */
+void kmem_cache_free(struct kmem_cache* cache, void* obj) {
+   struct kmem_slab* slab = (struct kmem_slab*)((uint32_t)obj & 0xfffff000);
+   ASSERT(slab->cache == cache);
+   uint32_t idx = ((uint32_t)obj - (uint32_t)slab - cache->obj_offset) / cache->obj_size;
+   ASSERT(idx < cache->objs_per_slab);
+   bool release = false;
+
+   enum intr_status old_status = intr_disable();
+   slab->next[idx] = slab->free_idx;
+   slab->free_idx = idx;
+   slab->inuse--;
+   cache->active_objs--;
+   list_remove(&slab->slab_tag);
+   if (slab->inuse > 0) {
+      list_push(&cache->partial_list, &slab->slab_tag);
+   } else if (cache->empty_cnt < KMEM_EMPTY_SLABS) {
+      list_push(&cache->empty_list, &slab->slab_tag);
+      cache->empty_cnt++;
+   } else {
+      cache->slab_cnt--;
+      release = true;
+   }
+   intr_set_status(old_status);
+
+   if (release) {
+      mfree_page(PF_KERNEL, slab, 1);
+   }
+}
+
+/* 用空格把buf补齐到width宽 */
+static void pad_to(char* buf, uint32_t width) {
+   uint32_t len = strlen(buf);
+   while (len < width) {
+      buf[len++] = ' ';
+   }
+   buf[len] = 0;
+}
+
+/* 打印各对象缓存的使用情况,GROWS是新建slab的次数,
+ * ALLOCS与GROWS相差越大,说明分配越多地直接复用了缓存中的对象 */
+void kmem_cache_info_print(void) {
+   char* head = "object caches:\nNAME        SIZE   PER    SLABS  ACTIVE ALLOCS GROWS\n";
+   sys_write(stdout_no, head, strlen(head));
+
+   char buf[64];
+   uint32_t cache_idx;
+   for (cache_idx = 0; cache_idx < cache_cnt; cache_idx++) {
+      struct kmem_cache* cache = caches[cache_idx];
+      strcpy(buf, cache->name);
+      pad_to(buf, 12);
+      sprintf(buf + strlen(buf), "%d", cache->obj_size);
+      pad_to(buf, 19);
+      sprintf(buf + strlen(buf), "%d", cache->objs_per_slab);
+      pad_to(buf, 26);
+      sprintf(buf + strlen(buf), "%d", cache->slab_cnt);
+      pad_to(buf, 33);
+      sprintf(buf + strlen(buf), "%d", cache->active_objs);
+      pad_to(buf, 40);
+      sprintf(buf + strlen(buf), "%d", cache->alloc_cnt);
+      pad_to(buf, 47);
+      sprintf(buf + strlen(buf), "%d\n", cache->grow_cnt);
+      sys_write(stdout_no, buf, strlen(buf));
+   }
+}
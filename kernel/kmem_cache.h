@@ -0,0 +1,33 @@
+#ifndef __KERNEL_KMEM_CACHE_H
+#define __KERNEL_KMEM_CACHE_H
+#include "stdint.h"
+#include "list.h"
+
+#define KMEM_CACHE_MAX 8	 // 最多可建的对象缓存数
+#define KMEM_EMPTY_SLABS 1	 // 每个对象缓存最多保留的空slab数
+
+/* 对象缓存,专门分配某一种定长对象.
+ * 对象按页成批切好放在slab里,每个slab占一页,页首是slab头和空闲链表.
+ * 空闲链表不占用对象本身的空间,所以对象释放后保持上一个使用者留下的状态,
+ * 再分配时不清0也不重新构造,只在slab新建时对每个对象调用一次ctor */
+struct kmem_cache {
+   char* name;
+   uint32_t obj_size;		 // 对象大小,按4字节对齐
+   uint32_t objs_per_slab;	 // 每个slab可容纳的对象数
+   uint32_t obj_offset;		 // 第一个对象在slab页内的偏移
+   void (*ctor)(void* obj);	 // 对象构造函数,可为NULL
+   struct list partial_list;	 // 部分对象已分配的slab
+   struct list full_list;	 // 对象已全部分配出去的slab
+   struct list empty_list;	 // 对象全部空闲、暂不归还的slab
+   uint32_t empty_cnt;		 // empty_list上的slab数
+   uint32_t slab_cnt;		 // slab总数
+   uint32_t active_objs;	 // 已分配出去的对象数
+   uint32_t alloc_cnt;		 // 累计分配次数
+   uint32_t grow_cnt;		 // 累计因没有空闲对象而新建slab的次数
+};
+
+void kmem_cache_init(struct kmem_cache* cache, char* name, uint32_t obj_size, void (*ctor)(void*));
+void* kmem_cache_alloc(struct kmem_cache* cache);
+void kmem_cache_free(struct kmem_cache* cache, void* obj);
+void kmem_cache_info_print(void);
+#endif
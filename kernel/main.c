@@ -15,6 +15,8 @@
 
 #include "ide.h"
 #include "stdio-kernel.h"
+#include "exec.h"
+#include "selftest.h"
 
 void init(void);
 
@@ -23,10 +25,15 @@ int main(void) {
    init_all();
 
 /*************    写入应用程序    *************/
-   uint32_t file_size = 14452;
-   uint32_t sec_cnt = DIV_ROUND_UP(file_size, 512);
    struct disk* sda = &channels[0].devices[0];
-   void* prog_buf = sys_malloc(file_size);
+   /* 程序大小不再写死,从elf头算出:ld把节头表放在文件末尾,
+    * 所以节头表的结束处就是文件的大小 */
+   struct Elf32_Ehdr* elf_header = kmalloc(SECTOR_SIZE);
+   ide_read(sda, 300, elf_header, 1);
+   uint32_t file_size = elf_header->e_shoff + elf_header->e_shentsize * elf_header->e_shnum;
+   kfree(elf_header);
+   uint32_t sec_cnt = DIV_ROUND_UP(file_size, SECTOR_SIZE);
+   void* prog_buf = kmalloc(sec_cnt * SECTOR_SIZE);
    ide_read(sda, 300, prog_buf, sec_cnt);
    int32_t fd = sys_open("/prog_no_arg", O_CREAT|O_RDWR);
    if (fd != -1) {
@@ -37,6 +44,9 @@ int main(void) {
    }
 /*************    写入应用程序结束   *************/
    cls_screen();
+#ifdef SELFTEST
+   selftest_run();
+#endif
    console_put_str("[KimWeng@localhost /]$ ");
    while(1);
    return 0;
@@ -46,9 +56,13 @@ int main(void) {
 void init(void) {
    uint32_t ret_pid = fork();
    if(ret_pid) {  // 父进程
-      while(1);
+      /* init不断回收自己的子进程和过继来的孤儿进程 */
+      int32_t status;
+      while(1) {
+	 wait(&status);
+      }
    } else {	  // 子进程
       my_shell();
    }
    panic("init: should not be here");
-}
\ No newline at end of file
+}
\ No newline at end of file
@@ -7,34 +7,66 @@
 #include "string.h"
 #include "sync.h"
 #include "interrupt.h"
+#include "buddy.h"
+#include "kmem_cache.h"
+#include "fs.h"
+#include "file.h"
+#include "stdio.h"
+#include "vma.h"
+#include "wait_exit.h"
 
 //#define PG_SIZE 4096 ##已定義在global.h
 
 /***************  位图地址 ********************
 * 因为0xc009f000是内核主线程栈顶，0xc009e000是内核主线程的pcb.
-* 一个页框大小的位图可表示128M内存, 位图位置安排在地址0xc009a000,
-* 这样本系统最大支持4个页框的位图,即512M */
+* 位图位置安排在地址0xc009a000,最多4个页框.
+* 物理页框由伙伴系统管理,这里只放内核虚拟地址池的位图,大小与物理内存多少无关 */
 #define MEM_BITMAP_BASE 0xc009a000
 /*************************************/
 
+/* loader.S在0xb00处存下total_mem_bytes,其后依次是6字节的gdt_ptr、
+ * 最多ARDS_MAX个E820内存布局结构ards_buf和2字节的ards_nr */
+#define ARDS_BUF_ADDR 0xb0a
+#define ARDS_NR_ADDR  0xbfe
+#define ARDS_MAX      12
+#define ARDS_USABLE   1	   // 可被操作系统使用的内存
+
 #define PDE_IDX(addr) ((addr & 0xffc00000) >> 22)
 #define PTE_IDX(addr) ((addr & 0x003ff000) >> 12)
 
 /* 0xc0000000是内核从虚拟地址3G起. 0x100000意指跨过低端1M内存,使虚拟地址在逻辑上连续 */
 #define K_HEAP_START 0xc0100000
 
+/* 内核虚拟地址池紧接在线性映射区之后,用4K页映射,供需要单独映射的页使用,共64M */
+#define K_VADDR_POOL_SIZE 0x4000000
+
+#define KMAP_SLOTS 8
+
 
 
 //#################################################################################################################################
-/* 内存池结构,生成两个实例用于管理内核内存池和用户内存池 */
+/* 所有空闲物理页框由一个伙伴系统统一管理,内核和用户的分配都从这里取,
+ * 哪边用得多哪边就多占,不再事先对半分死 */
+struct frame_area {
+    struct buddy buddy;		 		// 线性映射区内的页框,内核和用户都可用
+    struct buddy high_buddy;	 		// 线性映射区以上的页框,内核够不着,只分给用户进程
+    uint32_t total_pages;	 		// 两个伙伴系统中实际可用的页框数,不含空洞
+    struct list zero_list;		 	// idle时预先清0的空闲页框,已从伙伴系统中取出
+    uint32_t zero_cnt;		 		// zero_list上的页框数
+    uint32_t low_watermark;	 		// 空闲页框少于此数时才执行各内存池的软上限
+};
+
+/* 内存池结构,生成两个实例,分别记内核和用户占用的页框数,页框本身都来自frames */
 struct pool {
-    struct bitmap pool_bitmap;	 	// 本内存池用到的位图结构,用于管理物理内存
-    uint32_t phy_addr_start;	 	// 本内存池所管理物理内存的起始地址
-    uint32_t pool_size;		 		// 本内存池字节容量
-	
 //~~~~~~~~~~~~~~~~~第11章c~~~~~~~~~~~~~~~~~~~~~~~
 	struct lock lock;
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    uint32_t lock_cnt;		 		// 加锁次数
+    uint32_t wait_cnt;		 		// 加锁时锁已被别的任务持有,只能阻塞让出cpu的次数
+    uint32_t used_pages;	 		// 当前记在本池名下的页框数
+    uint32_t peak_pages;	 		// used_pages的最大值
+    uint32_t soft_limit;	 		// 软上限页框数,0表示不限.只在空闲页框低于low_watermark时生效
+    uint32_t limit_hits;	 		// 因超出软上限被拒绝的分配次数
 };
 
 //~~~~~~~~~~~~~~~~~第12章e~~~~~~~~~~~~~~~~~~~~~~~
@@ -45,6 +77,8 @@ struct arena {
      * 否则cnt表示空闲mem_block数量 */
     uint32_t cnt;
     bool large;		   
+    struct list free_list;		 // 本arena中空闲的mem_block
+    struct list_elem arena_tag;		 // 用于挂在desc的partial/full/empty链表上
 };
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
@@ -52,55 +86,219 @@ struct arena {
 struct mem_block_desc k_block_descs[DESC_CNT];	// 内核内存块描述符数组
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 struct pool kernel_pool, user_pool; // 生成内核内存池和用户内存池
+static struct frame_area frames;	// 内核和用户共用的物理页框
+static struct list vmalloc_list;	// vmalloc区中已分配出去的区域
 struct virtual_addr kernel_vaddr;	// 此结构是用来给内核分配虚拟地址
+static uint32_t linear_map_size;	// 线性映射区覆盖的物理内存大小
+static uint32_t kmap_base;		// KMAP_SLOTS个连续的内核虚拟页,kmap映射线性映射区以外的页框用
+static uint32_t kmap_busy;		// 第i位为1表示第i个kmap槽正在使用
+static uint32_t kernel_pte_flags = PG_US_U | PG_RW_W | PG_P_1;	// 内核页的pte属性,支持全局页时加上PG_G
+
+static void vaddr_remove(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt);
+
+/* 获取内存池m_pool的锁,顺带统计加锁次数和因等锁而被换下cpu的次数.
+ * 已持有锁时的重入不计 */
+static void pool_lock(struct pool* m_pool) {
+   enum intr_status old_status = intr_disable();
+   if (m_pool->lock.holder != running_thread()) {
+      m_pool->lock_cnt++;
+      if (m_pool->lock.semaphore.value == 0) {
+	 m_pool->wait_cnt++;
+      }
+   }
+   intr_set_status(old_status);
+   lock_acquire(&m_pool->lock);
+}
 
 
 
 //#################################################################################################################################
 /* 为malloc做准备 */
 void block_desc_init(struct mem_block_desc* desc_array) {				   
-   uint16_t desc_idx, block_size = 16;
+   /* 1024以上插入1536、2048、3072三种规格,减少大于1024的申请直接占整页的浪费 */
+   static const uint16_t block_sizes[DESC_CNT] = {16, 32, 64, 128, 256, 512, 1024, 1536, 2048, 3072};
+   uint16_t desc_idx, block_size;
 
    /* 初始化每个mem_block_desc描述符 */
    for (desc_idx = 0; desc_idx < DESC_CNT; desc_idx++) {
+      block_size = block_sizes[desc_idx];
       desc_array[desc_idx].block_size = block_size;
 
+      /* 选最少的页框数,使arena中头部加末尾放不下一个块的空间不超过arena的1/8 */
+      uint32_t pages = 1, waste;
+      while (pages < ARENA_MAX_PAGES) {
+	 waste = (pages * PG_SIZE - sizeof(struct arena)) % block_size + sizeof(struct arena);
+	 if (waste * 8 <= pages * PG_SIZE) {
+	    break;
+	 }
+	 pages++;
+      }
+      desc_array[desc_idx].pages_per_arena = pages;
+
       /* 初始化arena中的内存块数量 */
-      desc_array[desc_idx].blocks_per_arena = (PG_SIZE - sizeof(struct arena)) / block_size;	  
+      desc_array[desc_idx].blocks_per_arena = (pages * PG_SIZE - sizeof(struct arena)) / block_size;	  
+
+      /* magazine一次交换的块数,大块少换几个,免得每个任务囤太多内存 */
+      uint32_t batch = PG_SIZE / 2 / block_size;
+      desc_array[desc_idx].mag_batch = batch == 0 ? 1 : (batch > MAG_BATCH_MAX ? MAG_BATCH_MAX : batch);
+      desc_array[desc_idx].alloc_cnt = 0;
+      desc_array[desc_idx].req_bytes = 0;
+
+      list_init(&desc_array[desc_idx].partial_list);
+      list_init(&desc_array[desc_idx].full_list);
+      list_init(&desc_array[desc_idx].empty_list);
+      desc_array[desc_idx].empty_cnt = 0;
+   }
+}
+
+/* 修正子进程描述符中的一个arena链表,parent_list是父进程中对应的链表 */
+static void arena_list_fork(struct list* plist, struct list* parent_list, struct mem_block_desc* desc) {
+   if (plist->head.next == &parent_list->tail) {   // 父进程此链表为空
+      list_init(plist);
+      return;
+   }
+   plist->head.next->prev = &plist->head;
+   plist->tail.prev->next = &plist->tail;
+   struct list_elem* elem = plist->head.next;
+   while (elem != &plist->tail) {
+      struct arena* a = elem2entry(struct arena, arena_tag, elem);
+      a->desc = desc;
+      elem = elem->next;
+   }
+}
+
+/* fork后子进程的描述符是父进程描述符的拷贝,堆中的arena也是父进程arena的拷贝,虚拟地址不变.
+ * 但链表首尾结点和arena->desc还指向父进程pcb中的描述符,须在子进程页表下改为desc_array */
+void block_desc_fork(struct mem_block_desc* desc_array, struct mem_block_desc* parent_array) {
+   uint16_t desc_idx;
+   for (desc_idx = 0; desc_idx < DESC_CNT; desc_idx++) {
+      struct mem_block_desc* desc = &desc_array[desc_idx];
+      struct mem_block_desc* parent_desc = &parent_array[desc_idx];
+      arena_list_fork(&desc->partial_list, &parent_desc->partial_list, desc);
+      arena_list_fork(&desc->full_list, &parent_desc->full_list, desc);
+      arena_list_fork(&desc->empty_list, &parent_desc->empty_list, desc);
+   }
+}
+
+/* 把[start, end)登记为已占用,与重叠或相邻的区间合并成一个.
+ * 成功返回0,内存不足返回-1 */
+static int32_t region_insert(struct virtual_addr* vaddr_pool, uint32_t start, uint32_t end) {
+   struct list* plist = &vaddr_pool->region_list;
+   struct list_elem* elem = plist->head.next;
+   struct vaddr_region* r;
+   while (elem != &plist->tail) {	 // 找到第一个不在start之前的区间
+      r = elem2entry(struct vaddr_region, region_tag, elem);
+      if (r->end >= start) {
+	 break;
+      }
+      elem = elem->next;
+   }
+
+   if (elem != &plist->tail && r->start <= end) {
+      /* 和r重叠或相邻,并入r,再吞掉后面被盖住或接上的区间 */
+      if (start < r->start) {
+	 r->start = start;
+      }
+      if (end > r->end) {
+	 r->end = end;
+      }
+      while (r->region_tag.next != &plist->tail) {
+	 struct vaddr_region* next_r = elem2entry(struct vaddr_region, region_tag, r->region_tag.next);
+	 if (next_r->start > r->end) {
+	    break;
+	 }
+	 if (next_r->end > r->end) {
+	    r->end = next_r->end;
+	 }
+	 list_remove(&next_r->region_tag);
+	 kfree(next_r);
+      }
+      return 0;
+   }
 
-      list_init(&desc_array[desc_idx].free_list);
+   struct vaddr_region* new_r = kmalloc_nozero(sizeof(struct vaddr_region));
+   if (new_r == NULL) {
+      return -1;
+   }
+   new_r->start = start;
+   new_r->end = end;
+   list_insert_before(elem, &new_r->region_tag);
+   return 0;
+}
 
-      block_size *= 2;         // 更新为下一个规格内存块
+/* 把[start, end)从已占用的区间中去掉,从一个区间中间挖走时要拆成两个 */
+static void region_remove(struct virtual_addr* vaddr_pool, uint32_t start, uint32_t end) {
+   struct list* plist = &vaddr_pool->region_list;
+   struct list_elem* elem = plist->head.next;
+   while (elem != &plist->tail) {
+      struct list_elem* next = elem->next;
+      struct vaddr_region* r = elem2entry(struct vaddr_region, region_tag, elem);
+      if (r->start >= end) {
+	 break;
+      }
+      if (r->end > start) {
+	 if (r->start < start && r->end > end) {
+	    struct vaddr_region* tail_r = kmalloc_nozero(sizeof(struct vaddr_region));
+	    if (tail_r == NULL) {
+	       PANIC("region_remove: out of memory");
+	    }
+	    tail_r->start = end;
+	    tail_r->end = r->end;
+	    r->end = start;
+	    list_insert_before(next, &tail_r->region_tag);
+	    break;
+	 } else if (r->start >= start && r->end <= end) {
+	    list_remove(elem);
+	    kfree(r);
+	 } else if (r->start < start) {
+	    r->end = start;
+	 } else {
+	    r->start = end;
+	 }
+      }
+      elem = next;
+   }
+}
+
+/* 首次适配:在vaddr_start到3G之间找一段能放下pg_cnt页的空隙,找不到返回0 */
+static uint32_t region_find_free(struct virtual_addr* vaddr_pool, uint32_t pg_cnt) {
+   uint32_t size = pg_cnt * PG_SIZE;
+   uint32_t cursor = vaddr_pool->vaddr_start;
+   struct list_elem* elem = vaddr_pool->region_list.head.next;
+   while (elem != &vaddr_pool->region_list.tail) {
+      struct vaddr_region* r = elem2entry(struct vaddr_region, region_tag, elem);
+      if (r->start >= cursor && r->start - cursor >= size) {
+	 return cursor;
+      }
+      if (r->end > cursor) {
+	 cursor = r->end;
+      }
+      elem = elem->next;
    }
+   return 0xc0000000 - cursor >= size ? cursor : 0;
 }
 
 /* 在pf表示的虚拟内存池中申请pg_cnt个虚拟页,
  * 成功则返回虚拟页的起始地址, 失败则返回NULL */
 static void* vaddr_get(enum pool_flags pf, uint32_t pg_cnt) {
    int vaddr_start = 0, bit_idx_start = -1;
-   uint32_t cnt = 0;
    
    if (pf == PF_KERNEL) { //##如果是核心內存池
       bit_idx_start  = bitmap_scan(&kernel_vaddr.vaddr_bitmap, pg_cnt);
       if (bit_idx_start == -1) {
 		return NULL;
       }
-      while(cnt < pg_cnt) {
-		bitmap_set(&kernel_vaddr.vaddr_bitmap, bit_idx_start + cnt++, 1);
-      }
+      bitmap_set_range(&kernel_vaddr.vaddr_bitmap, bit_idx_start, pg_cnt);
       vaddr_start = kernel_vaddr.vaddr_start + bit_idx_start * PG_SIZE;
    } 
    else {
    //~~~~~~~~~~~~~~~~~~第11章c~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 	  struct task_struct* cur = running_thread();
-      bit_idx_start  = bitmap_scan(&cur->userprog_vaddr.vaddr_bitmap, pg_cnt);
-      if (bit_idx_start == -1) {
+      vaddr_start = region_find_free(&cur->userprog_vaddr, pg_cnt);
+      if (vaddr_start == 0 || \
+          region_insert(&cur->userprog_vaddr, vaddr_start, vaddr_start + pg_cnt * PG_SIZE) == -1) {
 		return NULL;
 	  }
-	  while(cnt < pg_cnt) {
-		bitmap_set(&cur->userprog_vaddr.vaddr_bitmap, bit_idx_start + cnt++, 1);
-      }
-      vaddr_start = cur->userprog_vaddr.vaddr_start + bit_idx_start * PG_SIZE;
 
    /* ###(0xc0000000 - PG_SIZE)做为用户3级栈已经在start_process被分配 */
       ASSERT((uint32_t)vaddr_start < (0xc0000000 - PG_SIZE));
@@ -129,21 +327,188 @@ uint32_t* pde_ptr(uint32_t vaddr) {
    return pde;
 }
 
+/* 返回可以访问物理页框pg_phyaddr的内核虚拟地址,不必切换页目录.
+ * 线性映射区内的页框直接换算,不改页表;其余的临时映射到一个kmap槽上.
+ * 用完要调用kunmap */
+void* kmap(uint32_t pg_phyaddr) {
+   ASSERT(pg_phyaddr % PG_SIZE == 0);
+   if (pg_phyaddr < linear_map_size) {
+      return phy2linear(pg_phyaddr);
+   }
+   enum intr_status old_status = intr_disable();
+   uint32_t slot = 0;
+   while (slot < KMAP_SLOTS && (kmap_busy & (1U << slot))) {
+      slot++;
+   }
+   if (slot == KMAP_SLOTS) {
+      PANIC("kmap: no free slot");
+   }
+   kmap_busy |= 1U << slot;
+   uint32_t vaddr = kmap_base + slot * PG_SIZE;
+   *pte_ptr(vaddr) = pg_phyaddr | PG_US_S | PG_RW_W | PG_P_1;
+   asm volatile ("invlpg %0"::"m" (*(char*)vaddr):"memory");
+   intr_set_status(old_status);
+   return (void*)vaddr;
+}
+
+/* 撤销kmap返回的映射,线性映射区中的地址什么也不用做 */
+void kunmap(void* _vaddr) {
+   uint32_t vaddr = (uint32_t)_vaddr & 0xfffff000;
+   if (vaddr < kmap_base || vaddr >= kmap_base + KMAP_SLOTS * PG_SIZE) {
+      return;
+   }
+   enum intr_status old_status = intr_disable();
+   *pte_ptr(vaddr) = 0;
+   asm volatile ("invlpg %0"::"m" (*(char*)vaddr):"memory");
+   kmap_busy &= ~(1U << ((vaddr - kmap_base) / PG_SIZE));
+   intr_set_status(old_status);
+}
+
 
 //=================================================================================
-/* 在m_pool指向的物理内存池中分配1个物理页,
+/* 从zero_list上取一个预先清0的页框,没有则返回NULL.
+ * 取出的页框仍带PG_ZEROED标记 */
+static struct page* zero_page_get(void) {
+   struct page* pg = NULL;
+   enum intr_status old_status = intr_disable();
+   if (!list_empty(&frames.zero_list)) {
+      pg = elem2entry(struct page, free_elem, list_pop(&frames.zero_list));
+      frames.zero_cnt--;
+   }
+   intr_set_status(old_status);
+   return pg;
+}
+
+/* 空闲页框数,含预先清0的 */
+static uint32_t frames_free(void) {
+   return frames.buddy.free_pages + frames.high_buddy.free_pages + frames.zero_cnt;
+}
+
+/* 返回管理页框pfn的伙伴系统 */
+static struct buddy* frame_buddy(uint32_t pfn) {
+   struct buddy* high = &frames.high_buddy;
+   return high->page_cnt > 0 && pfn >= high->pfn_start ? high : &frames.buddy;
+}
+
+/* 在m_pool名下记上pg_cnt个页框.
+ * 空闲页框低于low_watermark时,已达到软上限的池不能再多占,返回false */
+static bool pool_charge(struct pool* m_pool, uint32_t pg_cnt) {
+   enum intr_status old_status = intr_disable();
+   if (m_pool->soft_limit != 0 && m_pool->used_pages + pg_cnt > m_pool->soft_limit && \
+       frames_free() < frames.low_watermark + pg_cnt) {
+      m_pool->limit_hits++;
+      intr_set_status(old_status);
+      return false;
+   }
+   m_pool->used_pages += pg_cnt;
+   if (m_pool->used_pages > m_pool->peak_pages) {
+      m_pool->peak_pages = m_pool->used_pages;
+   }
+   intr_set_status(old_status);
+   return true;
+}
+
+static void pool_uncharge(struct pool* m_pool, uint32_t pg_cnt) {
+   enum intr_status old_status = intr_disable();
+   ASSERT(m_pool->used_pages >= pg_cnt);
+   m_pool->used_pages -= pg_cnt;
+   intr_set_status(old_status);
+}
+
+/* 把刚分配的页框pg记为m_pool所有 */
+static void page_owner_set(struct page* pg, struct pool* m_pool) {
+   pg->private = NULL;
+   if (m_pool == &user_pool) {
+      pg->flags |= PG_USER;
+   } else {
+      pg->flags &= ~PG_USER;
+   }
+}
+
+/* 为m_pool分配1个物理页,
  * 成功则返回页框的物理地址,失败则返回NULL */
 static void* palloc(struct pool* m_pool) {
-   /* 扫描或设置位图要保证原子操作 */
-   int bit_idx = bitmap_scan(&m_pool->pool_bitmap, 1); // 找一个物理页面
-   if (bit_idx == -1 ) {
+   if (!pool_charge(m_pool, 1)) {
       return NULL;
    }
-   bitmap_set(&m_pool->pool_bitmap, bit_idx, 1);       // 将此位bit_idx置1
-   uint32_t page_phyaddr = ((bit_idx * PG_SIZE) + m_pool->phy_addr_start);
+   /* 伙伴系统内部关中断保证原子操作.
+    * 用户页先用内核够不着的高端页框,把线性映射区留给内核 */
+   int32_t pfn = -1;
+   if (m_pool == &user_pool) {
+      pfn = buddy_alloc(&frames.high_buddy, 0);
+   }
+   if (pfn == -1) {
+      pfn = buddy_alloc(&frames.buddy, 0);	// 取一个0阶块,即一个物理页面
+   }
+   if (pfn == -1) {
+      /* 伙伴系统空了再动用预先清0的页框,不需要清0的申请用它也不必留标记 */
+      struct page* pg = zero_page_get();
+      if (pg == NULL) {
+	 pool_uncharge(m_pool, 1);
+	 return NULL;
+      }
+      pg->flags &= ~PG_ZEROED;
+      pfn = page2pfn(pg);
+   }
+   page_owner_set(pfn2page(pfn), m_pool);
+   uint32_t page_phyaddr = (uint32_t)pfn * PG_SIZE;
    return (void*)page_phyaddr;
 }
 
+/* 和palloc一样分配1个物理页,但优先取预先清0的页框.
+ * 这种页框带着PG_ZEROED返回,调用者映射后用pages_zero决定是否还要清0 */
+static void* palloc_zeroed(struct pool* m_pool) {
+   if (!pool_charge(m_pool, 1)) {
+      return NULL;
+   }
+   struct page* pg = zero_page_get();
+   if (pg == NULL) {
+      pool_uncharge(m_pool, 1);
+      return palloc(m_pool);
+   }
+   page_owner_set(pg, m_pool);
+   return (void*)(page2pfn(pg) * PG_SIZE);
+}
+
+/* 把从_vaddr开始已映射好的pg_cnt页清0,预先清过0的页框只去掉标记即可.
+ * 页框已归调用者所有,不需要持有内存池的锁 */
+static void pages_zero(void* _vaddr, uint32_t pg_cnt) {
+   uint32_t vaddr = (uint32_t)_vaddr;
+   while (pg_cnt-- > 0) {
+      struct page* pg = vaddr2page(vaddr);
+      if (pg->flags & PG_ZEROED) {
+	 pg->flags &= ~PG_ZEROED;
+      } else {
+	 memset((void*)vaddr, 0, PG_SIZE);
+      }
+      vaddr += PG_SIZE;
+   }
+}
+
+/* 为m_pool分配pg_cnt个物理地址连续的页框,成功则返回首页框的物理地址,失败则返回NULL.
+ * 按2的幂分配后把多出的尾部页框还回去,并把分到的块拆成单页,
+ * 这样每页以后都可以单独用pfree回收 */
+static void* palloc_contig(struct pool* m_pool, uint32_t pg_cnt) {
+   uint32_t order = pages2order(pg_cnt);
+   if (order >= MAX_ORDER || !pool_charge(m_pool, pg_cnt)) {
+      return NULL;
+   }
+   int32_t pfn = buddy_alloc(&frames.buddy, order);
+   if (pfn == -1) {
+      pool_uncharge(m_pool, pg_cnt);
+      return NULL;
+   }
+   uint32_t idx;
+   for (idx = 0; idx < (1U << order); idx++) {
+      pfn2page(pfn + idx)->order = 0;
+      page_owner_set(pfn2page(pfn + idx), m_pool);
+   }
+   for (idx = pg_cnt; idx < (1U << order); idx++) {
+      buddy_free(&frames.buddy, pfn + idx, 0);
+   }
+   return (void*)((uint32_t)pfn * PG_SIZE);
+}
+
 
 //=================================================================================
 /* 页表中添加虚拟地址_vaddr与物理地址_page_phyaddr的映射 */
@@ -151,6 +516,7 @@ static void page_table_add(void* _vaddr, void* _page_phyaddr) {
    uint32_t vaddr = (uint32_t)_vaddr, page_phyaddr = (uint32_t)_page_phyaddr;
    uint32_t* pde = pde_ptr(vaddr);
    uint32_t* pte = pte_ptr(vaddr);
+   uint32_t pte_flags = vaddr >= 0xc0000000 ? kernel_pte_flags : (PG_US_U | PG_RW_W | PG_P_1);
 
 /************************   注意   *************************
  * 执行*pte,会访问到空的pde。所以确保pde创建完成后才能执行*pte,
@@ -161,16 +527,17 @@ static void page_table_add(void* _vaddr, void* _page_phyaddr) {
       ASSERT(!(*pte & 0x00000001)); //*pte & 0x00000001 == true會ASSERT
 
       if (!(*pte & 0x00000001)) {   // 只要是创建页表,pte就应该不存在,多判断一下放心
-		*pte = (page_phyaddr | PG_US_U | PG_RW_W | PG_P_1);    // US=1,RW=1,P=1
+		*pte = (page_phyaddr | pte_flags);    // US=1,RW=1,P=1
       } 
 	  else {			    //应该不会执行到这，因为上面的ASSERT会先执行。
 		PANIC("pte repeat");
-		*pte = (page_phyaddr | PG_US_U | PG_RW_W | PG_P_1);      // US=1,RW=1,P=1
+		*pte = (page_phyaddr | pte_flags);      // US=1,RW=1,P=1
       }
    } 
    else {			    // 页目录项不存在,所以要先创建页目录再创建页表项.
       /* 页表中用到的页框一律从内核空间分配 */
-      uint32_t pde_phyaddr = (uint32_t)palloc(&kernel_pool);
+      uint32_t pde_phyaddr = (uint32_t)palloc_zeroed(&kernel_pool);
+      struct page* pt_page = pfn2page(pde_phyaddr / PG_SIZE);
 
       *pde = (pde_phyaddr | PG_US_U | PG_RW_W | PG_P_1);
 
@@ -178,36 +545,152 @@ static void page_table_add(void* _vaddr, void* _page_phyaddr) {
        * 避免里面的陈旧数据变成了页表项,从而让页表混乱.
        * 访问到pde对应的物理地址,用pte取高20位便可.
        * 因为pte是基于该pde对应的物理地址内再寻址,
-       * 把低12位置0便是该pde对应的物理页的起始*/
-      memset((void*)((int)pte & 0xfffff000), 0, PG_SIZE);
+       * 把低12位置0便是该pde对应的物理页的起始.
+       * 预先清过0的页框就不必再清了 */
+      if (pt_page->flags & PG_ZEROED) {
+	 pt_page->flags &= ~PG_ZEROED;
+      } else {
+	 memset((void*)((int)pte & 0xfffff000), 0, PG_SIZE);
+      }
          
       ASSERT(!(*pte & 0x00000001));
-      *pte = (page_phyaddr | PG_US_U | PG_RW_W | PG_P_1);      // US=1,RW=1,P=1
+      *pte = (page_phyaddr | pte_flags);      // US=1,RW=1,P=1
    }
 }
 
 
 //=================================================================================
-/* 分配pg_cnt个页空间,成功则返回起始虚拟地址,失败时返回NULL */
-void* malloc_page(enum pool_flags pf, uint32_t pg_cnt) {
+/* vmalloc区中分配出去的一段虚拟地址,页框不连续,逐页映射 */
+struct vmalloc_area {
+   uint32_t start;
+   uint32_t pg_cnt;
+   struct list_elem area_tag;	 // 挂在vmalloc_list上
+};
+
+/* 在内核虚拟地址池中占住pg_cnt页并登记为vmalloc区域,不分配页框,失败返回NULL */
+static void* vmalloc_area_add(uint32_t pg_cnt) {
+   struct vmalloc_area* area = kmalloc_nozero(sizeof(struct vmalloc_area));
+   if (area == NULL) {
+      return NULL;
+   }
+   pool_lock(&kernel_pool);
+   void* vaddr = vaddr_get(PF_KERNEL, pg_cnt);
+   lock_release(&kernel_pool.lock);
+   if (vaddr == NULL) {
+      kfree(area);
+      return NULL;
+   }
+   area->start = (uint32_t)vaddr;
+   area->pg_cnt = pg_cnt;
+
+   /* 缺页处理会在中断中查这个链表,增删都关中断 */
+   enum intr_status old_status = intr_disable();
+   list_append(&vmalloc_list, &area->area_tag);
+   intr_set_status(old_status);
+   return vaddr;
+}
+
+/* 找包含vaddr的vmalloc区域,没有返回NULL,须关中断调用 */
+static struct vmalloc_area* vmalloc_area_find(uint32_t vaddr) {
+   struct list_elem* elem = vmalloc_list.head.next;
+   while (elem != &vmalloc_list.tail) {
+      struct vmalloc_area* area = elem2entry(struct vmalloc_area, area_tag, elem);
+      if (vaddr >= area->start && vaddr < area->start + area->pg_cnt * PG_SIZE) {
+	 return area;
+      }
+      elem = elem->next;
+   }
+   return NULL;
+}
+
+/* 在vmalloc区中申请size字节,按页取整,成功返回起始地址,失败返回NULL.
+ * 只占虚拟地址,页框等第一次访问时由缺页处理逐页分配,新页内容为0.
+ * 那时内存不足只能PANIC,所以只给能容忍这一点的调用者用,kmalloc不走这里 */
+void* vmalloc(uint32_t size) {
+   ASSERT(size > 0);
+   return vmalloc_area_add(DIV_ROUND_UP(size, PG_SIZE));
+}
+
+/* 释放vmalloc或多页malloc_page_common得到的区域,已装入的页框还回去,虚拟地址归还 */
+void vfree(void* _vaddr) {
+   uint32_t vaddr = (uint32_t)_vaddr;
+   enum intr_status old_status = intr_disable();
+   struct vmalloc_area* area = vmalloc_area_find(vaddr);
+   ASSERT(area != NULL && area->start == vaddr);
+   list_remove(&area->area_tag);
+   intr_set_status(old_status);
+
+   uint32_t page_vaddr = vaddr, end = vaddr + area->pg_cnt * PG_SIZE;
+   for (; page_vaddr < end; page_vaddr += PG_SIZE) {
+      uint32_t* pte = pte_ptr(page_vaddr);
+      if ((*pde_ptr(page_vaddr) & PG_P_1) && (*pte & PG_P_1)) {
+	 pfree(*pte & 0xfffff000);
+	 *pte = 0;
+	 asm volatile ("invlpg %0"::"m" (*(char*)page_vaddr):"memory");
+      }
+   }
+   pool_lock(&kernel_pool);
+   vaddr_remove(PF_KERNEL, _vaddr, area->pg_cnt);
+   lock_release(&kernel_pool.lock);
+   kfree(area);
+}
+
+/* vmalloc区中还没装入的页第一次被访问时,分配一个清0的页框装上.
+ * vaddr不属于任何vmalloc区域时返回false.在缺页中断中调用,中断已关 */
+static bool vmalloc_fault(uint32_t vaddr) {
+   if (vmalloc_area_find(vaddr) == NULL) {
+      return false;
+   }
+   void* page_phyaddr = palloc_zeroed(&kernel_pool);
+   if (page_phyaddr == NULL) {
+      PANIC("vmalloc_fault: out of memory");
+   }
+   uint32_t page_vaddr = vaddr & 0xfffff000;
+   page_table_add((void*)page_vaddr, page_phyaddr);
+   pages_zero((void*)page_vaddr, 1);
+   return true;
+}
+
+//=================================================================================
+/* 分配pg_cnt个页空间,成功则返回起始虚拟地址,失败时返回NULL.
+ * prefer_zeroed为true时优先用预先清0的页框,调用者之后须调用pages_zero */
+static void* malloc_page_common(enum pool_flags pf, uint32_t pg_cnt, bool prefer_zeroed) {
    ASSERT(pg_cnt > 0 && pg_cnt < 3840);
 /***********   malloc_page的原理是三个动作的合成:   ***********
       1通过vaddr_get在虚拟内存池中申请虚拟地址
       2通过palloc在物理内存池中申请物理页
       3通过page_table_add将以上得到的虚拟地址和物理地址在页表中完成映射
 ***************************************************************/
-   void* vaddr_start = vaddr_get(pf, pg_cnt);
+   if (pf == PF_KERNEL) {
+      /* 内核页取自线性映射区,不用再申请虚拟地址和改页表,
+       * 但虚拟地址连续就要求物理页框也连续,多页时向伙伴系统要连续的块 */
+      void* page_phyaddr;
+      if (pg_cnt == 1) {
+	 page_phyaddr = prefer_zeroed ? palloc_zeroed(&kernel_pool) : palloc(&kernel_pool);
+      } else {
+	 page_phyaddr = palloc_contig(&kernel_pool, pg_cnt);
+      }
+      /* 内存碎片化后凑不出连续的块,就改到vmalloc区用零散的页框逐页映射 */
+      if (page_phyaddr != NULL || pg_cnt == 1) {
+	 return page_phyaddr == NULL ? NULL : phy2linear(page_phyaddr);
+      }
+   }
+
+   void* vaddr_start = pf == PF_KERNEL ? vmalloc_area_add(pg_cnt) : vaddr_get(pf, pg_cnt);
    if (vaddr_start == NULL) {
       return NULL;
    }
 
    uint32_t vaddr = (uint32_t)vaddr_start, cnt = pg_cnt;
-   struct pool* mem_pool = pf & PF_KERNEL ? &kernel_pool : &user_pool;
+   struct pool* mem_pool = pf == PF_KERNEL ? &kernel_pool : &user_pool;
 
    /* 因为虚拟地址是连续的,但物理地址可以是不连续的,所以逐个做映射*/
    while (cnt-- > 0) {
-      void* page_phyaddr = palloc(mem_pool);
+      void* page_phyaddr = prefer_zeroed ? palloc_zeroed(mem_pool) : palloc(mem_pool);
       if (page_phyaddr == NULL) {  // 失败时要将曾经已申请的虚拟地址和物理页全部回滚，在将来完成内存回收时再补充
+		if (pf == PF_KERNEL) {  // 内核的区域已登记,vfree会把已映射的页框一并还回去
+		   vfree(vaddr_start);
+		}
 		return NULL;
       }
       page_table_add((void*)vaddr, page_phyaddr); // 在页表中做映射 
@@ -216,28 +699,35 @@ void* malloc_page(enum pool_flags pf, uint32_t pg_cnt) {
    return vaddr_start;
 }
 
+/* 分配pg_cnt个页空间,页框内容不清0 */
+void* malloc_page(enum pool_flags pf, uint32_t pg_cnt) {
+   return malloc_page_common(pf, pg_cnt, false);
+}
+
 
 //=================================================================================
 /* 从内核物理内存池中申请pg_cnt页内存,成功则返回其虚拟地址,失败则返回NULL */
 void* get_kernel_pages(uint32_t pg_cnt) {
-   lock_acquire(&kernel_pool.lock);	//##<======第11章b後新增，
-   
-   void* vaddr =  malloc_page(PF_KERNEL, pg_cnt);
+   pool_lock(&kernel_pool);	//##<======第11章b後新增，
+   void* vaddr =  malloc_page_common(PF_KERNEL, pg_cnt, true);
+   lock_release(&kernel_pool.lock); //##<======第11章b後新增，
+
+   /* 锁只保护位图和页表,清0整页很慢,放到锁外做 */
    if (vaddr != NULL) {	   // 若分配的地址不为空,将页框清0后返回
-      memset(vaddr, 0, pg_cnt * PG_SIZE);
+      pages_zero(vaddr, pg_cnt);
    }
-   
-   lock_release(&kernel_pool.lock); //##<======第11章b後新增，
    return vaddr;
 }
 
 //~~~~~~~~~~~~~~~~~~~~~~~~第11章b~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 /* 在用户空间中申请4k内存,并返回其虚拟地址 */
 void* get_user_pages(uint32_t pg_cnt) {
-   lock_acquire(&user_pool.lock);
-   void* vaddr = malloc_page(PF_USER, pg_cnt);
-   memset(vaddr, 0, pg_cnt * PG_SIZE);
+   pool_lock(&user_pool);
+   void* vaddr = malloc_page_common(PF_USER, pg_cnt, true);
    lock_release(&user_pool.lock);
+   if (vaddr != NULL) {
+      pages_zero(vaddr, pg_cnt);
+   }
    return vaddr;
 }
 
@@ -280,21 +770,18 @@ void* get_a_page(enum pool_flags pf, uint32_t vaddr) {
 
 void* get_a_page(enum pool_flags pf, uint32_t vaddr) {
    struct pool* mem_pool = pf & PF_KERNEL ? &kernel_pool : &user_pool;
-   lock_acquire(&mem_pool->lock);
+   pool_lock(mem_pool);
 
    /* 先将虚拟地址对应的位图置1 */
    struct task_struct* cur = running_thread();
    int32_t bit_idx = -1;
 
-/* 若当前是用户进程申请用户内存,就修改用户进程自己的虚拟地址位图 */
-   if (cur->pgdir != NULL && pf == PF_USER && vaddr < 0x8048000) {
-      bit_idx = vaddr / PG_SIZE;
-      ASSERT(bit_idx >= 0);//<===============
-      bitmap_set(&cur->userprog_vaddr.vaddr_bitmap, bit_idx, 1);
-   } else if (cur->pgdir != NULL && pf == PF_USER) {
-      bit_idx = (vaddr - cur->userprog_vaddr.vaddr_start) / PG_SIZE;
-      ASSERT(bit_idx >= 0);//<===============
-      bitmap_set(&cur->userprog_vaddr.vaddr_bitmap, bit_idx, 1);
+/* 若当前是用户进程申请用户内存,就登记到用户进程自己的虚拟地址区间中 */
+   if (cur->pgdir != NULL && pf == PF_USER) {
+      if (region_insert(&cur->userprog_vaddr, vaddr, vaddr + PG_SIZE) == -1) {
+	 lock_release(&mem_pool->lock);
+	 return NULL;
+      }
    } else if (cur->pgdir == NULL && pf == PF_KERNEL){
 /* 如果是内核线程申请内核内存,就修改kernel_vaddr. */
       bit_idx = (vaddr - kernel_vaddr.vaddr_start) / PG_SIZE;
@@ -326,7 +813,7 @@ void* get_a_page(enum pool_flags pf, uint32_t vaddr) {
 /* 安装1页大小的vaddr,专门针对fork时虚拟地址位图无须操作的情况 */
 void* get_a_page_without_opvaddrbitmap(enum pool_flags pf, uint32_t vaddr) {
    struct pool* mem_pool = pf & PF_KERNEL ? &kernel_pool : &user_pool;
-   lock_acquire(&mem_pool->lock);
+   pool_lock(mem_pool);
    void* page_phyaddr = palloc(mem_pool);
    if (page_phyaddr == NULL) {
       lock_release(&mem_pool->lock);
@@ -339,6 +826,11 @@ void* get_a_page_without_opvaddrbitmap(enum pool_flags pf, uint32_t vaddr) {
 
 /* 得到虚拟地址映射到的物理地址 */
 uint32_t addr_v2p(uint32_t vaddr) {
+   /* 大页没有页表,物理地址直接由页目录项和vaddr的低22位组成 */
+   uint32_t pde = *pde_ptr(vaddr);
+   if (pde & PG_PS) {
+      return (pde & 0xffc00000) + (vaddr & 0x003fffff);
+   }
    uint32_t* pte = pte_ptr(vaddr);
 /* (*pte)的值是页表所在的物理页框地址,
  * 去掉其低12位的页表项属性+虚拟地址vaddr的低12位 */
@@ -491,7 +983,87 @@ uint32_t addr_v2p(uint32_t vaddr) {
 
 //#################################################################################################################################
 /* 初始化内存池 */
-static void mem_pool_init(uint32_t all_mem) {
+/* 把物理内存从0起线性映射到K_LINEAR_BASE,返回映射区的大小(4M对齐).
+ * 处理器支持PSE(cpuid功能号1,edx第3位)时每4M用一个大页,连内核映像所在的第768项也换成大页,
+ * 一项页目录项就顶一张页表,tlb也只占一项;否则把4K的pte填进loader为第768~1022项预先分配的页表.
+ * 第0项页目录项仍指向原来的页表,低端1M的恒等映射不变 */
+static uint32_t linear_map_init(uint32_t all_mem) {
+   uint32_t eax = 1, ebx, ecx, edx;
+   asm volatile ("cpuid" : "+a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx));
+   bool pse = edx & (1 << 3);
+
+   uint32_t linear_size = all_mem < K_LINEAR_MAX ? all_mem : K_LINEAR_MAX;
+   linear_size = DIV_ROUND_UP(linear_size, 0x400000) * 0x400000;
+   if (pse) {
+      asm volatile ("movl %%cr4, %%eax; orl $0x10, %%eax; movl %%eax, %%cr4" : : : "eax", "memory");
+   }
+
+   uint32_t phy_addr;
+   for (phy_addr = 0; phy_addr < linear_size; phy_addr += 0x400000) {
+      uint32_t vaddr = (uint32_t)phy2linear(phy_addr);
+      if (pse) {
+	 *pde_ptr(vaddr) = phy_addr | PG_PS | PG_US_S | PG_RW_W | PG_P_1;
+	 continue;
+      }
+      uint32_t* pte = pte_ptr(vaddr);
+      uint32_t pte_idx;
+      for (pte_idx = 0; pte_idx < 1024; pte_idx++) {
+	 if (!(pte[pte_idx] & PG_P_1)) {
+	    pte[pte_idx] = (phy_addr + pte_idx * PG_SIZE) | PG_US_S | PG_RW_W | PG_P_1;
+	 }
+      }
+   }
+   /* 页目录项由页表换成了大页,刷新整个tlb */
+   asm volatile ("movl %%cr3, %%eax; movl %%eax, %%cr3" : : : "eax", "memory");
+
+   put_str("      linear map size:");
+   put_int(linear_size);
+   put_str(pse ? " (4M pages)\n" : " (4K pages)\n");
+   return linear_size;
+}
+
+/* E820返回的地址范围描述符 */
+struct ards {
+   uint32_t base_low;
+   uint32_t base_high;
+   uint32_t length_low;
+   uint32_t length_high;
+   uint32_t type;
+};
+
+/* 从loader.S留下的E820内存布局中取出4G以下可用的内存区域,页对齐后存入starts和ends,返回区域数.
+ * BIOS不支持E820时ards_nr为0,只能把[0, total_mem_bytes)当作一整块 */
+static uint32_t mem_regions_get(uint32_t total_mem_bytes, uint32_t* starts, uint32_t* ends) {
+   uint16_t ards_nr = *(uint16_t*)ARDS_NR_ADDR;
+   if (ards_nr == 0) {
+      starts[0] = 0;
+      ends[0] = total_mem_bytes & 0xfffff000;
+      return 1;
+   }
+
+   struct ards* ards = (struct ards*)ARDS_BUF_ADDR;
+   uint32_t region_cnt = 0, idx;
+   for (idx = 0; idx < ards_nr && idx < ARDS_MAX; idx++) {
+      if (ards[idx].type != ARDS_USABLE || ards[idx].base_high != 0) {
+	 continue;
+      }
+      uint32_t start = ards[idx].base_low;
+      uint32_t end = start + ards[idx].length_low;
+      if (ards[idx].length_high != 0 || end < start) {	 // 超出4G的部分舍去
+	 end = 0xfffff000;
+      }
+      start = (start + PG_SIZE - 1) & 0xfffff000;
+      end &= 0xfffff000;
+      if (start < end) {
+	 starts[region_cnt] = start;
+	 ends[region_cnt] = end;
+	 region_cnt++;
+      }
+   }
+   return region_cnt;
+}
+
+static void mem_pool_init(uint32_t total_mem_bytes) {
     put_str("   mem_pool_init start\n");
 	
     uint32_t page_table_size = PG_SIZE * 256;	  		// 页表大小= 1页的页目录表+第0和第768个页目录项指向同一个页表+
@@ -501,127 +1073,87 @@ static void mem_pool_init(uint32_t all_mem) {
 	
 	uint32_t used_mem = page_table_size + 0x100000;	  	// 0x100000为低端1M内存
 /**==>##頁表所佔的總大小(單位為byte)+記憶體最一開始的1MB=被使用的記憶體總大小=used_mem，單位為byte**/
-    
-	uint32_t free_mem = all_mem - used_mem;
-/**==>##查到的能用的總記憶體大小(=all_mem，應為32MB)-被使用的記憶體總大小(used_mem)=能自由使用的記憶體大小=free_mem**/
 
-    uint16_t all_free_pages = free_mem / PG_SIZE;		// 1页为4k,不管总内存是不是4k的倍数,
-/**==>##能自由使用的記憶體大小(free_mem)除以一個頁表的大小=能自由使用的頁表數量=all_free_pages**/
-	//###剩下的記憶體可以分配free_mem / PG_SIZ的頁表
-    // 对于以页为单位的内存分配策略，不足1页的内存不用考虑了。
- 
 //----------------------------------------------------- 
-	uint16_t kernel_free_pages = all_free_pages / 2;
-/**==>##把能自由使用的頁表大小(all_free_pages)的一半分給核心，kernel_free_pages為核心能自由使用的頁表數量**/
-
-    uint16_t user_free_pages = all_free_pages - kernel_free_pages;
-/**==>##把能自由使用的頁表大小(all_free_pages)未分給核心的另一半給使用者，kernel_free_pages為使用者能自由使用的頁表數量**/
-	//###把"用剩下的記憶體"分配到的頁表的"一半"給使用者使用
-
-//----------------------------------------------------- 
-    /* 为简化位图操作，余数不处理，坏处是这样做会丢内存。
-    好处是不用做内存的越界检查,因为位图表示的内存少于实际物理内存*/
-    uint32_t kbm_length = kernel_free_pages / 8;		// Kernel BitMap的长度,位图中的一位表示一页,以字节为单位
-/**==>##核心能自由使用的頁表數量(kernel_free_pages)除以8=Kernel BitMap的長度(8位元算1單位長)=kbm_length**/
-
-	uint32_t ubm_length = user_free_pages / 8;			// User BitMap的长度.
-/**==>##使用者能自由使用的頁表數量(kernel_free_pages)除以8=User BitMap的長度(8位元算1單位長)=kbm_length**/
-	//###每8個(位元組)分頁算一個單位長度，所以要除以8。
-	//###若最後一組頁表不足8個，則"不使用(捨棄)"這不足8個的頁表，好處是這樣"使用的"會小於"能使用的"
-
-//----------------------------------------------------- 
-    uint32_t kp_start = used_mem;				  		// Kernel Pool start,内核内存池的起始地址
-/**==>##used_mem為"被使用的總記憶體大小"(被低端1MB、分頁目錄表、頁表使用)，單位為byte，内核内存池的起始地址(kp_start)由此開始算**/
-	//###頁表是從0x100000開始算的，解釋在上面
-    
-	uint32_t up_start = kp_start + kernel_free_pages * PG_SIZE;	  // User Pool start,用户内存池的起始地址
-/**==>##内核内存池的起始地址(kp_start)+核心能自由使用的頁表數量*1個頁表的大小=使用者内存池的起始地址(up_start)**/
-	//###kernel_free_pages的單位是頁表
-
-
-//==========================================================================================
-    kernel_pool.phy_addr_start = kp_start;
-    user_pool.phy_addr_start   = up_start;
-	//###kp_start在低地址處，up_start在高地址處
-
-//------------------------------------------------------ 
-    kernel_pool.pool_size = kernel_free_pages * PG_SIZE;
-/**==>##kernel_pool.pool_size存的是"核心能自由使用的頁表數量(kernel_free_pages)*頁表大小"=核心能自由使用的總大小(單位為byte)**/
-    
-	user_pool.pool_size	 = user_free_pages * PG_SIZE;
-/**==>##user_pool.pool_size存的是"使用者能自由使用的頁表數量(user_free_pages)*頁表大小"=使用者能自由使用的總大小(單位為byte)**/
+    /* 物理内存可能有空洞,以最高的可用地址作为内存上限 */
+    uint32_t region_start[ARDS_MAX], region_end[ARDS_MAX];
+    uint32_t region_cnt = mem_regions_get(total_mem_bytes, region_start, region_end);
+    uint32_t all_mem = 0, region_idx;
+    for (region_idx = 0; region_idx < region_cnt; region_idx++) {
+       if (region_end[region_idx] > all_mem) {
+          all_mem = region_end[region_idx];
+       }
+    }
+
+    uint32_t linear_end = linear_map_init(all_mem);
+    linear_map_size = linear_end < all_mem ? linear_end : all_mem;
+
+    /* 每个物理页框一个struct page,按页框号索引,
+     * mem_map占用的页框紧跟在页表之后,经线性映射访问 */
+    uint32_t mem_map_pages = DIV_ROUND_UP((all_mem / PG_SIZE) * sizeof(struct page), PG_SIZE);
+    mem_map = (struct page*)phy2linear(used_mem);
+    memset(mem_map, 0, mem_map_pages * PG_SIZE);
+    used_mem += mem_map_pages * PG_SIZE;
+    ASSERT(used_mem <= linear_map_size);
  
-//------------------------------------------------------ 
-	kernel_pool.pool_bitmap.btmp_bytes_len = kbm_length;
-/**==>##kernel_pool.pool_bitmap.btmp_bytes_len存的是Kernel BitMap的長度(8位元算1單位長)**/
-
-    user_pool.pool_bitmap.btmp_bytes_len = ubm_length;
-/**==>##user_pool.pool_bitmap.btmp_bytes_len存的是User BitMap的長度(8位元算1單位長)**/
-	//###struct pool裡面包struct bitmap
-
-//------------------------------------------------------ 
-    /*********    内核内存池和用户内存池位图   ***********
-    *   位图是全局的数据，长度不固定。
-    *   全局或静态的数组需要在编译时知道其长度，
-    *   而我们需要根据总内存大小算出需要多少字节。
-    *   所以改为指定一块内存来生成位图.
-    *   ************************************************/
-    // 内核使用的最高地址是0xc009f000,这是主线程的栈地址.(内核的大小预计为70K左右)
-    // 32M内存占用的位图是2k.内核内存池的位图先定在MEM_BITMAP_BASE(0xc009a000)处.
-	//	#~~~~~~~~~~~~~~~~~~^ 1k?
-	/*	###選0xc009a000的原因是kernel堆疊從0xc00f000，而PCB從0xc00e000，
-		###0xc00e000-0xc009a000=0x4000=4分頁大小，
-		###而32MB除以一個分頁的大小(=4k)再除以8=1k=總共只需要的點陣圖大小(佔一個分頁的四分之一)，	
-		###目前分配4分頁的大小給點陣圖表示可支援的總記憶體大小可以擴到32MB*4*4=512MB		*/ 
-	kernel_pool.pool_bitmap.bits = (void*)MEM_BITMAP_BASE;
-/**==>##kernel_pool.pool_bitmap.bits存的是核心的點陣圖的堆疊的起始地址**/
-
-    /* 用户内存池的位图紧跟在内核内存池位图之后 */
-    user_pool.pool_bitmap.bits = (void*)(MEM_BITMAP_BASE + kbm_length);
-/**==>##user_pool.pool_bitmap.bits存的是核心的點陣圖的堆疊的起始地址+Kernel BitMap的長度(8位元算1單位長)=使用者的點陣圖的堆疊的起始地址**/
+//----------------------------------------------------- 
+    /* 空闲页框不再分给两个内存池,统一由frames管理.
+     * 线性映射区内的归buddy,之上的归high_buddy,
+     * 两个伙伴系统先按地址范围初始化,再把每个可用区域中used_mem以上的部分加进去 */
+    buddy_init(&frames.buddy, used_mem / PG_SIZE, (linear_map_size - used_mem) / PG_SIZE);
+    buddy_init(&frames.high_buddy, linear_map_size / PG_SIZE, (all_mem - linear_map_size) / PG_SIZE);
+    for (region_idx = 0; region_idx < region_cnt; region_idx++) {
+       uint32_t start = region_start[region_idx] > used_mem ? region_start[region_idx] : used_mem;
+       uint32_t end = region_end[region_idx];
+       uint32_t normal_end = end < linear_map_size ? end : linear_map_size;
+       if (start < normal_end) {
+          buddy_free_range(&frames.buddy, start / PG_SIZE, (normal_end - start) / PG_SIZE);
+       }
+       uint32_t high_start = start > linear_map_size ? start : linear_map_size;
+       if (high_start < end) {
+          buddy_free_range(&frames.high_buddy, high_start / PG_SIZE, (end - high_start) / PG_SIZE);
+       }
+    }
+    frames.total_pages = frames.buddy.free_pages + frames.high_buddy.free_pages;
+    list_init(&frames.zero_list);
+    frames.zero_cnt = 0;
+
+    /* 用户进程占到7/8以上后,空闲页框一旦低于1/16就不再给它,
+     * 剩下的留给内核,免得用户进程把内存吃光后内核连页表都分不到 */
+    frames.low_watermark = frames.total_pages / 16;
+    kernel_pool.soft_limit = 0;
+    user_pool.soft_limit = frames.total_pages - frames.total_pages / 8;
 
 
 //==========================================================================================
     /******************** 输出内存池信息 **********************/
-    put_str("      kernel_pool_bitmap_start:");
-	put_int((int)kernel_pool.pool_bitmap.bits);
-    put_str("\n");
-	
-    put_str("      kernel_pool_bitmap_end:");
-    put_int((int)kernel_pool.pool_bitmap.bits + kernel_pool.pool_bitmap.btmp_bytes_len);
-    put_str("\n");
-	
-    put_str("       kernel_pool_phy_addr_start:");put_int(kernel_pool.phy_addr_start);
-    put_str("\n");
-	
-    put_str("       kernel_pool_phy_addr_end:");
-    put_int(kernel_pool.phy_addr_start + kernel_pool.pool_size);
-    put_str("\n");
-	
-	//----------------------------------------
-    put_str("      user_pool_bitmap_start:");
-    put_int((int)user_pool.pool_bitmap.bits);
+    put_str("      mem_map_start:");
+	put_int((int)mem_map);
     put_str("\n");
 	
-    put_str("      user_pool_bitmap_end:");
-    put_int((int)user_pool.pool_bitmap.bits + user_pool.pool_bitmap.btmp_bytes_len);
+    put_str("      mem_map_end:");
+    put_int((int)mem_map + mem_map_pages * PG_SIZE);
     put_str("\n");
-	
-    put_str("       user_pool_phy_addr_start:");
-    put_int(user_pool.phy_addr_start);
+
+    put_str("       usable regions:");
+    for (region_idx = 0; region_idx < region_cnt; region_idx++) {
+       put_str(" ");
+       put_int(region_start[region_idx]);
+       put_str("-");
+       put_int(region_end[region_idx]);
+    }
     put_str("\n");
 	
-    put_str("       user_pool_phy_addr_end:");
-    put_int(user_pool.phy_addr_start + user_pool.pool_size);
+    put_str("       free pages:");
+    put_int(frames.total_pages);
+    put_str(" high:");
+    put_int(frames.high_buddy.free_pages);
     put_str("\n");
 
-    /* 将位图置0*/
-    bitmap_init(&kernel_pool.pool_bitmap);
-    bitmap_init(&user_pool.pool_bitmap);
-
 //~~~~~~~~~~~~~~~~~~~~~~~~~第11章b~~~~~~~~~~~~~~~~~~~~~~~~~~~~	
 	lock_init(&kernel_pool.lock);
     lock_init(&user_pool.lock);
+    list_init(&vmalloc_list);
 /*
 ###需要注意:
 ###	lock_init函數內容在sync.c，
@@ -632,15 +1164,20 @@ static void mem_pool_init(uint32_t all_mem) {
 
 //==========================================================================================
 	/* 下面初始化内核虚拟地址的位图,按实际物理内存大小生成数组。*/
-	// 用于维护内核堆的虚拟地址,所以要和内核内存池大小一致
-	kernel_vaddr.vaddr_bitmap.btmp_bytes_len = kbm_length;
-/**==>##kernel_vaddr.vaddr_bitmap.btmp_bytes_len存的內容=Kernel BitMap的長度(8位元算1單位長)**/
-
-    /* 位图的数组指向一块未使用的内存,目前定位在内核内存池和用户内存池之外*/
-    kernel_vaddr.vaddr_bitmap.bits = (void*)(MEM_BITMAP_BASE + kbm_length + ubm_length);
-/**==>##kernel_vaddr.vaddr_bitmap.bits存的是未被核心和使用者使用的點陣圖的起始位址，即虛擬位址的點陣圖的器始位址**/
+	/*	###選0xc009a000的原因是kernel堆疊從0xc00f000，而PCB從0xc00e000，
+		###0xc00e000-0xc009a000=0x4000=4分頁大小，
+		###目前分配4分頁的大小給點陣圖表示可支援的總記憶體大小可以擴到32MB*4*4=512MB		*/ 
+	/* 内核物理内存池的页都在线性映射区中,不再占用内核虚拟地址,位图只管线性映射区之后的K_VADDR_POOL_SIZE */
+	kernel_vaddr.vaddr_bitmap.btmp_bytes_len = K_VADDR_POOL_SIZE / PG_SIZE / 8;
+/**==>##kernel_vaddr.vaddr_bitmap.btmp_bytes_len存的內容=核心虛擬位址點陣圖的長度(8位元算1單位長)**/
+
+    /* 物理内存池改用伙伴系统后,MEM_BITMAP_BASE处只剩内核虚拟地址的位图及其摘要层 */
+    kernel_vaddr.vaddr_bitmap.bits = (void*)MEM_BITMAP_BASE;
+    kernel_vaddr.vaddr_bitmap.summary = \
+       (uint32_t*)(MEM_BITMAP_BASE + BITMAP_SUMMARY_OFF(kernel_vaddr.vaddr_bitmap.btmp_bytes_len));
+/**==>##kernel_vaddr.vaddr_bitmap.bits存的是虛擬位址的點陣圖的器始位址**/
     
-	kernel_vaddr.vaddr_start = K_HEAP_START;
+	kernel_vaddr.vaddr_start = K_LINEAR_BASE + linear_end;
 /**==>##kernel_vaddr.vaddr_bitmap.bits存的是跨過低端1MB的起始地址**/
 /*	###K_HEAP_START=0xc0100000=1100000000_0100000000_000000000000
 	###="分頁目錄取c00、分頁表取400、偏移量取0"(筆記照相的記憶體圖的紅色粗箭頭位置)	*/
@@ -669,29 +1206,219 @@ static struct mem_block* arena2block(struct arena* a, uint32_t idx) {
     return (struct mem_block*)((uint32_t)a + sizeof(struct arena) + idx * a->desc->block_size);
 }
 
-/* 返回内存块b所在的arena地址 */
+/* 返回虚拟地址vaddr所映射的物理页框的描述符 */
+struct page* vaddr2page(uint32_t vaddr) {
+    return pfn2page(addr_v2p(vaddr) / PG_SIZE);
+}
+
+/* 返回内存块b所在的arena地址.
+ * arena可能跨多页,所以不能再直接取页首,而是从b所在页框的描述符中取 */
 static struct arena* block2arena(struct mem_block* b) {
-    return (struct arena*)((uint32_t)b & 0xfffff000);
+    return (struct arena*)vaddr2page((uint32_t)b)->private;
 }
 
-/* 在堆中申请size字节内存 */
-void* sys_malloc(uint32_t size) {
-   enum pool_flags PF;
+/* 从desc中取出一个空闲块.内核堆的描述符为各线程共用,调用者需持有内核内存池的锁;
+ * 用户堆的描述符是进程私有的,只在申请页框时加锁.
+ * 优先从部分分配的arena中取块,其次复用缓存的空arena,
+ * 都没有时才创建新的arena提供mem_block */
+static struct mem_block* arena_block_get(enum pool_flags PF, struct mem_block_desc* desc) {
+   struct pool* mem_pool = PF == PF_KERNEL ? &kernel_pool : &user_pool;
+   struct arena* a;
+   struct mem_block* b;
+   if (!list_empty(&desc->partial_list)) {
+      a = elem2entry(struct arena, arena_tag, desc->partial_list.head.next);
+   } 
+   else if (!list_empty(&desc->empty_list)) {
+      a = elem2entry(struct arena, arena_tag, list_pop(&desc->empty_list));
+      desc->empty_cnt--;
+      list_push(&desc->partial_list, &a->arena_tag);
+   } 
+   else {
+      /* 用户堆的块可以不清0返回,所以新arena的页框必须清0,免得把别的进程留下的数据带给用户 */
+      pool_lock(mem_pool);
+      a = malloc_page_common(PF, desc->pages_per_arena, PF == PF_USER);       // 分配pages_per_arena页框做为arena
+      lock_release(&mem_pool->lock);
+		
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~第15章g~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~	
+      struct task_struct* cur_thread = running_thread();//<=================================
+      page_dir_activate(cur_thread);                    //<=================================
+      /*
+      ####bochs會出現bug!!!
+      ####不知為何，bochs會誤讀分頁表，把虛擬地址誤映射到物理位址
+      ####也不知為何原因，重新載入cr3可以消除此bug!!!
+      */
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+		
+      if (a == NULL) {
+	 return NULL;
+      }
+      if (PF == PF_USER) {
+	 pages_zero(a, desc->pages_per_arena);
+      }
+      /* 对于分配的小块内存,将desc置为相应内存块描述符, 
+       * cnt置为此arena可用的内存块数,large置为false */
+      a->desc = desc;
+      a->large = false;
+      a->cnt = desc->blocks_per_arena;
+      uint32_t block_idx;
+
+      /* arena的每一页都记下arena的地址,供block2arena使用 */
+      for (block_idx = 0; block_idx < desc->pages_per_arena; block_idx++) {
+	 vaddr2page((uint32_t)a + block_idx * PG_SIZE)->private = a;
+      }
+	
+      /* 开始将arena拆分成内存块,并添加到arena自己的free_list中 */
+      list_init(&a->free_list);
+      for (block_idx = 0; block_idx < desc->blocks_per_arena; block_idx++) {
+	 b = arena2block(a, block_idx);
+	 list_append(&a->free_list, &b->free_elem);	
+      }
+      list_push(&desc->partial_list, &a->arena_tag);
+   }    
+
+   b = elem2entry(struct mem_block, free_elem, list_pop(&a->free_list));
+   a->cnt--;		   // 将此arena中的空闲内存块数减1
+   if (a->cnt == 0) {   // 块已分完,移到full_list
+      list_remove(&a->arena_tag);
+      list_append(&desc->full_list, &a->arena_tag);
+   }
+   return b;
+}
+
+/* 把块b还给所在的arena,加锁的要求同arena_block_get */
+static void arena_block_put(enum pool_flags PF, struct mem_block* b) {
+   struct arena* a = block2arena(b);
+   struct mem_block_desc* desc = a->desc;
+   /* 先将内存块回收到所在arena的free_list */
+   list_push(&a->free_list, &b->free_elem);
+
+   /* 原先已分满的arena现在有了空闲块,移回partial_list */
+   if (++a->cnt == 1) {
+      list_remove(&a->arena_tag);
+      list_push(&desc->partial_list, &a->arena_tag);
+   }
+
+   /* 再判断此arena中的内存块是否都是空闲,如果是就缓存或释放arena.
+    * 块都在arena自己的链表上,不必再逐块从描述符的链表中摘除 */
+   if (a->cnt == desc->blocks_per_arena) {
+      list_remove(&a->arena_tag);
+      if (desc->empty_cnt < EMPTY_ARENA_CACHE) {
+	 list_push(&desc->empty_list, &a->arena_tag);
+	 desc->empty_cnt++;
+      } else {
+	 struct pool* mem_pool = PF == PF_KERNEL ? &kernel_pool : &user_pool;
+	 pool_lock(mem_pool);
+	 mfree_page(PF, a, desc->pages_per_arena); 
+	 lock_release(&mem_pool->lock);
+      }
+   } 
+}
+
+#ifdef SELFTEST
+/* 开机自检对比用:为true时内核堆的小块不经magazine,
+ * 每次申请释放都加锁直接存取arena,即改用magazine之前的做法 */
+bool k_mags_off;
+
+/* 取内核内存池的加锁次数和等锁次数 */
+void kernel_pool_lock_stat(uint32_t* lock_cnt, uint32_t* wait_cnt) {
+   enum intr_status old_status = intr_disable();
+   *lock_cnt = kernel_pool.lock_cnt;
+   *wait_cnt = kernel_pool.wait_cnt;
+   intr_set_status(old_status);
+}
+#endif
+
+/* magazine只由所属任务自己访问,压入弹出都不用加锁 */
+static void mag_push(struct mem_magazine* mag, struct mem_block* b) {
+   b->free_elem.next = (struct list_elem*)mag->top;
+   mag->top = b;
+   mag->cnt++;
+}
+
+static struct mem_block* mag_pop(struct mem_magazine* mag) {
+   struct mem_block* b = mag->top;
+   mag->top = (struct mem_block*)b->free_elem.next;
+   mag->cnt--;
+   return b;
+}
+
+/* 从当前任务的magazine中取一个内核堆的块.
+ * magazine空了才加一次锁,从arena中批量补充mag_batch个 */
+static struct mem_block* mag_block_get(struct mem_magazine* mag, struct mem_block_desc* desc) {
+#ifdef SELFTEST
+   if (k_mags_off) {
+      pool_lock(&kernel_pool);
+      struct mem_block* b = arena_block_get(PF_KERNEL, desc);
+      lock_release(&kernel_pool.lock);
+      return b;
+   }
+#endif
+   if (mag->cnt == 0) {
+      pool_lock(&kernel_pool);
+      while (mag->cnt < desc->mag_batch) {
+	 struct mem_block* b = arena_block_get(PF_KERNEL, desc);
+	 if (b == NULL) {
+	    break;
+	 }
+	 mag_push(mag, b);
+      }
+      lock_release(&kernel_pool.lock);
+      if (mag->cnt == 0) {
+	 return NULL;
+      }
+   }
+   return mag_pop(mag);
+}
+
+/* 把内核堆的块b放回当前任务的magazine.
+ * magazine满了(2倍mag_batch)才加一次锁,批量归还mag_batch个给arena */
+static void mag_block_put(struct mem_magazine* mag, struct mem_block_desc* desc, struct mem_block* b) {
+#ifdef SELFTEST
+   if (k_mags_off) {
+      pool_lock(&kernel_pool);
+      arena_block_put(PF_KERNEL, b);
+      lock_release(&kernel_pool.lock);
+      return;
+   }
+#endif
+   if (mag->cnt >= desc->mag_batch * 2) {
+      pool_lock(&kernel_pool);
+      uint32_t cnt = desc->mag_batch;
+      while (cnt-- > 0) {
+	 arena_block_put(PF_KERNEL, mag_pop(mag));
+      }
+      lock_release(&kernel_pool.lock);
+   }
+   mag_push(mag, b);
+}
+
+/* 把任务magazine中缓存的内核堆块全部还给arena,任务退出前调用 */
+void k_mags_drain(struct mem_magazine* mags) {
+   pool_lock(&kernel_pool);
+   uint32_t desc_idx;
+   for (desc_idx = 0; desc_idx < DESC_CNT; desc_idx++) {
+      while (mags[desc_idx].cnt > 0) {
+	 arena_block_put(PF_KERNEL, mag_pop(&mags[desc_idx]));
+      }
+   }
+   lock_release(&kernel_pool.lock);
+}
+
+/* 在堆中申请size字节内存,zero为true时返回前清0 */
+static void* heap_alloc(enum pool_flags PF, uint32_t size, bool zero) {
    struct pool* mem_pool;
    uint32_t pool_size;
    struct mem_block_desc* descs;
    struct task_struct* cur_thread = running_thread();
 
-/* 判断用哪个内存池*/
-   if (cur_thread->pgdir == NULL) {     // 若为内核线程
-      PF = PF_KERNEL; 
-      pool_size = kernel_pool.pool_size;
+/* 内核堆为所有任务共用,用户堆是当前进程自己的 */
+   pool_size = frames.total_pages * PG_SIZE;
+   if (PF == PF_KERNEL) {
       mem_pool = &kernel_pool;
       descs = k_block_descs;
    } 
    else {				      // 用户进程pcb中的pgdir会在为其分配页表时创建
-      PF = PF_USER;
-      pool_size = user_pool.pool_size;
+      ASSERT(cur_thread->pgdir != NULL);
       mem_pool = &user_pool;
       descs = cur_thread->u_block_desc;
    }
@@ -702,34 +1429,40 @@ void* sys_malloc(uint32_t size) {
    }
    struct arena* a;
    struct mem_block* b;	
-   lock_acquire(&mem_pool->lock);
 
-/* 超过最大内存块1024, 就分配页框 */
-   if (size > 1024) {
+/* 超过最大规格的内存块, 就分配页框 */
+   if (size > descs[DESC_CNT - 1].block_size) {
       uint32_t page_cnt = DIV_ROUND_UP(size + sizeof(struct arena), PG_SIZE);    // 向上取整需要的页框数
 
-      a = malloc_page(PF, page_cnt);
+      /* 页框在申请时就全部装上,内存不足时返回NULL,调用者的出错处理才有效.
+       * 内核的大块凑不出连续页框时由malloc_page_common改到vmalloc区逐页映射.
+       * 给用户的页框不管是否要求清0都得清,免得泄露别的进程的数据 */
+      bool need_zero = zero || PF == PF_USER;
+      pool_lock(mem_pool);
+      a = malloc_page_common(PF, page_cnt, need_zero);
+      lock_release(&mem_pool->lock);
+      if (a != NULL && need_zero) {
+	 pages_zero(a, page_cnt);	 // 将分配的内存清0,在锁外做
+      }
 
       if (a != NULL) {
-		memset(a, 0, page_cnt * PG_SIZE);	 // 将分配的内存清0  
 
 		/* 对于分配的大块页框,将desc置为NULL, cnt置为页框数,large置为true */
 		a->desc = NULL;
 		a->cnt = page_cnt;
 		a->large = true;
-		lock_release(&mem_pool->lock);
+		vaddr2page((uint32_t)a)->private = a;	 // 返回的地址和arena头在同一页
 		
 		return (void*)(a + 1);		 // 跨过arena大小，把剩下的内存返回
 	/*	###int a[x]; a+1實際是橫跨4位元組的大小，因為int佔4位元組，
 		###因此a + 1就是橫跨1個struct arena* a之結構的大小。	*/
       } 
 	  else { 
-		lock_release(&mem_pool->lock);
 		return NULL; 
       }
    }   
    
-   else {    // 若申请的内存小于等于1024,可在各种规格的mem_block_desc中去适配
+   else {    // 若申请的内存不超过最大规格,可在各种规格的mem_block_desc中去适配
       uint8_t desc_idx;
       
       /* 从内存块描述符中匹配合适的内存块规格 */
@@ -738,56 +1471,64 @@ void* sys_malloc(uint32_t size) {
 			break;
 		}
       }
+      struct mem_block_desc* desc = &descs[desc_idx];
 
-   /* 若mem_block_desc的free_list中已经没有可用的mem_block,
-    * 就创建新的arena提供mem_block */
-      if (list_empty(&descs[desc_idx].free_list)) {
-		a = malloc_page(PF, 1);       // 分配1页框做为arena
-		
-//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~第15章g~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~	
-		struct task_struct* cur_thread = running_thread();//<=================================
-		page_dir_activate(cur_thread);                    //<=================================
-		/*
-		####bochs會出現bug!!!
-		####不知為何，bochs會誤讀分頁表，把虛擬地址誤映射到物理位址
-		####也不知為何原因，重新載入cr3可以消除此bug!!!
-		*/
-//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-		
-		if (a == NULL) {
-			lock_release(&mem_pool->lock);
-			return NULL;
-		}
-		memset(a, 0, PG_SIZE);
-	
-		/* 对于分配的小块内存,将desc置为相应内存块描述符, 
-		* cnt置为此arena可用的内存块数,large置为false */
-		a->desc = &descs[desc_idx];
-		a->large = false;
-		a->cnt = descs[desc_idx].blocks_per_arena;
-		uint32_t block_idx;
-	
-		enum intr_status old_status = intr_disable();
-	
-		/* 开始将arena拆分成内存块,并添加到内存块描述符的free_list中 */
-		for (block_idx = 0; block_idx < descs[desc_idx].blocks_per_arena; block_idx++) {
-			b = arena2block(a, block_idx);
-			ASSERT(!elem_find(&a->desc->free_list, &b->free_elem));
-			list_append(&a->desc->free_list, &b->free_elem);	
-		}
-		intr_set_status(old_status);
-      }    
-
-   /* 开始分配内存块 */
-      b = elem2entry(struct mem_block, free_elem, list_pop(&(descs[desc_idx].free_list)));
-      memset(b, 0, descs[desc_idx].block_size);
+   /* 内核堆的描述符为所有内核线程共用,先走本任务的magazine,少抢锁.
+    * 用户堆的描述符是进程私有的,直接从arena取块 */
+      if (PF == PF_KERNEL) {
+		b = mag_block_get(&cur_thread->k_mags[desc_idx], desc);
+      } 
+	  else {
+		b = arena_block_get(PF, desc);
+      }
+      if (b == NULL) {
+		return NULL;
+      }
 
-      a = block2arena(b);  // 获取内存块b所在的arena
-      a->cnt--;		   // 将此arena中的空闲内存块数减1
-      lock_release(&mem_pool->lock);
+   /* 清0在锁外做,统计量只需关中断保护 */
+      if (zero) {
+		memset(b, 0, desc->block_size);
+      }
+      enum intr_status old_status = intr_disable();
+      desc->alloc_cnt++;
+      desc->req_bytes += size;
+      intr_set_status(old_status);
       return (void*)b;
    }
 }
+
+/* 在内核堆中申请size字节内存,内容清0.不管当前是内核线程还是用户进程,都从内核堆分配 */
+void* kmalloc(uint32_t size) {
+   return heap_alloc(PF_KERNEL, size, true);
+}
+
+/* 同kmalloc,但不清0.给马上会把内存整个写一遍的调用者用 */
+void* kmalloc_nozero(uint32_t size) {
+   return heap_alloc(PF_KERNEL, size, false);
+}
+
+/* 在当前进程的用户堆中申请size字节内存,内容清0 */
+void* umalloc(uint32_t size) {
+   return heap_alloc(PF_USER, size, true);
+}
+
+/* 同umalloc,但不清0 */
+void* umalloc_nozero(uint32_t size) {
+   return heap_alloc(PF_USER, size, false);
+}
+
+/* malloc系统调用,用户的malloc不清0,要清0用calloc */
+void* sys_malloc(uint32_t size) {
+   return umalloc_nozero(size);
+}
+
+/* calloc系统调用,申请nmemb个size字节的元素,内容清0,相乘溢出时返回NULL */
+void* sys_calloc(uint32_t nmemb, uint32_t size) {
+   if (size != 0 && nmemb > 0xffffffff / size) {
+      return NULL;
+   }
+   return umalloc(nmemb * size);
+}
 /*	###統整:
 	###	sys_malloc函數主要是在做筆記照相的事，先確認你要申請的記憶體的size對應到的 區塊描述符號的 free_list 有沒有串列在上面
 	###	(核心只有唯一一個 區塊描述陣列 ，而每個使用者都有一個專屬的 區塊描述陣列 )，
@@ -813,43 +1554,96 @@ void* sys_malloc(uint32_t size) {
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~第12章f~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 /* 将物理地址pg_phy_addr回收到物理内存池 */
 void pfree(uint32_t pg_phy_addr) {
-   struct pool* mem_pool;
-   uint32_t bit_idx = 0;
-   if (pg_phy_addr >= user_pool.phy_addr_start) {     // 用户物理内存池
-      mem_pool = &user_pool;
-      bit_idx = (pg_phy_addr - user_pool.phy_addr_start) / PG_SIZE;
-   } 
-   else {	  // 内核物理内存池
-      mem_pool = &kernel_pool;
-      bit_idx = (pg_phy_addr - kernel_pool.phy_addr_start) / PG_SIZE;
+   /* 页框还被fork出的进程以写时复制的方式共享着,只减少引用 */
+   struct page* pg = pfn2page(pg_phy_addr / PG_SIZE);
+   enum intr_status old_status = intr_disable();
+   if (pg->ref_cnt > 0) {
+      pg->ref_cnt--;
+      intr_set_status(old_status);
+      return;
    }
-   bitmap_set(&mem_pool->pool_bitmap, bit_idx, 0);	 // 将位图中该位清0
+   intr_set_status(old_status);
+
+   /* 从页框所属的内存池名下去掉 */
+   pool_uncharge(pg->flags & PG_USER ? &user_pool : &kernel_pool, 1);
+   pg->flags &= ~PG_USER;
+   buddy_free(frame_buddy(pg_phy_addr / PG_SIZE), pg_phy_addr / PG_SIZE, 0);	 // 还回伙伴系统,能合并就与伙伴合并
 }
 
 /* 去掉页表中虚拟地址vaddr的映射,只去掉vaddr对应的pte */
 static void page_table_pte_remove(uint32_t vaddr) {
    uint32_t* pte = pte_ptr(vaddr);
    *pte &= ~PG_P_1;	// 将页表项pte的P位置0
-   asm volatile ("invlpg %0"::"m" (vaddr):"memory");    //更新tlb
+   asm volatile ("invlpg %0"::"m" (*(char*)vaddr):"memory");    //更新tlb
 }
 
 /* 在虚拟地址池中释放以_vaddr起始的连续pg_cnt个虚拟页地址 */
 static void vaddr_remove(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt) {
-   uint32_t bit_idx_start = 0, vaddr = (uint32_t)_vaddr, cnt = 0;
+   uint32_t bit_idx_start = 0, vaddr = (uint32_t)_vaddr;
 
    if (pf == PF_KERNEL) {  // 内核虚拟内存池
       bit_idx_start = (vaddr - kernel_vaddr.vaddr_start) / PG_SIZE;
-      while(cnt < pg_cnt) {
-		bitmap_set(&kernel_vaddr.vaddr_bitmap, bit_idx_start + cnt++, 0);
-      }
+      bitmap_clear_range(&kernel_vaddr.vaddr_bitmap, bit_idx_start, pg_cnt);
    } 
    else {  // 用户虚拟内存池
       struct task_struct* cur_thread = running_thread();
-      bit_idx_start = (vaddr - cur_thread->userprog_vaddr.vaddr_start) / PG_SIZE;
-      while(cnt < pg_cnt) {
-		bitmap_set(&cur_thread->userprog_vaddr.vaddr_bitmap, bit_idx_start + cnt++, 0);
+      region_remove(&cur_thread->userprog_vaddr, vaddr, vaddr + pg_cnt * PG_SIZE);
+   }
+}
+
+/* 若当前进程的用户虚拟地址vaddr已映射,释放其页框并清掉pte,虚拟地址位图不动 */
+void user_page_release(uint32_t vaddr) {
+   ASSERT(vaddr < 0xc0000000);
+   if (!(*pde_ptr(vaddr) & PG_P_1)) {
+      return;
+   }
+   uint32_t* pte = pte_ptr(vaddr);
+   if (*pte & PG_P_1) {
+      pfree(*pte & 0xfffff000);
+      *pte = 0;
+      asm volatile ("invlpg %0"::"m" (*(char*)vaddr):"memory");
+   }
+}
+
+/* 当前进程的用户虚拟地址vaddr所在页已装入且被写过时返回true */
+bool user_page_dirty(uint32_t vaddr) {
+   ASSERT(vaddr < 0xc0000000);
+   return (*pde_ptr(vaddr) & PG_P_1) && (*pte_ptr(vaddr) & (PG_P_1 | PG_DIRTY)) == (PG_P_1 | PG_DIRTY);
+}
+
+/* 在当前进程的虚拟地址池中占住连续pg_cnt页,不分配页框,成功返回起始地址,失败返回NULL */
+void* user_vaddr_get(uint32_t pg_cnt) {
+   return vaddr_get(PF_USER, pg_cnt);
+}
+
+/* 把当前进程的[start, end)登记为已占用,不分配页框.成功返回0,失败返回-1 */
+int32_t user_vaddr_mark(uint32_t start, uint32_t end) {
+   return region_insert(&running_thread()->userprog_vaddr, start, end);
+}
+
+/* 把当前进程的[start, end)归还给虚拟地址池,不动页表 */
+void user_vaddr_unmark(uint32_t start, uint32_t end) {
+   region_remove(&running_thread()->userprog_vaddr, start, end);
+}
+
+/* fork时给子进程复制一份已占用区间,只复制区间节点,开销与父进程占用的区间数成正比.
+ * 成功返回0,内存不足返回-1 */
+int32_t user_vaddr_fork(struct virtual_addr* child_vaddr, struct virtual_addr* parent_vaddr) {
+   child_vaddr->vaddr_start = parent_vaddr->vaddr_start;
+   list_init(&child_vaddr->region_list);
+   struct list_elem* elem = parent_vaddr->region_list.head.next;
+   while (elem != &parent_vaddr->region_list.tail) {
+      struct vaddr_region* parent_r = elem2entry(struct vaddr_region, region_tag, elem);
+      struct vaddr_region* r = kmalloc_nozero(sizeof(struct vaddr_region));
+      if (r == NULL) {
+	 return -1;
       }
+      r->start = parent_r->start;
+      r->end = parent_r->end;
+      list_append(&child_vaddr->region_list, &r->region_tag);
+      elem = elem->next;
    }
+   return 0;
 }
 
 /* 释放以虚拟地址vaddr为起始的cnt个物理页框 */
@@ -857,21 +1651,27 @@ void mfree_page(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt) {
 	uint32_t pg_phy_addr;
 	uint32_t vaddr = (int32_t)_vaddr, page_cnt = 0;
 	ASSERT(pg_cnt >=1 && vaddr % PG_SIZE == 0); 
+
+	/* vmalloc区中的页可能还没装入,整个区域交给vfree */
+	if (vaddr >= kernel_vaddr.vaddr_start) {
+		vfree(_vaddr);
+		return;
+	}
 	pg_phy_addr = addr_v2p(vaddr);  // 获取虚拟地址vaddr对应的物理地址
 
 	/* 确保待释放的物理内存在低端1M+1k大小的页目录+1k大小的页表地址范围外 */
 	//								^~~~~~		   ^~~~~~	4k大小?
 	ASSERT((pg_phy_addr % PG_SIZE) == 0 && pg_phy_addr >= 0x102000);
    
-	/* 判断pg_phy_addr属于用户物理内存池还是内核物理内存池 */
-	if (pg_phy_addr >= user_pool.phy_addr_start) {   // 位于user_pool内存池
+	/* 两个内存池的页框混在一起,按虚拟地址判断:内核页都在线性映射区中 */
+	if (vaddr < K_LINEAR_BASE) {   // 用户页
 		vaddr -= PG_SIZE;
 		while (page_cnt < pg_cnt) {
 			vaddr += PG_SIZE;
 			pg_phy_addr = addr_v2p(vaddr);
 	
-			/* 确保物理地址属于用户物理内存池 */
-			ASSERT((pg_phy_addr % PG_SIZE) == 0 && pg_phy_addr >= user_pool.phy_addr_start);
+			/* 确保页框记在用户内存池名下 */
+			ASSERT((pg_phy_addr % PG_SIZE) == 0 && (pfn2page(pg_phy_addr / PG_SIZE)->flags & PG_USER));
 	
 			/* 先将对应的物理页框归还到内存池 */
 			pfree(pg_phy_addr);
@@ -884,22 +1684,15 @@ void mfree_page(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt) {
 		/* 清空虚拟地址的位图中的相应位 */
 		vaddr_remove(pf, _vaddr, pg_cnt);
 	} 
-	else {	     // 位于kernel_pool内存池
-		vaddr -= PG_SIZE;	      
+	else {	     // 内核页
+		/* 内核页在线性映射区中,物理页框连续,页表也不用动,只需把页框还回去 */
+		pg_phy_addr = linear2phy(vaddr);
 		while (page_cnt < pg_cnt) {
-			vaddr += PG_SIZE;
-			pg_phy_addr = addr_v2p(vaddr);
-			/* 确保待释放的物理内存只属于内核物理内存池 */
-			ASSERT((pg_phy_addr % PG_SIZE) == 0 && \
-			pg_phy_addr >= kernel_pool.phy_addr_start && \
-			pg_phy_addr < user_pool.phy_addr_start);
+			/* 确保待释放的页框记在内核内存池名下 */
+			ASSERT(!(pfn2page(pg_phy_addr / PG_SIZE)->flags & PG_USER));
 		
-			/* 先将对应的物理页框归还到内存池 */
 			pfree(pg_phy_addr);
-		
-			/* 再从页表中清除此虚拟地址所在的页表项pte */
-			page_table_pte_remove(vaddr);
-		
+			pg_phy_addr += PG_SIZE;
 			page_cnt++;
 		}
 	/*	也可以寫成這樣?      
@@ -918,9 +1711,6 @@ void mfree_page(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt) {
 		
 			vaddr += PG_SIZE;
 		}	*/
-
-   	/* 清空虚拟地址的位图中的相应位 */
-   	vaddr_remove(pf, _vaddr, pg_cnt);
 	}
 }
 /*	###統整:
@@ -944,50 +1734,55 @@ void mfree_page(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt) {
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~第12章g~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-/* 回收内存ptr */
-void sys_free(void* ptr) {
+/* 把ptr还给PF所指的堆 */
+static void heap_free(enum pool_flags PF, void* ptr) {
    ASSERT(ptr != NULL);
    if (ptr != NULL) {
-      enum pool_flags PF;
       struct pool* mem_pool;
+      struct task_struct* cur_thread = running_thread();
 
-	/* 判断是线程还是进程 */
-      if (running_thread()->pgdir == NULL) {
+      if (PF == PF_KERNEL) {
 		ASSERT((uint32_t)ptr >= K_HEAP_START);
-		PF = PF_KERNEL; 
 		mem_pool = &kernel_pool;
       } 
 	  else {
-		PF = PF_USER;
+		ASSERT(cur_thread->pgdir != NULL && (uint32_t)ptr < 0xc0000000);
 		mem_pool = &user_pool;
       }
 
-      lock_acquire(&mem_pool->lock);   
       struct mem_block* b = ptr;
       struct arena* a = block2arena(b);	     // 把mem_block转换成arena,获取元信息
       ASSERT(a->large == 0 || a->large == 1);
-      if (a->desc == NULL && a->large == true) { // 大于1024的内存
+      if (a->desc == NULL && a->large == true) { // 大于最大规格的内存
+		pool_lock(mem_pool);
 		mfree_page(PF, a, a->cnt); 
+		lock_release(&mem_pool->lock); 
       } 
-	  else {				 // 小于等于1024的内存块
-		/* 先将内存块回收到free_list */
-		list_append(&a->desc->free_list, &b->free_elem);
-
-		/* 再判断此arena中的内存块是否都是空闲,如果是就释放arena */
-		if (++a->cnt == a->desc->blocks_per_arena) {
-			uint32_t block_idx;
-			for (block_idx = 0; block_idx < a->desc->blocks_per_arena; block_idx++) {
-				struct mem_block*  b = arena2block(a, block_idx);
-				ASSERT(elem_find(&a->desc->free_list, &b->free_elem));
-				list_remove(&b->free_elem);
-			}
-	    mfree_page(PF, a, 1); 
-		} 
-      }   
-      lock_release(&mem_pool->lock); 
+	  else if (PF == PF_KERNEL) {	 // 内核堆的小块先放回本任务的magazine
+		uint32_t desc_idx = a->desc - k_block_descs;
+		mag_block_put(&cur_thread->k_mags[desc_idx], a->desc, b);
+      } 
+	  else {				 // 用户堆的小块直接还给arena
+		arena_block_put(PF, b);
+      }
    }
 }
 
+/* 回收kmalloc申请的内存ptr */
+void kfree(void* ptr) {
+   heap_free(PF_KERNEL, ptr);
+}
+
+/* 回收umalloc申请的内存ptr */
+void ufree(void* ptr) {
+   heap_free(PF_USER, ptr);
+}
+
+/* free系统调用 */
+void sys_free(void* ptr) {
+   ufree(ptr);
+}
+
 /*	###統整:
 	###	sys_free函數為sys_malloc的反向，目的是把用完的 串列 重新塞回 free_list中，
 	###	若arena所屬的所有串列(b)全部都塞回去了，那要把arena所屬的分頁整個釋放掉，
@@ -999,9 +1794,274 @@ void sys_free(void* ptr) {
 	###	如果要釋放的是小記憶體(小於等於1024Byte)，則把b塞回free_list，然後a->cnt加1，
 	###	此時若arena所屬的所有串列(b)都塞回去了，即a->cnt == a->desc->blocks_per_arena，則要把arena所屬的分頁整個釋放掉，
 	###	用for迴圈把b一個一個從free_list remove掉，最後再釋放掉arena所屬的分頁，
+	###	(現在改成每個arena有自己的free_list，區塊描述符號只記arena掛在partial/full/empty哪個串列，
+	###	 所以不用再一個一個remove，全空的arena也會先留EMPTY_ARENA_CACHE個不還回去)
 	###	請看筆記照相!!!															*/
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
+/* 某一规格内存块的统计结果 */
+struct desc_stat {
+   uint32_t arena_cnt;		 // arena数
+   uint32_t used_blocks;	 // 已分配出去的块数
+};
+
+/* 统计desc下的arena数和已分配块数,调用者需持有对应内存池的锁 */
+static void desc_stat_collect(struct mem_block_desc* desc, struct desc_stat* st) {
+   struct list* lists[3] = {&desc->partial_list, &desc->full_list, &desc->empty_list};
+   uint32_t list_idx;
+   st->arena_cnt = st->used_blocks = 0;
+   for (list_idx = 0; list_idx < 3; list_idx++) {
+      struct list_elem* elem = lists[list_idx]->head.next;
+      while (elem != &lists[list_idx]->tail) {
+	 struct arena* a = elem2entry(struct arena, arena_tag, elem);
+	 st->arena_cnt++;
+	 st->used_blocks += desc->blocks_per_arena - a->cnt;
+	 elem = elem->next;
+      }
+   }
+}
+
+/* 将val以十进制追加到buf末尾,用空格补齐到width宽 */
+static void pad_append(char* buf, uint32_t val, uint32_t width) {
+   char* end = buf + strlen(buf);
+   uint32_t len = sprintf(end, "%d", val);
+   while (len < width) {
+      end[len++] = ' ';
+   }
+   end[len] = 0;
+}
+
+/* 打印descs中各规格内存块的使用情况.
+ * 缓存在各任务magazine中的块也算在USED里.
+ * WASTE%是arena头部和末尾放不下一个块的空间占arena的比例,
+ * FRAG%是按累计申请字节数估算的块内浪费,即内部碎片 */
+static void heap_info_print(char* title, struct mem_block_desc* descs, struct pool* mem_pool) {
+   struct desc_stat st[DESC_CNT];
+   uint32_t desc_idx;
+
+   /* 先在锁内统计,打印放到锁外 */
+   lock_acquire(&mem_pool->lock);
+   for (desc_idx = 0; desc_idx < DESC_CNT; desc_idx++) {
+      desc_stat_collect(&descs[desc_idx], &st[desc_idx]);
+   }
+   lock_release(&mem_pool->lock);
+
+   char* head = "SIZE   PAGES  BLOCKS ARENAS USED   FREE   WASTE% FRAG%\n";
+   sys_write(stdout_no, title, strlen(title));
+   sys_write(stdout_no, head, strlen(head));
+
+   char buf[64];
+   for (desc_idx = 0; desc_idx < DESC_CNT; desc_idx++) {
+      struct mem_block_desc* desc = &descs[desc_idx];
+      uint32_t arena_bytes = desc->pages_per_arena * PG_SIZE;
+      uint32_t waste = (arena_bytes - desc->blocks_per_arena * desc->block_size) * 100 / arena_bytes;
+      uint32_t frag = 0;
+      if (desc->alloc_cnt > 0) {
+	 frag = (desc->block_size - desc->req_bytes / desc->alloc_cnt) * 100 / desc->block_size;
+      }
+      buf[0] = 0;
+      pad_append(buf, desc->block_size, 7);
+      pad_append(buf, desc->pages_per_arena, 7);
+      pad_append(buf, desc->blocks_per_arena, 7);
+      pad_append(buf, st[desc_idx].arena_cnt, 7);
+      pad_append(buf, st[desc_idx].used_blocks, 7);
+      pad_append(buf, st[desc_idx].arena_cnt * desc->blocks_per_arena - st[desc_idx].used_blocks, 7);
+      pad_append(buf, waste, 7);
+      pad_append(buf, frag, 0);
+      strcat(buf, "\n");
+      sys_write(stdout_no, buf, strlen(buf));
+   }
+}
+
+/* 打印物理内存池及内核堆、当前进程堆的使用情况 */
+void sys_meminfo(void) {
+   char buf[64];
+   sprintf(buf, "free pages: %d/%d, %d high, %d zeroed, low watermark %d\n", \
+	   frames_free(), frames.total_pages, frames.high_buddy.free_pages, frames.zero_cnt, frames.low_watermark);
+   sys_write(stdout_no, buf, strlen(buf));
+   sprintf(buf, "kernel pool pages: %d used, %d peak, limit %d, %d refused\n", \
+	   kernel_pool.used_pages, kernel_pool.peak_pages, kernel_pool.soft_limit, kernel_pool.limit_hits);
+   sys_write(stdout_no, buf, strlen(buf));
+   sprintf(buf, "user pool pages: %d used, %d peak, limit %d, %d refused\n", \
+	   user_pool.used_pages, user_pool.peak_pages, user_pool.soft_limit, user_pool.limit_hits);
+   sys_write(stdout_no, buf, strlen(buf));
+   sprintf(buf, "kernel pool lock: %d acquires, %d waits\n", kernel_pool.lock_cnt, kernel_pool.wait_cnt);
+   sys_write(stdout_no, buf, strlen(buf));
+   sprintf(buf, "user pool lock: %d acquires, %d waits\n", user_pool.lock_cnt, user_pool.wait_cnt);
+   sys_write(stdout_no, buf, strlen(buf));
+
+   heap_info_print("kernel heap:\n", k_block_descs, &kernel_pool);
+   kmem_cache_info_print();
+   struct task_struct* cur = running_thread();
+   if (cur->pgdir != NULL) {
+      heap_info_print("user heap:\n", cur->u_block_desc, &user_pool);
+   }
+}
+
+/* fork时让子进程以写时复制的方式共享当前进程的用户空间,须关中断调用.
+ * 只复制页表:可写的页在父子进程中都改为只读并打上PG_COW,页框的ref_cnt加1,
+ * 之后谁先写,谁就在page_fault_handler中得到自己的一份.
+ * 页表页框不够时返回-1 */
+int32_t user_space_cow_share(uint32_t* child_pgdir) {
+   ASSERT(intr_get_status() == INTR_OFF);
+   uint32_t pde_idx;
+   for (pde_idx = 0; pde_idx < 768; pde_idx++) {	 // 第768项起是共用的内核空间
+      uint32_t vaddr = pde_idx << 22;
+      if (!(*pde_ptr(vaddr) & PG_P_1)) {
+	 continue;
+      }
+      void* pt_phyaddr = palloc(&kernel_pool);
+      if (pt_phyaddr == NULL) {
+	 return -1;
+      }
+
+      uint32_t* pte = pte_ptr(vaddr);	 // 父进程这张页表的第0项
+      uint32_t pte_idx;
+      for (pte_idx = 0; pte_idx < 1024; pte_idx++) {
+	 if (!(pte[pte_idx] & PG_P_1)) {
+	    continue;
+	 }
+	 if ((pte[pte_idx] & PG_RW_W) && !(pte[pte_idx] & PG_SHARED)) {	 // 共享映射的页父子进程一直共用
+	    pte[pte_idx] = (pte[pte_idx] & ~PG_RW_W) | PG_COW;
+	 }
+	 pfn2page(pte[pte_idx] >> 12)->ref_cnt++;
+      }
+      void* pt_vaddr = kmap((uint32_t)pt_phyaddr);
+      memcpy(pt_vaddr, pte, PG_SIZE);
+      kunmap(pt_vaddr);
+      child_pgdir[pde_idx] = (uint32_t)pt_phyaddr | PG_US_U | PG_RW_W | PG_P_1;
+   }
+   /* 父进程的页表项改成了只读,重新加载cr3刷新整个tlb */
+   asm volatile ("movl %%cr3, %%eax; movl %%eax, %%cr3" : : : "eax", "memory");
+   return 0;
+}
+
+/* 进程退出时释放当前进程的整个用户空间:逐个页目录项归还已装入的页框和页表所占的页框,
+ * 写时复制共享着的页框只减少引用.再把已占用区间的节点还给内核堆 */
+void user_space_release(void) {
+   struct task_struct* cur = running_thread();
+   ASSERT(cur->pgdir != NULL);
+   uint32_t pde_idx;
+   for (pde_idx = 0; pde_idx < 768; pde_idx++) {
+      uint32_t vaddr = pde_idx << 22;
+      uint32_t* pde = pde_ptr(vaddr);
+      if (!(*pde & PG_P_1)) {
+	 continue;
+      }
+      uint32_t* pte = pte_ptr(vaddr);
+      uint32_t pte_idx;
+      for (pte_idx = 0; pte_idx < 1024; pte_idx++) {
+	 if (pte[pte_idx] & PG_P_1) {
+	    pfree(pte[pte_idx] & 0xfffff000);
+	 }
+      }
+      /* 先断开页目录项再还页表页框,免得页框被别人拿去后还挂在页目录里 */
+      uint32_t pt_phyaddr = *pde & 0xfffff000;
+      *pde = 0;
+      pfree(pt_phyaddr);
+   }
+   asm volatile ("movl %%cr3, %%eax; movl %%eax, %%cr3" : : : "eax", "memory");
+
+   struct list* region_list = &cur->userprog_vaddr.region_list;
+   while (!list_empty(region_list)) {
+      kfree(elem2entry(struct vaddr_region, region_tag, list_pop(region_list)));
+   }
+}
+
+/* 写时复制:当前页表中pte映射vaddr所在页且打了PG_COW,为其换上可写的私有页框 */
+static void cow_page_copy(uint32_t vaddr, uint32_t* pte) {
+   uint32_t page_vaddr = vaddr & 0xfffff000;
+   uint32_t old_phyaddr = *pte & 0xfffff000;
+   struct page* old_pg = pfn2page(old_phyaddr / PG_SIZE);
+
+   if (old_pg->ref_cnt == 0) {	 // 其它共享者都已复制走或已释放,直接改回可写
+      *pte = (*pte & ~PG_COW) | PG_RW_W;
+   } 
+   else {
+         uint32_t new_phyaddr = (uint32_t)palloc(&user_pool);
+      if (new_phyaddr == 0) {
+	 PANIC("cow_page_copy: out of memory");
+      }
+      void* new_vaddr = kmap(new_phyaddr);
+      memcpy(new_vaddr, (void*)page_vaddr, PG_SIZE);
+      kunmap(new_vaddr);
+      pfn2page(new_phyaddr / PG_SIZE)->private = old_pg->private;	 // 堆中的页框还记着arena
+      old_pg->ref_cnt--;
+      *pte = new_phyaddr | (*pte & 0xfff & ~PG_COW) | PG_RW_W;
+   }
+   asm volatile ("invlpg %0"::"m" (*(char*)page_vaddr):"memory");
+}
+
+/* 页错误(0x0e)处理程序,处理写时复制和按需调页,其它情况打印地址后悬停 */
+static void page_fault_handler(uint8_t vec_nr UNUSED) {
+   uint32_t vaddr;
+   asm ("movl %%cr2, %0" : "=r" (vaddr));	 // cr2是存放造成page_fault的地址
+
+   if (vaddr < 0xc0000000) {
+      /* pde的判断要在pte之前,否则pde不存在时访问pte本身也会缺页 */
+      uint32_t* pte = pte_ptr(vaddr);
+      bool present = (*pde_ptr(vaddr) & PG_P_1) && (*pte & PG_P_1);
+      if (present && (*pte & PG_COW)) {
+	 cow_page_copy(vaddr, pte);
+	 return;
+      }
+      /* 还没装入的页若属于某段映射,就从文件读入或填0 */
+      if (!present && vma_fault(vaddr)) {
+	 return;
+      }
+   } else if (vaddr >= kernel_vaddr.vaddr_start && vmalloc_fault(vaddr)) {
+      return;
+   }
+
+   /* 用户态的非法访问(空指针、写只读的代码段等)只结束该进程,内核态的缺页仍然停机.
+    * 从3特权级进入时cpu换到esp0,中断栈正好在pcb页顶;kernel.S压入的中断号就是
+    * 本函数的参数,以此确认页顶的中断栈是这次缺页的,而不是系统调用进入内核时留下的 */
+   struct task_struct* cur = running_thread();
+   struct intr_stack* intr_0_stack = (struct intr_stack*)((uint32_t)cur + PG_SIZE - sizeof(struct intr_stack));
+   if (cur->pgdir != NULL && (intr_0_stack->cs & 3) == 3 && \
+       (uint32_t)intr_0_stack == (uint32_t)__builtin_frame_address(0) + 8) {
+      put_str("\n");put_str(cur->name);put_str(": segmentation fault, addr is ");put_int(vaddr);put_str("\n");
+      sys_exit(-1);
+   }
+
+   put_str("\npage fault addr is ");put_int(vaddr);
+   PANIC("page_fault_handler: unexpected page fault");
+}
+
+/* 处理器支持全局页(cpuid功能号1,edx第13位)时,把内核页表中已有的pte都打上PG_G并打开cr4.PGE.
+ * 内核空间在各进程的页目录中都一样,切换进程重新加载cr3时这部分tlb就不会被冲掉.
+ * 页表的页目录项不打G,否则经第1023项自映射访问页表时会留下全局的tlb项;
+ * 大页的页目录项本身就是映射,要打G,它们在各页目录中都一样,自映射留下的全局tlb项也没有问题.
+ * 没有大页时第0项页目录项与第768项共用页表,低端1M的恒等映射也会变成全局的,进入进程后内核不应再用到它 */
+static void kernel_pages_global(void) {
+   uint32_t eax = 1, ebx, ecx, edx;
+   asm volatile ("cpuid" : "+a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx));
+   if (!(edx & (1 << 13))) {
+      return;
+   }
+   uint32_t pde_idx;
+   for (pde_idx = 768; pde_idx < 1023; pde_idx++) {
+      uint32_t vaddr = pde_idx << 22;
+      uint32_t* pde = pde_ptr(vaddr);
+      if (!(*pde & PG_P_1)) {
+	 continue;
+      }
+      if (*pde & PG_PS) {	 // 大页的G位就在页目录项中
+	 *pde |= PG_G;
+	 continue;
+      }
+      uint32_t* pte = pte_ptr(vaddr);
+      uint32_t pte_idx;
+      for (pte_idx = 0; pte_idx < 1024; pte_idx++) {
+	 if (pte[pte_idx] & PG_P_1) {
+	    pte[pte_idx] |= PG_G;
+	 }
+      }
+   }
+   kernel_pte_flags |= PG_G;
+   asm volatile ("movl %%cr4, %%eax; orl $0x80, %%eax; movl %%eax, %%cr4" : : : "eax", "memory");
+}
+
 /* 内存管理部分初始化入口 */
 void mem_init() {
     put_str("mem_init start\n");
@@ -1014,10 +2074,46 @@ void mem_init() {
 	/* 初始化mem_block_desc数组descs,为malloc做准备 */
     block_desc_init(k_block_descs);
 	//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+    /* 预留kmap的临时映射槽 */
+    kmap_base = (uint32_t)vaddr_get(PF_KERNEL, KMAP_SLOTS);
+
+    /* 置CR0的WP位,内核写只读的用户页也会引发页错误,写时复制才对系统调用同样有效 */
+    asm volatile ("movl %%cr0, %%eax; orl $0x10000, %%eax; movl %%eax, %%cr0" : : : "eax", "memory");
+    /* 0x0e是中断门,处理程序在关中断下运行.按需调页要读盘,vma_fault读文件前会自己开中断,
+     * 所以不能在关中断才成立的临界区里访问还没装入的用户页 */
+    register_handler(0x0e, page_fault_handler);
+
+    kernel_pages_global();
 	
     put_str("mem_init done\n");
 }
 
+/* 由idle线程调用:取一个空闲页框清0,挂到zero_list上.
+ * 已攒够ZERO_PAGES_MAX或没有空闲页框时返回false */
+bool page_prezero(void) {
+   if (frames.zero_cnt >= ZERO_PAGES_MAX) {
+      return false;
+   }
+   int32_t pfn = buddy_alloc(&frames.buddy, 0);
+   if (pfn == -1) {
+      return false;
+   }
+
+   /* 空闲页框没有映射,经kmap访问来清0 */
+   void* vaddr = kmap((uint32_t)pfn * PG_SIZE);
+   memset(vaddr, 0, PG_SIZE);
+   kunmap(vaddr);
+
+   struct page* pg = pfn2page(pfn);
+   pg->flags |= PG_ZEROED;
+   enum intr_status old_status = intr_disable();
+   list_append(&frames.zero_list, &pg->free_elem);
+   frames.zero_cnt++;
+   intr_set_status(old_status);
+   return true;
+}
+
 /*
 ###需要注意:
 ### 當使用者系統呼叫了以後，會從TSS拿核心態的esp，
@@ -3,6 +3,7 @@
 #include "stdint.h"
 #include "bitmap.h"
 #include "list.h"
+#include "buddy.h"
 
 /* 内存池标记,用于判断用哪个内存池 */
 enum pool_flags {
@@ -16,11 +17,32 @@ enum pool_flags {
 #define	 PG_RW_W  2	// R/W 属性位值, 读/写/执行
 #define	 PG_US_S  0	// U/S 属性位值, 系统级
 #define	 PG_US_U  4	// U/S 属性位值, 用户级
+#define	 PG_DIRTY 0x40	// D 脏位,页被写过后由处理器置1
+#define	 PG_PS	  0x80	// PS 页目录项的此位为1表示直接映射一个4M的大页,不再经过页表
+#define	 PG_G	  0x100	// G 全局位,cr4.PGE打开后重新加载cr3也不会冲掉此页的tlb项,只用于内核页
+#define	 PG_COW	  0x200	// 页表项中留给软件用的AVL位,表示此页写时复制
+#define	 PG_SHARED 0x400	// 另一个AVL位,表示此页属于共享映射,fork时不做写时复制
+
+/* 物理内存从0起线性映射到内核空间的K_LINEAR_BASE处,最多映射K_LINEAR_MAX字节,
+ * 内核分配到的页框都经这里访问,虚拟地址与物理地址只差一个常数 */
+#define K_LINEAR_BASE  0xc0000000
+#define K_LINEAR_MAX   0x30000000
+#define linear2phy(vaddr)  ((uint32_t)(vaddr) - K_LINEAR_BASE)
+#define phy2linear(paddr)  ((void*)((uint32_t)(paddr) + K_LINEAR_BASE))
+
+/* 用户进程中已占用的一段虚拟地址[start, end),页对齐 */
+struct vaddr_region {
+   uint32_t start;
+   uint32_t end;
+   struct list_elem region_tag;	 // 按地址升序挂在virtual_addr.region_list上
+};
 
 /* 用于虚拟地址管理 */
 struct virtual_addr {
 /* 虚拟地址用到的位图结构，用于记录哪些虚拟地址被占用了。以页为单位。*/
    struct bitmap vaddr_bitmap;
+/* 用户进程不用位图,已占用的虚拟地址按区间记在这里,互不相邻也不重叠 */
+   struct list region_list;
 /* 管理的虚拟地址 */
    uint32_t vaddr_start;
 };
@@ -34,11 +56,30 @@ struct mem_block {
 /* 内存块描述符 */
 struct mem_block_desc {
    uint32_t block_size;		 // 内存块大小
+   uint32_t pages_per_arena;	 // 每个arena占用的页框数
    uint32_t blocks_per_arena;// 本arena中可容纳此mem_block的数量.
-   struct list free_list;	 // 目前可用的mem_block链表
+   /* 空闲块挂在各arena自己的free_list上,arena按空闲程度挂在下面三个链表上 */
+   struct list partial_list;	 // 部分块已分配的arena
+   struct list full_list;	 // 块已全部分配出去的arena
+   struct list empty_list;	 // 块全部空闲、暂不归还的arena
+   uint32_t empty_cnt;		 // empty_list上的arena数
+   uint32_t alloc_cnt;		 // 累计分配次数
+   uint32_t req_bytes;		 // 累计申请的字节数,和alloc_cnt一起用来估算内部碎片
+   uint32_t mag_batch;		 // magazine与arena之间一次批量交换的块数
 };
 
-#define DESC_CNT 7	   		 // 内存块描述符个数
+/* 任务私有的内核堆内存块缓存,每种规格一个,最多存2倍mag_batch个块.
+ * 块之间借用free_elem.next串成单链表 */
+struct mem_magazine {
+   struct mem_block* top;
+   uint32_t cnt;
+};
+
+#define DESC_CNT 10	   		 // 内存块描述符个数
+#define EMPTY_ARENA_CACHE 2	 // 每种规格最多缓存的空arena数
+#define ARENA_MAX_PAGES 4	 // 一个arena最多占用的页框数
+#define MAG_BATCH_MAX 4	 	 // mag_batch的上限
+#define ZERO_PAGES_MAX 128	 // 最多预先清0的页框数
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
 extern struct pool kernel_pool, user_pool;
@@ -48,6 +89,10 @@ void* malloc_page(enum pool_flags pf, uint32_t pg_cnt);
 void malloc_init(void);
 uint32_t* pte_ptr(uint32_t vaddr);
 uint32_t* pde_ptr(uint32_t vaddr);
+void* kmap(uint32_t pg_phyaddr);
+void kunmap(void* vaddr);
+void* vmalloc(uint32_t size);
+void vfree(void* vaddr);
 
 //~~~~~~~~~~~~~~~~~~第11章b~~~~~~~~~~~~~~~~~~~~~~
 uint32_t addr_v2p(uint32_t vaddr);
@@ -56,14 +101,38 @@ void* get_user_pages(uint32_t pg_cnt);
 
 //~~~~~~~~~~~~~~~~~~第12章e~~~~~~~~~~~~~~~~~~~~~~
 void block_desc_init(struct mem_block_desc* desc_array);
+void block_desc_fork(struct mem_block_desc* desc_array, struct mem_block_desc* parent_array);
+void* kmalloc(uint32_t size);
+void* kmalloc_nozero(uint32_t size);
+void kfree(void* ptr);
+void* umalloc(uint32_t size);
+void* umalloc_nozero(uint32_t size);
+void ufree(void* ptr);
 void* sys_malloc(uint32_t size);
+void* sys_calloc(uint32_t nmemb, uint32_t size);
+void sys_meminfo(void);
+void k_mags_drain(struct mem_magazine* mags);
+#ifdef SELFTEST
+extern bool k_mags_off;
+void kernel_pool_lock_stat(uint32_t* lock_cnt, uint32_t* wait_cnt);
+#endif
+struct page* vaddr2page(uint32_t vaddr);
 
 //~~~~~~~~~~~~~~~~~~第12章g~~~~~~~~~~~~~~~~~~~~~~
 void mfree_page(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt);
 void pfree(uint32_t pg_phy_addr);
 void sys_free(void* ptr);
+void user_page_release(uint32_t vaddr);
+bool user_page_dirty(uint32_t vaddr);
+void* user_vaddr_get(uint32_t pg_cnt);
+int32_t user_vaddr_mark(uint32_t start, uint32_t end);
+void user_vaddr_unmark(uint32_t start, uint32_t end);
+int32_t user_vaddr_fork(struct virtual_addr* child_vaddr, struct virtual_addr* parent_vaddr);
 
 //~~~~~~~~~~~~~~~~~~第15章a~~~~~~~~~~~~~~~~~~~~~~
 void* get_a_page_without_opvaddrbitmap(enum pool_flags pf, uint32_t vaddr);
+bool page_prezero(void);
+int32_t user_space_cow_share(uint32_t* child_pgdir);
+void user_space_release(void);
 
 #endif
@@ -0,0 +1,382 @@
+#include "selftest.h"
+#include "stdint.h"
+#include "global.h"
+#include "debug.h"
+#include "bitmap.h"
+#include "timer.h"
+#include "stdio-kernel.h"
+#include "thread.h"
+#include "memory.h"
+#include "sync.h"
+#include "list.h"
+
+#ifdef SELFTEST
+#ifdef NDEBUG
+#error "SELFTEST relies on ASSERT, build it without DEBUG=0"
+#endif
+
+/* 自检用的伪随机数,线性同余 */
+static uint32_t rand_seed = 20221017;
+static uint32_t rand_next(uint32_t range) {
+   rand_seed = rand_seed * 1103515245 + 12345;
+   return (rand_seed >> 8) % range;
+}
+
+/* 内核线程不能从函数返回,自检线程做完后挂起,由main等它挂起后回收 */
+static void selftest_reap(struct task_struct* pthread) {
+   while (pthread->status != TASK_HANGING) {
+      mtime_sleep(10);
+   }
+   thread_exit(pthread);
+}
+
+//===============================位图===============================
+/* 4101字节:1025个整字加最后一个只有1字节的不完整字,摘要层要跨过多个32位字 */
+#define BTMP_BYTES 4101
+static uint32_t btmp_bits[DIV_ROUND_UP(BTMP_BYTES, 4)];
+static uint32_t btmp_summary[BITMAP_SUMMARY_BYTES(BTMP_BYTES) / 4];
+
+/* 原来的bitmap_scan:逐字节跳过0xff,再逐位数连续的0.从start开始找,找不到返回-1 */
+static int32_t old_scan_from(struct bitmap* btmp, uint32_t start, uint32_t cnt) {
+   uint32_t bit_len = btmp->btmp_bytes_len * 8;
+   uint32_t bit_idx = start, count = 0;
+   while (bit_idx < bit_len) {
+      if (count == 0 && bit_idx % 8 == 0 && btmp->bits[bit_idx / 8] == 0xff) {
+	 bit_idx += 8;
+	 continue;
+      }
+      if (bitmap_scan_test(btmp, bit_idx)) {
+	 count = 0;
+      } else if (++count == cnt) {
+	 return bit_idx - cnt + 1;
+      }
+      bit_idx++;
+   }
+   return -1;
+}
+
+/* 按bitmap_scan的next-fit规则用原来的逐位算法找一遍,作为对照 */
+static int32_t old_scan(struct bitmap* btmp, uint32_t cnt) {
+   uint32_t start = btmp->hint < btmp->btmp_bytes_len * 8 ? btmp->hint : 0;
+   int32_t bit_idx = old_scan_from(btmp, start, cnt);
+   if (bit_idx == -1 && start != 0) {
+      bit_idx = old_scan_from(btmp, 0, cnt);
+   }
+   return bit_idx;
+}
+
+/* 摘要层的每一位都应与对应的字是否全满一致,超出位图的位按已占用算 */
+static void summary_check(struct bitmap* btmp) {
+   uint32_t bit_len = btmp->btmp_bytes_len * 8;
+   uint32_t word_idx, words = DIV_ROUND_UP(btmp->btmp_bytes_len, 4);
+   for (word_idx = 0; word_idx < words; word_idx++) {
+      bool full = true;
+      uint32_t bit_idx;
+      for (bit_idx = word_idx * 32; bit_idx < word_idx * 32 + 32 && bit_idx < bit_len; bit_idx++) {
+	 if (!bitmap_scan_test(btmp, bit_idx)) {
+	    full = false;
+	    break;
+	 }
+      }
+      ASSERT(((btmp->summary[word_idx / 32] >> (word_idx % 32)) & 1) == (uint32_t)full);
+   }
+}
+
+/* 把整个位图置1后清出[bit_idx, bit_idx + cnt),hint回到0 */
+static void btmp_hole(struct bitmap* btmp, uint32_t bit_idx, uint32_t cnt) {
+   bitmap_set_range(btmp, 0, btmp->btmp_bytes_len * 8);
+   bitmap_clear_range(btmp, bit_idx, cnt);
+   btmp->hint = 0;
+}
+
+/* 随机置位、清位并申请,每次申请都与原来的逐位算法对照 */
+static void btmp_random_check(struct bitmap* btmp, uint32_t rounds) {
+   static const uint8_t cnts[] = {1, 2, 3, 7, 31, 32, 33, 64};
+   uint32_t bit_len = btmp->btmp_bytes_len * 8;
+   while (rounds-- > 0) {
+      uint32_t op = rand_next(4);
+      uint32_t bit_idx = rand_next(bit_len);
+      uint32_t cnt = 1 + rand_next(70);
+      if (bit_idx + cnt > bit_len) {
+	 cnt = bit_len - bit_idx;
+      }
+      if (op == 0) {
+	 bitmap_clear_range(btmp, bit_idx, cnt);
+      } else if (op == 1) {
+	 bitmap_set_range(btmp, bit_idx, cnt);
+      } else {
+	 cnt = cnts[rand_next(sizeof(cnts))];
+	 int32_t expect = old_scan(btmp, cnt);
+	 int32_t got = bitmap_scan(btmp, cnt);
+	 ASSERT(got == expect);
+	 if (got != -1) {
+	    bitmap_set_range(btmp, got, cnt);
+	 }
+      }
+   }
+}
+
+/* 从头扫描rounds次的平均纳秒数,old为true时用原来的逐位算法 */
+static uint32_t btmp_scan_ns(struct bitmap* btmp, uint32_t cnt, bool old, uint32_t rounds) {
+   uint32_t i;
+   uint64_t start = ktime_ns();
+   for (i = 0; i < rounds; i++) {
+      btmp->hint = 0;
+      if (old) {
+	 old_scan_from(btmp, 0, cnt);
+      } else {
+	 bitmap_scan(btmp, cnt);
+      }
+   }
+   return (uint32_t)(ktime_ns() - start) / rounds;
+}
+
+/* 位图自检:不完整的最后一个字、跨字的连续0、摘要层跳过全满的字、hint绕回,
+ * 再随机地与原来的逐位算法对照,最后比较两者的扫描耗时 */
+static void bitmap_selftest(void) {
+   struct bitmap btmp;
+   btmp.bits = (uint8_t*)btmp_bits;
+   btmp.btmp_bytes_len = BTMP_BYTES;
+   btmp.summary = btmp_summary;
+   bitmap_init(&btmp);
+   uint32_t bit_len = BTMP_BYTES * 8;
+
+   ASSERT(bitmap_scan(&btmp, 1) == 0 && btmp.hint == 1);
+   ASSERT(bitmap_scan(&btmp, 40) == 1);	 // 跨过第0、1两个字
+
+   bitmap_set_range(&btmp, 0, bit_len);
+   btmp.hint = 0;
+   ASSERT(bitmap_scan(&btmp, 1) == -1);
+   summary_check(&btmp);
+
+   /* 跨字的连续0:[30, 35)横跨第0和第1个字 */
+   btmp_hole(&btmp, 30, 5);
+   ASSERT(bitmap_scan(&btmp, 6) == -1);
+   ASSERT(bitmap_scan(&btmp, 5) == 30);
+
+   /* 最后一个不完整的字:位图之外的位按已占用算,不能拼进连续的0 */
+   btmp_hole(&btmp, bit_len - 3, 3);
+   ASSERT(bitmap_scan(&btmp, 4) == -1);
+   ASSERT(bitmap_scan(&btmp, 3) == (int32_t)bit_len - 3);
+
+   /* 摘要层:前面33个字全满,整段跳过 */
+   btmp_hole(&btmp, 33 * 32 + 7, 1);
+   summary_check(&btmp);
+   ASSERT(bitmap_scan(&btmp, 1) == 33 * 32 + 7);
+   summary_check(&btmp);
+
+   /* hint之后没有空位时要绕回开头 */
+   btmp_hole(&btmp, 5, 2);
+   btmp.hint = bit_len - 10;
+   ASSERT(bitmap_scan(&btmp, 2) == 5 && btmp.hint == 7);
+
+   /* 随机对照,先带摘要层,再去掉摘要层,最后重建摘要层检查一致 */
+   bitmap_init(&btmp);
+   btmp_random_check(&btmp, 3000);
+   summary_check(&btmp);
+   btmp.summary = NULL;
+   btmp_random_check(&btmp, 3000);
+   bitmap_attach_summary(&btmp, btmp_summary);
+   summary_check(&btmp);
+
+   /* 耗时对比:上半部分零散地空着300位,另有一段4位的空位在末尾附近 */
+   bitmap_set_range(&btmp, 0, bit_len);
+   uint32_t i;
+   for (i = 0; i < 300; i++) {	 // 间隔53位,都是单独的空位
+      bitmap_set(&btmp, bit_len / 2 + i * 53, 0);
+   }
+   bitmap_clear_range(&btmp, bit_len - 40, 4);
+   printk("bitmap selftest ok: 1 bit %d ns (old %d ns), 4 bits %d ns (old %d ns)\n", \
+	  btmp_scan_ns(&btmp, 1, false, 100), btmp_scan_ns(&btmp, 1, true, 100), \
+	  btmp_scan_ns(&btmp, 4, false, 100), btmp_scan_ns(&btmp, 4, true, 100));
+}
+
+//===============================内核堆===============================
+#define HEAP_WORKERS 3		 // 同时申请释放的线程数
+#define HEAP_ROUNDS 2000	 // 每个线程的轮数,每轮申请再释放heap_sizes中的各一块
+
+static const uint16_t heap_sizes[] = {16, 60, 200, 1000};
+
+/* 一次对比的结果,都是这段时间内的增量 */
+struct heap_stat {
+   uint32_t lock_cnt;		 // 内核内存池的加锁次数
+   uint32_t wait_cnt;		 // 加锁时锁被别人持有而阻塞的次数
+   uint32_t switch_cnt;		 // 任务切换次数
+};
+
+static void heap_worker(void* arg UNUSED) {
+   void* blocks[sizeof(heap_sizes) / sizeof(heap_sizes[0])];
+   uint32_t round, i, cnt = sizeof(heap_sizes) / sizeof(heap_sizes[0]);
+   for (round = 0; round < HEAP_ROUNDS; round++) {
+      for (i = 0; i < cnt; i++) {
+	 blocks[i] = kmalloc_nozero(heap_sizes[i]);
+	 ASSERT(blocks[i] != NULL);
+	 *(uint32_t*)blocks[i] = round;
+      }
+      for (i = 0; i < cnt; i++) {
+	 ASSERT(*(uint32_t*)blocks[i] == round);
+	 kfree(blocks[i]);
+      }
+   }
+   k_mags_drain(running_thread()->k_mags);
+   thread_block(TASK_HANGING);
+}
+
+/* 跑一遍HEAP_WORKERS个线程的申请释放,mags_off为true时内核堆不走magazine */
+static void heap_bench(bool mags_off, struct heap_stat* stat) {
+   struct task_struct* workers[HEAP_WORKERS];
+   uint32_t lock_start, wait_start, switch_start, i;
+   k_mags_off = mags_off;
+   kernel_pool_lock_stat(&lock_start, &wait_start);
+   switch_start = thread_switch_cnt();
+   for (i = 0; i < HEAP_WORKERS; i++) {
+      workers[i] = thread_start("heap_test", 20, heap_worker, NULL);
+   }
+   for (i = 0; i < HEAP_WORKERS; i++) {
+      selftest_reap(workers[i]);
+   }
+   stat->switch_cnt = thread_switch_cnt() - switch_start;
+   kernel_pool_lock_stat(&stat->lock_cnt, &stat->wait_cnt);
+   stat->lock_cnt -= lock_start;
+   stat->wait_cnt -= wait_start;
+   k_mags_off = false;
+}
+
+/* 内核堆对比:多个线程同时申请释放小块,分别不走和走magazine,
+ * 打印两次的加锁次数、等锁次数和任务切换次数.只做报告,不作断言 */
+static void heap_selftest(void) {
+   struct heap_stat off, on;
+   heap_bench(true, &off);
+   heap_bench(false, &on);
+   printk("heap bench: %d threads x %d rounds\n", HEAP_WORKERS, HEAP_ROUNDS);
+   printk("   lock per call: %d acquires, %d waits, %d switches\n", off.lock_cnt, off.wait_cnt, off.switch_cnt);
+   printk("   magazine:      %d acquires, %d waits, %d switches\n", on.lock_cnt, on.wait_cnt, on.switch_cnt);
+}
+
+//===============================优先级继承===============================
+#define PI_HOLD_TICKS 10	 // C来等锁之后,A再持锁运行的嘀嗒数
+#define PI_SPIN_TICKS 200	 // 两个B合计空转的嘀嗒数
+#define PI_TURN_TICKS 3	 // B每次空转的嘀嗒数,小于1级的时间片MLFQ_SLICE(1)
+
+/* 一次运行的结果 */
+struct pi_result {
+   uint32_t c_wait;		 // C在lock_acquire中等了多少嘀嗒
+   bool c_before_b;		 // C拿到锁时B是否还没跑完
+   uint8_t a_base;		 // A的base_priority
+   uint8_t a_boosted;		 // A放锁前的优先级
+   uint8_t a_released;		 // A放锁后的优先级
+};
+
+static struct lock pi_lock;
+static struct semaphore pi_b_turn[2];	 // 两个B轮流空转,拿到自己的信号量才能转
+static volatile bool pi_a_locked, pi_b_done;
+static volatile uint32_t pi_b_spun;	 // 两个B合计已空转的嘀嗒数
+static struct pi_result pi_res;
+
+/* 读当前的ticks,免得编译器把空转循环中的读取提到循环外 */
+static uint32_t ticks_now(void) {
+   return *(volatile uint32_t*)&ticks;
+}
+
+/* 在cpu上空转,直到自己运行时看到cnt次嘀嗒,被换下cpu的时间不算 */
+static void spin_ticks(uint32_t cnt) {
+   uint32_t last = ticks_now();
+   while (cnt > 0) {
+      uint32_t now = ticks_now();
+      if (now != last) {
+	 last = now;
+	 cnt--;
+      }
+   }
+}
+
+/* 低优先级的A:先拿锁,等C来等锁后再持锁运行PI_HOLD_TICKS个嘀嗒 */
+static void pi_low(void* arg UNUSED) {
+   struct task_struct* cur = running_thread();
+   pi_res.a_base = cur->base_priority;
+   lock_acquire(&pi_lock);
+   pi_a_locked = true;
+   while (*(volatile uint32_t*)&pi_lock.semaphore.waiter_prios == 0);
+   spin_ticks(PI_HOLD_TICKS);
+   pi_res.a_boosted = cur->priority;
+   lock_release(&pi_lock);
+   pi_res.a_released = cur->priority;
+   thread_block(TASK_HANGING);
+}
+
+/* 中优先级的B,共两个,不碰锁,轮流空转PI_TURN_TICKS个嘀嗒.
+ * 单个空转的任务时间片用完就降级,约30个嘀嗒后就和A同在3级,老化也救不了反转.
+ * 两个B在时间片用完之前就把cpu交给对方并阻塞,被唤醒时重新拿到满的时间片,
+ * 一直留在1级,A所在的3级在B跑完之前分不到cpu */
+static void pi_mid(void* arg) {
+   uint32_t me = (uint32_t)arg;
+   sema_down(&pi_b_turn[me]);
+   while (pi_b_spun < PI_SPIN_TICKS) {
+      spin_ticks(PI_TURN_TICKS);
+      pi_b_spun += PI_TURN_TICKS;
+      sema_up(&pi_b_turn[1 - me]);
+      sema_down(&pi_b_turn[me]);
+   }
+   pi_b_done = true;
+   sema_up(&pi_b_turn[1 - me]);	 // 让对方也退出循环
+   thread_block(TASK_HANGING);
+}
+
+/* 高优先级的C:等A手里的锁,记下等了多久、拿到锁时B是否已经跑完 */
+static void pi_high(void* arg UNUSED) {
+   uint32_t start = ticks_now();
+   lock_acquire(&pi_lock);
+   pi_res.c_wait = ticks_now() - start;
+   pi_res.c_before_b = !pi_b_done;
+   lock_release(&pi_lock);
+   thread_block(TASK_HANGING);
+}
+
+/* A(5)持锁,两个B(20)轮流空转,C(31)等锁,跑一遍并把结果存到res.
+ * donate_off为true时不借优先级 */
+static void pi_run(bool donate_off, struct pi_result* res) {
+   lock_donate_off = donate_off;
+   lock_init(&pi_lock);
+   sema_init(&pi_b_turn[0], 1);
+   sema_init(&pi_b_turn[1], 0);
+   pi_a_locked = pi_b_done = false;
+   pi_b_spun = 0;
+
+   struct task_struct* a = thread_start("pi_low", 5, pi_low, NULL);
+   while (!pi_a_locked) {
+      mtime_sleep(10);
+   }
+   struct task_struct* b0 = thread_start("pi_mid", 20, pi_mid, (void*)0);
+   struct task_struct* b1 = thread_start("pi_mid", 20, pi_mid, (void*)1);
+   struct task_struct* c = thread_start("pi_high", 31, pi_high, NULL);
+   selftest_reap(c);
+   selftest_reap(a);
+   selftest_reap(b0);
+   selftest_reap(b1);
+   lock_donate_off = false;
+   *res = pi_res;
+}
+
+/* 优先级继承自检:先关掉借优先级,C要等B全部跑完,即发生了优先级反转;
+ * 再打开,A借到C的优先级先于B运行,C的等待只比A的持锁时间略长,A放锁后回到base_priority */
+static void pi_selftest(void) {
+   struct pi_result off, on;
+   pi_run(true, &off);
+   pi_run(false, &on);
+
+   ASSERT(!off.c_before_b && off.c_wait >= PI_SPIN_TICKS);
+   ASSERT(off.a_boosted == off.a_base);
+   ASSERT(on.c_before_b && on.c_wait < PI_HOLD_TICKS * 2);
+   ASSERT(on.a_boosted == 31 && on.a_released == on.a_base);
+   printk("priority inheritance selftest ok: high waited %d ticks without donation, %d ticks with it\n", \
+	  off.c_wait, on.c_wait);
+}
+
+/* 依次执行各项自检,失败时由ASSERT停机并打印出错位置 */
+void selftest_run(void) {
+   bitmap_selftest();
+   heap_selftest();
+   pi_selftest();
+}
+
+#endif
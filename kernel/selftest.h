@@ -0,0 +1,5 @@
+#ifndef __KERNEL_SELFTEST_H
+#define __KERNEL_SELFTEST_H
+/* 开机自检,只在make SELFTEST=1时编入,由main在初始化完成后调用 */
+void selftest_run(void);
+#endif
@@ -14,6 +14,10 @@
 /* 将位图btmp初始化 */
 void bitmap_init(struct bitmap* btmp) {
    memset(btmp->bits, 0, btmp->btmp_bytes_len);   
+   if (btmp->summary != NULL) {
+      memset(btmp->summary, 0, BITMAP_SUMMARY_BYTES(btmp->btmp_bytes_len));
+   }
+   btmp->hint = 0;
 }
 
 /* 判断bit_idx位是否为1,若为1则返回true，否则返回false */
@@ -31,60 +35,128 @@ bool bitmap_scan_test(struct bitmap* btmp, uint32_t bit_idx) {
 	###然後把0x00000100跟第3個方框中的8個位元做and運算，
 	###即可判斷第27位(第3號方框內的第2位置)是否為1。	*/
 
-//===============##在位图中申请连续cnt个位,成功则返回其起始位下标，失败返回=============//
-/*	###法一:
-	###先連續找至少有一個0的"方框"，找到後就不再使用方框搜尋法，
-	###然後以該方框內的第0個位元為起點，一個一個位元搜尋，
-	###直到找到連續的0的數量=cnt為止。	*/
-int bitmap_scan(struct bitmap* btmp, uint32_t cnt) {
-   uint32_t idx_byte = 0;	 // 用于记录空闲位所在的字节
-/* 先逐字节比较,蛮力法 */
-   while ( (0xff == btmp->bits[idx_byte]) && (idx_byte < btmp->btmp_bytes_len) ) {
-/* ##1表示该位已分配,所以若为0xff,则表示该字节内已无空闲位,向下一字节继续找 */
-      idx_byte++;
-	  //##idx_byte單位是位元組
+#define WORD_FULL 0xffffffff
+
+/* 位图中32位字的个数,最后一个字可能不完整 */
+static uint32_t word_cnt(struct bitmap* btmp) {
+   return DIV_ROUND_UP(btmp->btmp_bytes_len, 4);
+}
+
+/* 取位图中第word_idx个字,超出btmp_bytes_len的部分按已占用处理 */
+static uint32_t word_get(struct bitmap* btmp, uint32_t word_idx) {
+   uint32_t byte_idx = word_idx * 4;
+   if (byte_idx + 4 <= btmp->btmp_bytes_len) {
+      return ((uint32_t*)btmp->bits)[word_idx];
+   }
+   /* 最后一个不完整的字逐字节拼出来,避免越界读 */
+   uint32_t word = WORD_FULL, i;
+   for (i = 0; byte_idx + i < btmp->btmp_bytes_len; i++) {
+      word &= ~(0xffU << (i * 8));
+      word |= (uint32_t)btmp->bits[byte_idx + i] << (i * 8);
    }
+   return word;
+}
 
-   ASSERT(idx_byte < btmp->btmp_bytes_len); //##false會ASSERT
-   if (idx_byte == btmp->btmp_bytes_len) {  // 若该内存池找不到可用空间		
-      return -1;
+/* 根据第word_idx个字是否已全满更新摘要层 */
+static void summary_update(struct bitmap* btmp, uint32_t word_idx) {
+   if (btmp->summary == NULL) {
+      return;
+   }
+   uint32_t mask = 1U << (word_idx % 32);
+   if (word_get(btmp, word_idx) == WORD_FULL) {
+      btmp->summary[word_idx / 32] |= mask;
+   } else {
+      btmp->summary[word_idx / 32] &= ~mask;
    }
+}
 
- /* ##若在位图数组范围内的某字节内找到了空闲位，
-  * ##在该字节内逐位比对,返回空闲位的索引。*/
-   int idx_bit = 0;
- /* 和btmp->bits[idx_byte]这个字节逐位对比 */
-   while ((uint8_t)(BITMAP_MASK << idx_bit) & btmp->bits[idx_byte]) { 
-	 idx_bit++;
+/* 从bit_idx开始找第一个为0的位,找不到返回-1 */
+static int32_t next_zero(struct bitmap* btmp, uint32_t bit_idx) {
+   uint32_t words = word_cnt(btmp);
+   uint32_t word_idx = bit_idx / 32;
+   if (word_idx >= words) {
+      return -1;
    }
-	 
-   int bit_idx_start = idx_byte * 8 + idx_bit;    // 空闲位在位图内的下标
-   if (cnt == 1) {
-      return bit_idx_start;
+
+   /* 第一个字中bit_idx之前的位不参与查找 */
+   uint32_t word = word_get(btmp, word_idx) | ((1U << (bit_idx % 32)) - 1);
+   if (word != WORD_FULL) {
+      return word_idx * 32 + bsf(~word);
    }
 
-   uint32_t bit_left = (btmp->btmp_bytes_len * 8 - bit_idx_start);   // 记录还有多少位可以判断
-   uint32_t next_bit = bit_idx_start + 1;
-   uint32_t count = 1;	      // 用于记录找到的空闲位的个数
+   word_idx++;
+   while (word_idx < words) {
+      if (btmp->summary != NULL) {
+	 /* 有摘要层时,一次跳过32个全满的字 */
+	 uint32_t sum = btmp->summary[word_idx / 32] | ((1U << (word_idx % 32)) - 1);
+	 if (sum == WORD_FULL) {
+	    word_idx = (word_idx / 32 + 1) * 32;
+	    continue;
+	 }
+	 word_idx = word_idx / 32 * 32 + bsf(~sum);
+	 if (word_idx >= words) {
+	    break;
+	 }
+      }
+      word = word_get(btmp, word_idx);
+      if (word != WORD_FULL) {
+	 return word_idx * 32 + bsf(~word);
+      }
+      word_idx++;
+   }
+   return -1;
+}
 
-   bit_idx_start = -1;	      // 先将其置为-1,若找不到连续的位就直接返回
-   while (bit_left-- > 0) {
-      if ( !(bitmap_scan_test(btmp, next_bit)) ) {	 // 若next_bit为0
-		count++;
-      } 
-	  else {
-		count = 0;
+/* 在[bit_idx, limit)中找第一个为1的位,找不到返回limit */
+static uint32_t next_one(struct bitmap* btmp, uint32_t bit_idx, uint32_t limit) {
+   while (bit_idx < limit) {
+      uint32_t word = word_get(btmp, bit_idx / 32) & ~((1U << (bit_idx % 32)) - 1);
+      if (word != 0) {
+	 uint32_t one = bit_idx / 32 * 32 + bsf(word);
+	 return one < limit ? one : limit;
       }
-	  
-      if (count == cnt) {	    // 若找到连续的cnt个空位
-		bit_idx_start = next_bit - cnt + 1;
-		break;
+      bit_idx = (bit_idx / 32 + 1) * 32;   // 整字为0,直接跳到下一个字
+   }
+   return limit;
+}
+
+/* 从start开始找连续cnt个0,找不到返回-1 */
+static int32_t scan_from(struct bitmap* btmp, uint32_t start, uint32_t cnt) {
+   uint32_t bit_len = btmp->btmp_bytes_len * 8;
+   int32_t free_idx = next_zero(btmp, start);
+   while (free_idx != -1 && (uint32_t)free_idx + cnt <= bit_len) {
+      /* 这一段0在end处被1打断,不够长就从end之后接着找 */
+      uint32_t end = next_one(btmp, free_idx, free_idx + cnt);
+      if (end - free_idx == cnt) {
+	 return free_idx;
       }
-      next_bit++;          
+      free_idx = next_zero(btmp, end);
+   }
+   return -1;
+}
+
+//===============##在位图中申请连续cnt个位,成功则返回其起始位下标，失败返回-1=============//
+/* 以32位字为单位,用bsf跳过整字的0或1,有摘要层时再跳过全满的字.
+ * 从上次分配结束的位置(hint)开始找,找不到再从头找一遍 */
+int bitmap_scan(struct bitmap* btmp, uint32_t cnt) {
+   ASSERT(cnt > 0);
+   uint32_t start = btmp->hint < btmp->btmp_bytes_len * 8 ? btmp->hint : 0;
+   int32_t bit_idx_start = scan_from(btmp, start, cnt);
+   if (bit_idx_start == -1 && start != 0) {
+      bit_idx_start = scan_from(btmp, 0, cnt);
+   }
+   if (bit_idx_start != -1) {
+      btmp->hint = bit_idx_start + cnt;
    }
    return bit_idx_start;
 }
 
+/*	###以下是原本逐位元組比較的幾種寫法，留作參考:
+	###法一(原本的寫法):
+	###先連續找至少有一個0的"方框"，找到後就不再使用方框搜尋法，
+	###然後以該方框內的第0個位元為起點，一個一個位元搜尋，
+	###直到找到連續的0的數量=cnt為止。	*/
+
 /*
 ###法二:
 ###最為暴力的方法，直接一個一個位元搜尋，
@@ -168,5 +240,63 @@ void bitmap_set(struct bitmap* btmp, uint32_t bit_idx, int8_t value) {
 	  /* 一般都会用个0x1这样的数对字节中的位操作,
 	   * 将1任意移动后再取反,或者先取反再移位,可用来对位置0操作。*/
    }
+   summary_update(btmp, bit_idx / 32);
+}
+
+/* 将位图btmp中从bit_idx开始的连续cnt位设置为value */
+static void bitmap_fill(struct bitmap* btmp, uint32_t bit_idx, uint32_t cnt, int8_t value) {
+   ASSERT(bit_idx + cnt <= btmp->btmp_bytes_len * 8);
+   uint32_t end = bit_idx + cnt;
+   uint32_t word_idx = bit_idx / 32;
+
+   while (bit_idx < end) {
+      if (bit_idx % 32 == 0 && bit_idx + 32 <= end) {	      // 整字
+	 ((uint32_t*)btmp->bits)[bit_idx / 32] = value ? WORD_FULL : 0;
+	 bit_idx += 32;
+      } else if (bit_idx % 8 == 0 && bit_idx + 8 <= end) {   // 整字节
+	 btmp->bits[bit_idx / 8] = value ? 0xff : 0;
+	 bit_idx += 8;
+      } else {
+	 uint8_t mask = BITMAP_MASK << (bit_idx % 8);
+	 if (value) {
+	    btmp->bits[bit_idx / 8] |= mask;
+	 } else {
+	    btmp->bits[bit_idx / 8] &= ~mask;
+	 }
+	 bit_idx++;
+      }
+   }
+
+   /* 最后统一更新涉及到的字的摘要 */
+   if (btmp->summary != NULL) {
+      while (word_idx <= (end - 1) / 32) {
+	 summary_update(btmp, word_idx++);
+      }
+   }
+}
+
+/* 将位图btmp中从bit_idx开始的连续cnt位置1 */
+void bitmap_set_range(struct bitmap* btmp, uint32_t bit_idx, uint32_t cnt) {
+   if (cnt > 0) {
+      bitmap_fill(btmp, bit_idx, cnt, 1);
+   }
+}
+
+/* 将位图btmp中从bit_idx开始的连续cnt位清0 */
+void bitmap_clear_range(struct bitmap* btmp, uint32_t bit_idx, uint32_t cnt) {
+   if (cnt > 0) {
+      bitmap_fill(btmp, bit_idx, cnt, 0);
+   }
+}
+
+/* 为已有内容的位图btmp挂上摘要层summary,并按现有的位重建摘要.
+ * summary需有BITMAP_SUMMARY_BYTES(btmp->btmp_bytes_len)字节 */
+void bitmap_attach_summary(struct bitmap* btmp, uint32_t* summary) {
+   btmp->summary = summary;
+   memset(summary, 0, BITMAP_SUMMARY_BYTES(btmp->btmp_bytes_len));
+   uint32_t word_idx, words = word_cnt(btmp);
+   for (word_idx = 0; word_idx < words; word_idx++) {
+      summary_update(btmp, word_idx);
+   }
 }
 
@@ -7,6 +7,10 @@ struct bitmap {
    uint32_t btmp_bytes_len;
 /* 在遍历位图时,整体上以字节为单位,细节上是以位为单位,所以此处位图的指针必须是单字节 */
    uint8_t* bits; //點陣圖的初始虛擬位址
+/* 摘要层,每位对应bits中的一个32位字,为1表示该字已全满,可为NULL */
+   uint32_t* summary;
+/* 下次扫描的起始位(next-fit) */
+   uint32_t hint;
 };
 /*	###描述點陣圖的struct只有兩個內容，這個struct表達的是"整個"點陣圖，
 	###btmp_bytes_len表達的是"整個"點陣圖的長度，
@@ -14,8 +18,29 @@ struct bitmap {
 	###而btis[0]指的是第0個框框內的第0個位元的位址，
 	###而btis[1]指的是第0個框框內的第0個位元的位址...。	*/
 
+/* 摘要层紧跟在位图之后存放时,摘要相对bits的偏移和所占字节数 */
+#define BITMAP_SUMMARY_OFF(bytes_len)	(((bytes_len) + 3) & ~3)
+#define BITMAP_SUMMARY_BYTES(bytes_len)	(DIV_ROUND_UP(DIV_ROUND_UP(bytes_len, 4), 32) * 4)
+
+/* 返回x中最低的1位的下标,x不能为0 */
+static inline uint32_t bsf(uint32_t x) {
+   uint32_t idx;
+   asm ("bsf %1, %0" : "=r" (idx) : "rm" (x));
+   return idx;
+}
+
+/* 返回x中最高的1位的下标,x不能为0 */
+static inline uint32_t bsr(uint32_t x) {
+   uint32_t idx;
+   asm ("bsr %1, %0" : "=r" (idx) : "rm" (x));
+   return idx;
+}
+
 void bitmap_init(struct bitmap* btmp);
 int bitmap_scan_test(struct bitmap* btmp, uint32_t bit_idx);
 int bitmap_scan(struct bitmap* btmp, uint32_t cnt);
 void bitmap_set(struct bitmap* btmp, uint32_t bit_idx, int8_t value);
+void bitmap_set_range(struct bitmap* btmp, uint32_t bit_idx, uint32_t cnt);
+void bitmap_clear_range(struct bitmap* btmp, uint32_t bit_idx, uint32_t cnt);
+void bitmap_attach_summary(struct bitmap* btmp, uint32_t* summary);
 #endif
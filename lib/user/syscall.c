@@ -84,11 +84,16 @@ uint32_t write(int32_t fd, const void* buf, uint32_t count) {
    return _syscall3(SYS_WRITE, fd, buf, count);
 }
 
-/* 申请size字节大小的内存,并返回结果 */
+/* 申请size字节大小的内存,并返回结果.内存内容不保证为0 */
 void* malloc(uint32_t size) {
    return (void*)_syscall1(SYS_MALLOC, size);
 }
 
+/* 申请nmemb个size字节大小的内存,内容清0 */
+void* calloc(uint32_t nmemb, uint32_t size) {
+   return (void*)_syscall2(SYS_CALLOC, nmemb, size);
+}
+
 /* 释放ptr指向的内存 */
 void free(void* ptr) {
    _syscall1(SYS_FREE, ptr);
@@ -186,4 +191,46 @@ void ps(void) {
 
 int execv(const char* pathname, char** argv) {
    return _syscall2(SYS_EXECV, pathname, argv);
-}
\ No newline at end of file
+}
+
+/* 显示内存池及堆的使用情况 */
+void meminfo(void) {
+   _syscall0(SYS_MEMINFO);
+}
+
+/* 把文件fd从offset起的length字节映射到内存,返回映射的起始地址,失败返回MAP_FAILED.
+ * 参数多于3个,打包成mmap_args传给内核 */
+void* mmap(void* addr, uint32_t length, uint32_t prot, uint32_t flags, int32_t fd, uint32_t offset) {
+   struct mmap_args args = {addr, length, prot, flags, fd, offset};
+   return (void*)_syscall1(SYS_MMAP, &args);
+}
+
+/* 撤销[addr, addr + length)内的文件映射,共享映射的修改写回文件 */
+int32_t munmap(void* addr, uint32_t length) {
+   return _syscall2(SYS_MUNMAP, addr, length);
+}
+
+/* 等待子进程退出,子进程的退出状态存到status,返回子进程pid,没有子进程时返回-1 */
+int16_t wait(int32_t* status) {
+   return _syscall1(SYS_WAIT, status);
+}
+
+/* 以状态status结束当前进程 */
+void exit(int32_t status) {
+   _syscall1(SYS_EXIT, status);
+}
+
+/* 把当前进程的优先级降低increment(为负时升高),返回新的优先级 */
+int32_t nice(int32_t increment) {
+   return _syscall1(SYS_NICE, increment);
+}
+
+/* 睡眠m_seconds毫秒,按时钟嘀嗒向上取整 */
+void msleep(uint32_t m_seconds) {
+   _syscall1(SYS_SLEEP, m_seconds);
+}
+
+/* 读时钟clock_id的当前时间到tp,目前只支持CLOCK_MONOTONIC,成功返回0 */
+int32_t clock_gettime(uint32_t clock_id, struct timespec* tp) {
+   return _syscall2(SYS_CLOCK_GETTIME, clock_id, tp);
+}
\ No newline at end of file
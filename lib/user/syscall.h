@@ -2,6 +2,8 @@
 #define __LIB_USER_SYSCALL_H
 #include "stdint.h"
 #include "fs.h"
+#include "vma.h"
+#include "timer.h"
 
 
 enum SYSCALL_NR {
@@ -27,12 +29,22 @@ enum SYSCALL_NR {
    SYS_REWINDDIR,
    SYS_STAT,
    SYS_PS,
-   SYS_EXECV
+   SYS_EXECV,
+   SYS_MEMINFO,
+   SYS_CALLOC,
+   SYS_MMAP,
+   SYS_MUNMAP,
+   SYS_WAIT,
+   SYS_EXIT,
+   SYS_NICE,
+   SYS_SLEEP,
+   SYS_CLOCK_GETTIME
 };
 
 uint32_t getpid(void);
 uint32_t write(int32_t fd, const void* buf, uint32_t count);
 void* malloc(uint32_t size);
+void* calloc(uint32_t nmemb, uint32_t size);
 void free(void* ptr);
 int16_t fork(void);
 int32_t read(int32_t fd, void* buf, uint32_t count);
@@ -53,5 +65,13 @@ int32_t stat(const char* path, struct stat* buf);
 int32_t chdir(const char* path);
 void ps(void);
 int execv(const char* pathname, char** argv);
+void meminfo(void);
+void* mmap(void* addr, uint32_t length, uint32_t prot, uint32_t flags, int32_t fd, uint32_t offset);
+int32_t munmap(void* addr, uint32_t length);
+int16_t wait(int32_t* status);
+void exit(int32_t status);
+int32_t nice(int32_t increment);
+void msleep(uint32_t m_seconds);
+int32_t clock_gettime(uint32_t clock_id, struct timespec* tp);
 #endif
 
@@ -202,6 +202,15 @@ void buildin_ps(uint32_t argc, char** argv UNUSED) {
    ps();
 }
 
+/* meminfo命令内建函数 */
+void buildin_meminfo(uint32_t argc, char** argv UNUSED) {
+   if (argc != 1) {
+      printf("meminfo: no argument support!\n");
+      return;
+   }
+   meminfo();
+}
+
 /* clear命令内建函数 */
 void buildin_clear(uint32_t argc, char** argv UNUSED) {
    if (argc != 1) {
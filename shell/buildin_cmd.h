@@ -9,5 +9,6 @@ int32_t buildin_rm(uint32_t argc, char** argv);
 void make_clear_abs_path(char* path, char* wash_buf);
 void buildin_pwd(uint32_t argc, char** argv);
 void buildin_ps(uint32_t argc, char** argv);
+void buildin_meminfo(uint32_t argc, char** argv);
 void buildin_clear(uint32_t argc, char** argv);
 #endif
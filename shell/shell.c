@@ -166,6 +166,8 @@ void my_shell(void) {
 		buildin_pwd(argc, argv);
       } else if (!strcmp("ps", argv[0])) {
 		buildin_ps(argc, argv);
+      } else if (!strcmp("meminfo", argv[0])) {
+		buildin_meminfo(argc, argv);
       } else if (!strcmp("clear", argv[0])) {
 		buildin_clear(argc, argv);
       } else if (!strcmp("mkdir", argv[0])){
@@ -179,10 +181,17 @@ void my_shell(void) {
 		
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~第15章g~~~~~~~~~~~~~~~~~~~~~~~~~~~	
 		int32_t pid = fork();
-		if (pid) {	   	// 父进程
-			/* 下面这个while必须要加上,否则父进程一般情况下会比子进程先执行,
-			因此会进行下一轮循环将findl_path清空,这样子进程将无法从final_path中获得参数*/
-			while(1);
+		if (pid == -1) {
+			printf("my_shell: fork failed\n");
+		} else if (pid) {	   	// 父进程
+			/* 等子进程结束后再进行下一轮循环,否则父进程一般情况下会比子进程先执行,
+			会把final_path清空,这样子进程将无法从final_path中获得参数.
+			wait同时回收子进程的资源 */
+			int32_t status;
+			int32_t child_pid = wait(&status);
+			if (child_pid == -1) {	// 按理说程序正确的话不会执行到这句,fork出的进程便是shell子进程
+				panic("my_shell: no child\n");
+			}
 		} else {	   	// 子进程
 			make_clear_abs_path(argv[0], final_path);
 			argv[0] = final_path;
@@ -194,7 +203,7 @@ void my_shell(void) {
 			} else {
 				execv(argv[0], argv);
 			}
-			while(1);
+			exit(-1);	// 走到这里说明没能执行新程序
 		}
       }
 	  
@@ -3,11 +3,39 @@
 #include "global.h"
 #include "debug.h"
 #include "interrupt.h"
+#include "bitmap.h"
 
 /* 初始化信号量 */
 void sema_init(struct semaphore* psema, uint8_t value) {
    psema->value = value;       // 为信号量赋初值
-   list_init(&psema->waiters); //初始化信号量的等待队列
+   psema->waiter_prios = 0;
+   uint32_t prio;
+   for (prio = 0; prio <= PRIO_MAX; prio++) {
+      list_init(&psema->waiters[prio]); //初始化信号量各优先级的等待队列
+   }
+}
+
+/* 把pthread按其优先级加到psema的等待队列 */
+static void waiter_add(struct semaphore* psema, struct task_struct* pthread) {
+   struct list* plist = &psema->waiters[pthread->priority];
+   list_append(plist, &pthread->general_tag);
+   psema->waiter_prios |= 1U << pthread->priority;
+   pthread->queue = plist;
+}
+
+/* 把pthread从psema的等待队列中摘下 */
+static void waiter_remove(struct semaphore* psema, struct task_struct* pthread) {
+   ASSERT(pthread->queue == &psema->waiters[pthread->priority]);
+   list_remove(&pthread->general_tag);
+   if (list_empty(pthread->queue)) {
+      psema->waiter_prios &= ~(1U << pthread->priority);
+   }
+   pthread->queue = NULL;
+}
+
+/* 返回psema上等待者的最高优先级,没有等待者时返回0 */
+static uint8_t waiter_prio_highest(struct semaphore* psema) {
+   return psema->waiter_prios == 0 ? 0 : bsr(psema->waiter_prios);
 }
 
 
@@ -24,13 +52,13 @@ void sema_down(struct semaphore* psema) {
 /* 关中断来保证原子操作 */
    enum intr_status old_status = intr_disable();
    while(psema->value == 0) {	// 若value为0,表示已经被别人持有
-      ASSERT(!elem_find(&psema->waiters, &running_thread()->general_tag));
-      /* 当前线程不应该已在信号量的waiters队列中 */
-      if (elem_find(&psema->waiters, &running_thread()->general_tag)) {
-		PANIC("sema_down: thread blocked has been in waiters_list\n");
-      }
+      struct task_struct* cur = running_thread();
+      /* 当前线程不应该已在信号量的waiters队列中,
+       * 靠queue字段O(1)判断,遍历队列的检查只在调试版本中进行 */
+      ASSERT(cur->queue == NULL);
+      ASSERT(!elem_find(&psema->waiters[cur->priority], &cur->general_tag));
 /* 若信号量的值等于0,则当前线程把自己加入该锁的等待队列,然后阻塞自己 */
-      list_append(&psema->waiters, &running_thread()->general_tag); 
+      waiter_add(psema, cur);
       thread_block(TASK_BLOCKED);    // 阻塞线程,直到被唤醒
    }
 /* 若value为1或被唤醒后,会执行下面的代码,也就是获得了锁。*/
@@ -61,13 +89,27 @@ void sema_down(struct semaphore* psema) {
 	###也就是回到進入中斷處理常式前的狀態。	*/
 
 
+/* 等待中的pthread优先级改为prio,把它换到对应的桶里,仍排在该桶的队尾.
+ * 由thread_priority_set调用,此时已关中断 */
+void sema_waiter_reprio(struct task_struct* pthread, uint8_t prio) {
+   ASSERT(intr_get_status() == INTR_OFF);
+   /* queue指向所在信号量的waiters[pthread->priority],由此找回信号量 */
+   struct list* bucket0 = pthread->queue - pthread->priority;
+   struct semaphore* psema = elem2entry(struct semaphore, waiters, bucket0);
+   waiter_remove(psema, pthread);
+   pthread->priority = prio;
+   waiter_add(psema, pthread);
+}
+
 /* 信号量的up操作 */
 void sema_up(struct semaphore* psema) {
 /* 关中断,保证原子操作 */
    enum intr_status old_status = intr_disable();
    ASSERT(psema->value == 0);	    
-   if (!list_empty(&psema->waiters)) {
-      struct task_struct* thread_blocked = elem2entry(struct task_struct, general_tag, list_pop(&psema->waiters));
+   if (psema->waiter_prios != 0) {    // 唤醒优先级最高的桶中最先来的
+      struct list* plist = &psema->waiters[waiter_prio_highest(psema)];
+      struct task_struct* thread_blocked = elem2entry(struct task_struct, general_tag, plist->head.next);
+      waiter_remove(psema, thread_blocked);
       thread_unblock(thread_blocked);
    }
    psema->value++;
@@ -76,22 +118,83 @@ void sema_up(struct semaphore* psema) {
    intr_set_status(old_status);
 }
 /*	###需要注意:
-	###此elem2entry內含有list_pop(&psema->waiters)，
+	###原本此處是elem2entry內含有list_pop(&psema->waiters)，
 	###等於會執行list_pop函數，把等待隊列(waiters)的第一個執行緒pop掉!
+	###現在改為喚醒優先級最高的等待者，用waiter_remove把它從所在的桶中摘下。
 	###
 	###sema_up函數內有改變鏈結串列的函數，避免沒接完A的時間就到，然後下一棒要用沒接完的鏈結串列的情況，
 	###所以sema_up函數內要關中斷，離開後要回到進入 sema_up函數前 的狀態
 	###(傳入intr_set_status函數的old_status是定義在 sema_up函數內的開頭 的)。	*/
 
 
+#ifdef SELFTEST
+bool lock_donate_off;	 // 开机自检对比用,为true时不借优先级,以便观察优先级反转
+#endif
+
+/* 计算pthread的有效优先级:自身优先级与其所持各锁上等待者最高优先级中的较大者 */
+uint8_t lock_priority_effective(struct task_struct* pthread) {
+   uint8_t prio = pthread->base_priority;
+#ifdef SELFTEST
+   if (lock_donate_off) {
+      return prio;
+   }
+#endif
+   struct list_elem* lock_elem = pthread->held_locks.head.next;
+   while (lock_elem != &pthread->held_locks.tail) {
+      struct lock* plock = elem2entry(struct lock, holder_tag, lock_elem);
+      uint8_t waiter_prio = waiter_prio_highest(&plock->semaphore);
+      if (waiter_prio > prio) {
+	 prio = waiter_prio;
+      }
+      lock_elem = lock_elem->next;
+   }
+   return prio;
+}
+
+/* 把优先级prio借给plock的持有者,若持有者也在等别的锁,沿着锁链继续往下借 */
+static void priority_donate(struct lock* plock, uint8_t prio) {
+#ifdef SELFTEST
+   if (lock_donate_off) {
+      return;
+   }
+#endif
+   uint32_t depth = 0;
+   while (plock != NULL && depth++ < LOCK_DONATE_DEPTH) {
+      struct task_struct* holder = plock->holder;
+      if (holder == NULL || holder->priority >= prio) {
+	 break;
+      }
+      thread_priority_set(holder, prio);
+      plock = holder->blocked_on;
+   }
+}
+
 /* 获取锁plock */
 void lock_acquire(struct lock* plock) {
 /* 排除曾经自己已经持有锁但还未将其释放的情况。*/
-   if (plock->holder != running_thread()) { 
+   struct task_struct* cur = running_thread();
+   if (plock->holder != cur) { 
+      enum intr_status old_status = intr_disable();
+      if (plock->semaphore.value == 0) {
+	 /* 锁已被别人持有,把自己的优先级借给持有者,以免持有者被中等优先级的任务压住 */
+	 cur->blocked_on = plock;
+	 priority_donate(plock, cur->priority);
+      }
       sema_down(&plock->semaphore);    // 对信号量P操作,原子操作
-      plock->holder = running_thread();
+      cur->blocked_on = NULL;
+      plock->holder = cur;
       ASSERT(plock->holder_repeat_nr == 0);
       plock->holder_repeat_nr = 1;
+      /* 创建主线程之前(如thread_init中创建init进程时)当前pcb尚未初始化,
+       * 那时只有一个执行流,不会有人等锁,不必记录持有的锁 */
+      if (main_thread != NULL) {
+	 list_append(&cur->held_locks, &plock->holder_tag);
+	 /* 其余等待者此后等的是自己,继承它们的优先级 */
+	 if (plock->semaphore.waiter_prios != 0) {
+	    thread_priority_set(cur, lock_priority_effective(cur));
+	 }
+      }
+      intr_set_status(old_status);
    } 
    else {
       plock->holder_repeat_nr++;
@@ -122,9 +225,23 @@ void lock_release(struct lock* plock) {
    }
    ASSERT(plock->holder_repeat_nr == 1);
 
+   struct task_struct* cur = running_thread();
+   enum intr_status old_status = intr_disable();
    plock->holder = NULL;	   // 把锁的持有者置空放在V操作之前
    plock->holder_repeat_nr = 0;
+   uint8_t old_prio = cur->priority;
+   if (main_thread != NULL) {
+      list_remove(&plock->holder_tag);
+      /* 归还从这把锁的等待者那里借来的优先级 */
+      thread_priority_set(cur, lock_priority_effective(cur));
+   }
    sema_up(&plock->semaphore);	   // 信号量的V操作,也是原子操作
+   intr_set_status(old_status);
+
+   /* 曾被借高优先级,说明有更高优先级的任务在等这把锁,立即让出cpu给它 */
+   if (cur->priority < old_prio && old_status == INTR_ON) {
+      thread_yield();
+   }
 }
 /*	###需要注意:
 	###lock_release函數的plock->holder = NULL的操作必須放在sema_up之前，
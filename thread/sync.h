@@ -4,17 +4,23 @@
 #include "stdint.h"
 #include "thread.h"
 
-/* 信号量结构 */
+/* 信号量结构.等待者按优先级分桶,waiter_prios第p位为1表示waiters[p]非空,
+ * 像thread.c中的ready_levels一样,取优先级最高的等待者只需一次bsr */
 struct semaphore {
    uint8_t  value;
-   struct   list waiters;
+   uint32_t waiter_prios;
+   struct   list waiters[PRIO_MAX + 1];
 };
 
+/* 优先级继承沿"持锁者正在等的锁"向下传递的最大层数,防止死锁成环时无限循环 */
+#define LOCK_DONATE_DEPTH 8
+
 /* 锁结构 */
 struct lock {
    struct   task_struct* holder;	    // 锁的持有者
    struct   semaphore semaphore;	    // 用二元信号量实现锁
    uint32_t holder_repeat_nr;		    // 锁的持有者重复申请锁的次数
+   struct   list_elem holder_tag;	    // 用于挂在持有者的held_locks队列中
 };
 
 void sema_init(struct semaphore* psema, uint8_t value); 
@@ -23,4 +29,9 @@ void sema_up(struct semaphore* psema);
 void lock_init(struct lock* plock);
 void lock_acquire(struct lock* plock);
 void lock_release(struct lock* plock);
+uint8_t lock_priority_effective(struct task_struct* pthread);
+void sema_waiter_reprio(struct task_struct* pthread, uint8_t prio);
+#ifdef SELFTEST
+extern bool lock_donate_off;
+#endif
 #endif
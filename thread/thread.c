@@ -19,6 +19,7 @@
 #include "stdio.h"
 #include "file.h"
 #include "fs.h"
+#include "timer.h"
 
 
 //#define PG_SIZE 4096 已經定義在global.h中
@@ -30,13 +31,20 @@ struct task_struct* main_thread;    // 主线程PCB
 //~~~~~~~~~~~~~~~~~~~~~~~第13章~~~~~~~~~~~~~~~~~~~~~~~~~~
 struct task_struct* idle_thread;    // idle线程
 
-struct list thread_ready_list;	    // 就绪队列
+struct list thread_ready_list[MLFQ_LEVELS];	// 各级就绪队列
+static uint32_t ready_levels;	    // 第i位为1表示第i级就绪队列非空
 struct list thread_all_list;	    // 所有任务队列
 
 //~~~~~~~~~~~~~~~~~~~~~~~第12章a~~~~~~~~~~~~~~~~~~~~~~~~~
 struct lock pid_lock;		    	// 分配pid锁
+/* pid位图,第i位为1表示PID_START + i这个pid已被占用,进程被回收时还回来 */
+#define PID_START 1
+#define MAX_PID_NR 1024
+static uint8_t pid_bitmap_bits[MAX_PID_NR / 8];
+static struct bitmap pid_bitmap;
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
+static uint32_t switch_cnt;	    // 任务切换次数,sys_ps中显示
 static struct list_elem* thread_tag;// 用于保存队列中的线程结点
 
 extern void switch_to(struct task_struct* cur, struct task_struct* next);
@@ -51,10 +59,25 @@ extern void init(void);
 static void idle(void* arg UNUSED) {
    while(1) {
       thread_block(TASK_BLOCKED);  
+
+      /* 趁空闲把空闲页框预先清0,一有任务就绪就回去让出cpu */
+      while (ready_levels == 0 && page_prezero());
+      if (ready_levels != 0) {
+	 continue;
+      }
+
+      /* 关中断后再确认一次没有任务就绪,停掉周期时钟后再hlt,
+       * sti的下一条指令执行完才响应中断,所以中断不会漏在sti和hlt之间 */
+      intr_disable();
+      if (ready_levels == 0) {
+	 timer_idle_enter();
 	  
-      //执行hlt时必须要保证目前处在开中断的情况下
-      asm volatile ("sti; hlt" : : : "memory");
+	 //执行hlt时必须要保证目前处在开中断的情况下
+	 asm volatile ("sti; hlt" : : : "memory");
 	  //###一定要用sti先開中斷，否則hlt後所有的外部中斷都不會有影響了。
+	 timer_idle_exit();
+      }
+      intr_enable();
    }
 }
 /*
@@ -93,10 +116,12 @@ static void kernel_thread(thread_func* function, void* func_arg) {
 //~~~~~~~~~~~~~~~~~~~~~~~第12章a~~~~~~~~~~~~~~~~~~~~~~~~~
 /* 分配pid */
 static pid_t allocate_pid(void) {
-   static pid_t next_pid = 0;
    lock_acquire(&pid_lock);
    
-   next_pid++;
+   int32_t bit_idx = bitmap_scan(&pid_bitmap, 1);
+   if (bit_idx != -1) {
+      bitmap_set(&pid_bitmap, bit_idx, 1);
+   }
 /*	###next_pid++可大致拆解為:
 	###	move, [num] 1
 	###	move, eax [next_pid]
@@ -113,7 +138,14 @@ static pid_t allocate_pid(void) {
 	###	所以next_pid++要用PV包起來。	*/
    
    lock_release(&pid_lock);
-   return next_pid;
+   return bit_idx == -1 ? -1 : bit_idx + PID_START;
+}
+
+/* 归还pid */
+static void release_pid(pid_t pid) {
+   lock_acquire(&pid_lock);
+   bitmap_set(&pid_bitmap, pid - PID_START, 0);
+   lock_release(&pid_lock);
 }
 
 
@@ -163,12 +195,17 @@ void init_thread(struct task_struct* pthread, char* name, int prio) {
 
 	//pthread->status = TASK_RUNNING; <---##第9章c以前設成此
 	pthread->priority = prio;
+	pthread->base_priority = prio;
     /* ###self_kstack是线程自己在内核态下使用的栈顶地址 */
     pthread->self_kstack = (uint32_t*)((uint32_t)pthread + PG_SIZE);
 	
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~第9章c~~~~~~~~~~~~~~~~~~~~~~~~~~~
-	pthread->ticks = prio;
-	pthread->elapsed_ticks = 0;
+	pthread->level = prio2level(prio);
+	pthread->queue = NULL;
+	list_init(&pthread->held_locks);
+	pthread->blocked_on = NULL;
+	pthread->ticks = MLFQ_SLICE(pthread->level);
+	pthread->cpu_ns = 0;
 	pthread->pgdir = NULL; //###執行緒沒有自己的位址空間，這是給使用者用的，設為NULL!
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~第14章c~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -217,10 +254,8 @@ struct task_struct* thread_start(char* name, int prio, thread_func function, voi
     init_thread(thread, name, prio);
     thread_create(thread, function, func_arg);
 	
-	/* 确保之前不在队列中 */
-	ASSERT(!elem_find(&thread_ready_list, &thread->general_tag));
 	/* 加入就绪线程队列 */
-	list_append(&thread_ready_list, &thread->general_tag);
+	thread_ready_add(thread);
 	
 	/* 确保之前不在队列中 */
 	ASSERT(!elem_find(&thread_all_list, &thread->all_list_tag));
@@ -254,16 +289,41 @@ static void make_main_thread(void) {
 }
 
 
+/* 把pthread挂到其所在级别的就绪队列尾 */
+void thread_ready_add(struct task_struct* pthread) {
+   enum intr_status old_status = intr_disable();
+   struct list* plist = &thread_ready_list[pthread->level];
+   ASSERT(pthread->queue == NULL);
+   ASSERT(!elem_find(plist, &pthread->general_tag));
+   list_append(plist, &pthread->general_tag);
+   pthread->queue = plist;
+   ready_levels |= 1U << pthread->level;
+   intr_set_status(old_status);
+}
+
+/* 把pthread从就绪队列中摘下 */
+static void ready_remove(struct task_struct* pthread) {
+   ASSERT(pthread->queue == &thread_ready_list[pthread->level]);
+   list_remove(&pthread->general_tag);
+   pthread->queue = NULL;
+   if (list_empty(&thread_ready_list[pthread->level])) {
+      ready_levels &= ~(1U << pthread->level);
+   }
+}
+
 /* 实现任务调度 */
 void schedule() {
 
    ASSERT(intr_get_status() == INTR_OFF);
 
    struct task_struct* cur = running_thread(); 
-   if (cur->status == TASK_RUNNING) { // 若此线程只是cpu时间片到了,将其加入到就绪队列尾
-      ASSERT(!elem_find(&thread_ready_list, &cur->general_tag));
-      list_append(&thread_ready_list, &cur->general_tag);
-      cur->ticks = cur->priority;     // 重新将当前线程的ticks再重置为其priority;
+   if (cur->status == TASK_RUNNING) { // 若此线程只是cpu时间片到了,降一级后加入到就绪队列尾
+      /* 借用了等待者优先级的持锁者不降级,以免它被中等优先级的任务压住而迟迟不放锁 */
+      if (cur->level < MLFQ_LEVELS - 1 && cur->priority == cur->base_priority) {
+	 cur->level++;
+      }
+      cur->ticks = MLFQ_SLICE(cur->level);     // 按新的级别重置时间片
+      thread_ready_add(cur);
       cur->status = TASK_READY;
    }
    /*
@@ -278,25 +338,34 @@ void schedule() {
    
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~第13章~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
    /* 如果就绪队列中没有可运行的任务,就唤醒idle */
-   if (list_empty(&thread_ready_list)) {
+   if (ready_levels == 0) {
       thread_unblock(idle_thread);
    }
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
-   ASSERT(!list_empty(&thread_ready_list));
+   ASSERT(ready_levels != 0);
    thread_tag = NULL;	  // thread_tag清空
    //###因為thread_tag是全域變數，先賦予NULL比較保險
  
  
-/* 将thread_ready_list队列中的第一个就绪线程弹出,准备将其调度上cpu. */
-   thread_tag = list_pop(&thread_ready_list);   
+/* 从最高的非空一级就绪队列中弹出第一个就绪线程,准备将其调度上cpu. */
+   thread_tag = thread_ready_list[bsf(ready_levels)].head.next;
    struct task_struct* next = elem2entry(struct task_struct, general_tag, thread_tag);
+   ready_remove(next);
    next->status = TASK_RUNNING;
 
 //~~~~~~~~~~~~~~~~~~~~第11章b~~~~~~~~~~~~~~~~~~
    process_activate(next);
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+   if (next != cur) {
+      switch_cnt++;
+   }
    
+   /* 按纳秒记下cur这次占用的cpu时间 */
+   uint64_t now = ktime_ns();
+   cur->cpu_ns += now - cur->exec_start_ns;
+   next->exec_start_ns = now;
+
    switch_to(cur, next);
 }
 
@@ -356,11 +425,12 @@ void thread_unblock(struct task_struct* pthread) {
    enum intr_status old_status = intr_disable();
    ASSERT(((pthread->status == TASK_BLOCKED) || (pthread->status == TASK_WAITING) || (pthread->status == TASK_HANGING)));
    if (pthread->status != TASK_READY) {
-      ASSERT(!elem_find(&thread_ready_list, &pthread->general_tag));
-      if (elem_find(&thread_ready_list, &pthread->general_tag)) {
-		PANIC("thread_unblock: blocked thread in ready_list\n");
+      /* 阻塞过的多半是交互或等I/O的任务,升一级并给满时间片,使其尽快得到调度 */
+      if (pthread->level > prio2level(pthread->priority)) {
+	 pthread->level--;
       }
-      list_push(&thread_ready_list, &pthread->general_tag);    // 放到队列的最前面,使其尽快得到调度
+      pthread->ticks = MLFQ_SLICE(pthread->level);
+      thread_ready_add(pthread);
       pthread->status = TASK_READY;
    } 
    intr_set_status(old_status);
@@ -384,13 +454,95 @@ void thread_unblock(struct task_struct* pthread) {
 void thread_yield(void) {
    struct task_struct* cur = running_thread();   
    enum intr_status old_status = intr_disable();
-   ASSERT(!elem_find(&thread_ready_list, &cur->general_tag));
-   list_append(&thread_ready_list, &cur->general_tag);
+   thread_ready_add(cur);	 // 主动让出的不降级
    cur->status = TASK_READY;
    schedule();
    intr_set_status(old_status);
 }
 
+/* 回收已退出的进程thread_over的页目录、pcb和pid,并将其从队列中去掉.
+ * 由父进程在wait中调用,此时thread_over的用户空间已在exit中释放 */
+void thread_exit(struct task_struct* thread_over) {
+   ASSERT(thread_over != running_thread() && thread_over != main_thread);
+   enum intr_status old_status = intr_disable();
+   thread_over->status = TASK_DIED;
+
+   if (thread_over->queue == &thread_ready_list[thread_over->level]) {
+      ready_remove(thread_over);
+   }
+   if (thread_over->pgdir != NULL) {
+      page_dir_release(thread_over);
+   }
+   list_remove(&thread_over->all_list_tag);
+
+   pid_t pid = thread_over->pid;
+   mfree_page(PF_KERNEL, thread_over, 1);
+   release_pid(pid);
+   intr_set_status(old_status);
+}
+
+/* 把pthread移到第level级,若它在就绪队列中则一并换到该级的队列 */
+static void level_set(struct task_struct* pthread, uint8_t level) {
+   if (pthread->queue == &thread_ready_list[pthread->level]) {
+      ready_remove(pthread);
+      pthread->level = level;
+      thread_ready_add(pthread);
+   } else {
+      pthread->level = level;
+   }
+}
+
+/* 老化:把所有任务提回各自优先级所能到的最高级,由时钟中断每MLFQ_AGING_TICKS调用一次 */
+void thread_age(void) {
+   ASSERT(intr_get_status() == INTR_OFF);
+   struct list_elem* elem = thread_all_list.head.next;
+   while (elem != &thread_all_list.tail) {
+      struct task_struct* pthread = elem2entry(struct task_struct, all_list_tag, elem);
+      uint8_t top = prio2level(pthread->priority);
+      if (pthread->level != top) {
+	 level_set(pthread, top);
+      }
+      elem = elem->next;
+   }
+}
+
+/* 把pthread的有效优先级改为prio,供锁的优先级继承使用.
+ * 抬高时立即提到prio所能到的最高级并充满时间片,好让持锁者尽快运行并放锁;
+ * 降低时若当前级别高于prio所允许的,降到允许的最高级 */
+void thread_priority_set(struct task_struct* pthread, uint8_t prio) {
+   ASSERT(intr_get_status() == INTR_OFF);
+   uint8_t top = prio2level(prio);
+   if (prio > pthread->priority && pthread->level > top) {
+      level_set(pthread, top);
+      pthread->ticks = MLFQ_SLICE(top);
+   } else if (prio < pthread->priority && pthread->level < top) {
+      level_set(pthread, top);
+      if (pthread->ticks > MLFQ_SLICE(top)) {
+	 pthread->ticks = MLFQ_SLICE(top);
+      }
+   }
+   /* 在信号量上等待的任务按优先级分桶,要换到新优先级的桶里 */
+   if (pthread->status == TASK_BLOCKED && pthread->queue != NULL) {
+      sema_waiter_reprio(pthread, prio);
+   }
+   pthread->priority = prio;
+}
+
+/* 用于在list_traversal中找pid为pid的任务 */
+static bool pid_check(struct list_elem* pelem, int32_t pid) {
+   struct task_struct* pthread = elem2entry(struct task_struct, all_list_tag, pelem);
+   return pthread->pid == pid;
+}
+
+/* 根据pid找pcb,若找到则返回该pcb,否则返回NULL */
+struct task_struct* pid2thread(int32_t pid) {
+   struct list_elem* pelem = list_traversal(&thread_all_list, pid_check, pid);
+   if (pelem == NULL) {
+      return NULL;
+   }
+   return elem2entry(struct task_struct, all_list_tag, pelem);
+}
+
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~第15章e~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 /* 以填充空格的方式输出buf */
@@ -446,7 +598,14 @@ static bool elem2thread_info(struct list_elem* pelem, int arg UNUSED) {
       case 5:
 	 pad_print(out_pad, 16, "DIED", 's');
    }
-   pad_print(out_pad, 16, &pthread->elapsed_ticks, 'x');
+   /* 正在运行的任务还要加上这次上cpu以来的时间 */
+   uint64_t cpu_ns = pthread->cpu_ns;
+   if (pthread == running_thread()) {
+      cpu_ns += ktime_ns() - pthread->exec_start_ns;
+   }
+   char cpu_ms[16];
+   sprintf(cpu_ms, "%d", (uint32_t)div_u64_rem(cpu_ns, 1000000, NULL));
+   pad_print(out_pad, 16, cpu_ms, 's');
 
    memset(out_pad, 0, 16);
    ASSERT(strlen(pthread->name) < 17);
@@ -458,9 +617,46 @@ static bool elem2thread_info(struct list_elem* pelem, int arg UNUSED) {
 
 /* 打印任务列表 */
 void sys_ps(void) {
-   char* ps_title = "PID            PPID           STAT           TICKS          COMMAND\n";
+   char* ps_title = "PID            PPID           STAT           CPU_MS         COMMAND\n";
    sys_write(stdout_no, ps_title, strlen(ps_title));
    list_traversal(&thread_all_list, elem2thread_info, 0);
+
+   char buf[64] = {0};
+   sprintf(buf, "context switches: %d  cr3 loads: %d\n", switch_cnt, cr3_load_cnt);
+   sys_write(stdout_no, buf, strlen(buf));
+}
+
+#ifdef SELFTEST
+/* 取开机以来的任务切换次数,供开机自检对比 */
+uint32_t thread_switch_cnt(void) {
+   return switch_cnt;
+}
+#endif
+
+/* 把当前任务的优先级降低increment,increment为负时升高,限制在[PRIO_MIN, PRIO_MAX]内.
+ * 返回新的优先级 */
+int32_t sys_nice(int32_t increment) {
+   struct task_struct* cur = running_thread();
+   int32_t prio = cur->base_priority - increment;
+   if (prio < PRIO_MIN) {
+      prio = PRIO_MIN;
+   } else if (prio > PRIO_MAX) {
+      prio = PRIO_MAX;
+   }
+
+   enum intr_status old_status = intr_disable();
+   cur->base_priority = prio;
+   /* 有效优先级不低于所持锁上等待者的优先级 */
+   cur->priority = lock_priority_effective(cur);
+   /* 降低优先级立即生效,升高的等阻塞唤醒或老化时再升上去 */
+   if (cur->level < prio2level(cur->priority)) {
+      cur->level = prio2level(cur->priority);
+      if (cur->ticks > MLFQ_SLICE(cur->level)) {
+	 cur->ticks = MLFQ_SLICE(cur->level);
+      }
+   }
+   intr_set_status(old_status);
+   return prio;
 }
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
@@ -468,11 +664,18 @@ void sys_ps(void) {
 /* 初始化线程环境 */
 void thread_init(void) {
    put_str("thread_init start\n");
-   list_init(&thread_ready_list);
+   uint32_t level;
+   for (level = 0; level < MLFQ_LEVELS; level++) {
+      list_init(&thread_ready_list[level]);
+   }
    list_init(&thread_all_list);
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~第12章a~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
    lock_init(&pid_lock);
+   pid_bitmap.bits = pid_bitmap_bits;
+   pid_bitmap.btmp_bytes_len = MAX_PID_NR / 8;
+   pid_bitmap.summary = NULL;
+   bitmap_init(&pid_bitmap);
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~第15章a~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ 
 /* 先创建第一个用户进程:init */
@@ -591,4 +794,4 @@ void thread_init(void) {
 ###		kthread_stack->function = function; 把function給函數指標(名字也叫function)
 ###		kthread_stack->func_arg = func_arg; 賦予void function(void*)的參數
 ###		kthread_stack->ebp = kthread_stack->ebx = kthread_stack->esi = kthread_stack->edi = 0; 剩下的暫存器全歸0
-*/
\ No newline at end of file
+*/
\ No newline at end of file
@@ -7,6 +7,16 @@
 
 #define TASK_NAME_LEN 16
 #define MAX_FILES_OPEN_PER_PROC 8
+
+/* 多级反馈就绪队列:0级最高.时间片用完降一级,阻塞后被唤醒升一级,
+ * 每隔MLFQ_AGING_TICKS把所有任务提回各自能到的最高级,以免低级的任务饿死 */
+#define MLFQ_LEVELS 4
+#define MLFQ_SLICE(level) (5 << (level))	 // 各级的时间片嘀嗒数,级越低时间片越长
+#define MLFQ_AGING_TICKS 100
+#define PRIO_MIN 1
+#define PRIO_MAX 31
+/* 优先级决定任务能到的最高级,PRIO_MAX对应0级 */
+#define prio2level(prio) ((PRIO_MAX - (prio)) * MLFQ_LEVELS / PRIO_MAX)
 /* 自定义通用函数类型,它将在很多线程函数中做为形参类型 */
 typedef void thread_func(void*);
 //##可理解為: typedef void 名字(void*)  thread_func
@@ -106,19 +116,27 @@ struct task_struct {
 	
 	enum task_status status;
 	char name[16];
-	uint8_t priority;
-	uint8_t ticks;			// 每次在处理器上执行的时间嘀嗒数
+	uint8_t priority;		// 有效优先级,决定能到的最高就绪队列级别,持锁时可能被等待者抬高
+	uint8_t base_priority;		// 任务自身的优先级,由nice调整
+	uint8_t ticks;			// 本次时间片剩余的嘀嗒数
+	uint8_t level;			// 当前所在的就绪队列级别
 
 
-/* 此任务自上cpu运行后至今占用了多少cpu嘀嗒数,
- * 也就是此任务执行了多久*/
-	uint32_t elapsed_ticks;
+/* 此任务累计占用cpu的纳秒数,也就是此任务执行了多久.
+ * 在schedule中换下cpu时累加 */
+	uint64_t cpu_ns;
+	uint64_t exec_start_ns;	// 本次上cpu的时刻
 
 //~~~~~~~~~~~~~~~~~~~~第14章c~~~~~~~~~~~~~~~~~~~~~
 	int32_t fd_table[MAX_FILES_OPEN_PER_PROC];	// 文件描述符数组
 
 /* general_tag的作用是用于线程在一般的队列中的结点 */
 	struct list_elem general_tag;				    
+	struct list* queue;	// general_tag当前所在的队列,不在任何队列时为NULL
+
+/* 优先级继承用:held_locks是本任务持有的锁,blocked_on是本任务正在等的锁 */
+	struct list held_locks;
+	struct lock* blocked_on;
 
 /* all_list_tag的作用是用于线程队列thread_all_list中的结点 */
 	struct list_elem all_list_tag;
@@ -130,19 +148,23 @@ struct task_struct {
 	
 //~~~~~~~~~~~~~~~~~~~~第12章e~~~~~~~~~~~~~~~~~~~~~~
 	struct mem_block_desc u_block_desc[DESC_CNT];   // 用户进程内存块描述符
+	struct mem_magazine k_mags[DESC_CNT];		// 本任务缓存的内核堆内存块,申请释放时先走这里
+	struct list vma_list;		// 用户空间中按需调页的映射,元素为struct vm_area
 
 //~~~~~~~~~~~~~~~~~~~~第14章l~~~~~~~~~~~~~~~~~~~~~~
 	uint32_t cwd_inode_nr;
 	
 //~~~~~~~~~~~~~~~~~~~~第15章a~~~~~~~~~~~~~~~~~~~~~~
 	int16_t parent_pid;		 // 父进程pid
+	int32_t exit_status;	 // 进程退出时的返回值,由父进程在wait中取走
 
 	uint32_t stack_magic;	// 用这串数字做栈的边界标记,用于检测栈的溢出
 };
 
 //~~~~~~~~~~~~~~~~~~~~第11章b~~~~~~~~~~~~~~~~~~
-extern struct list thread_ready_list;
+extern struct list thread_ready_list[MLFQ_LEVELS];
 extern struct list thread_all_list;
+extern struct task_struct* main_thread;
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
 void thread_create(struct task_struct* pthread, thread_func function, void* func_arg);
@@ -157,14 +179,23 @@ void thread_init(void);
 //~~~~~~~~~~~~~第10章b~~~~~~~~~~~~~~
 void thread_block(enum task_status stat);
 void thread_unblock(struct task_struct* pthread);
+void thread_ready_add(struct task_struct* pthread);
+void thread_age(void);
 
 //~~~~~~~~~~~~~第13章~~~~~~~~~~~~~~~
 void thread_yield(void);
+void thread_priority_set(struct task_struct* pthread, uint8_t prio);
 
 //~~~~~~~~~~~~~第15章a~~~~~~~~~~~~~~
 pid_t fork_pid(void);
+void thread_exit(struct task_struct* thread_over);
+struct task_struct* pid2thread(int32_t pid);
 
 //~~~~~~~~~~~~~第15章e~~~~~~~~~~~~~~
 void sys_ps(void);
+#ifdef SELFTEST
+uint32_t thread_switch_cnt(void);
+#endif
+int32_t sys_nice(int32_t increment);
 
 #endif
@@ -5,28 +5,13 @@
 #include "string.h"
 #include "global.h"
 #include "memory.h"
+#include "vma.h"
+#include "inode.h"
+#include "file.h"
+#include "process.h"
+#include "wait_exit.h"
 
 extern void intr_exit(void);
-typedef uint32_t Elf32_Word, Elf32_Addr, Elf32_Off;
-typedef uint16_t Elf32_Half;
-
-/* 32位elf头 */
-struct Elf32_Ehdr {
-   unsigned char e_ident[16];
-   Elf32_Half    e_type;
-   Elf32_Half    e_machine;
-   Elf32_Word    e_version;
-   Elf32_Addr    e_entry;
-   Elf32_Off     e_phoff;
-   Elf32_Off     e_shoff;
-   Elf32_Word    e_flags;
-   Elf32_Half    e_ehsize;
-   Elf32_Half    e_phentsize;
-   Elf32_Half    e_phnum;
-   Elf32_Half    e_shentsize;
-   Elf32_Half    e_shnum;
-   Elf32_Half    e_shstrndx;
-};
 
 /* 程序头表Program header.就是段描述头 */
 struct Elf32_Phdr {
@@ -51,45 +36,33 @@ enum segment_type {
    PT_PHDR             // 程序头表
 };
 
-/* 将文件描述符fd指向的文件中,偏移为offset,大小为filesz的段加载到虚拟地址为vaddr的内存 */
-static bool segment_load(int32_t fd, uint32_t offset, uint32_t filesz, uint32_t vaddr) {
-   uint32_t vaddr_first_page = vaddr & 0xfffff000;    // vaddr地址所在的页框
-   uint32_t size_in_first_page = PG_SIZE - (vaddr & 0x00000fff);     // 加载到内存后,文件在第一个页框中占用的字节大小
-   uint32_t occupy_pages = 0;
-   /* 若一个页框容不下该段 */
-   if (filesz > size_in_first_page) {
-      uint32_t left_size = filesz - size_in_first_page;
-      occupy_pages = DIV_ROUND_UP(left_size, PG_SIZE) + 1;	     // 1是指vaddr_first_page
-   } else {
-      occupy_pages = 1;
-   }
+/* 程序头p_flags中的可写位 */
+#define PF_W 2
 
-   /* 为进程分配内存 */
-   uint32_t page_idx = 0;
-   uint32_t vaddr_page = vaddr_first_page;
-   while (page_idx < occupy_pages) {
-      uint32_t* pde = pde_ptr(vaddr_page);
-      uint32_t* pte = pte_ptr(vaddr_page);
-
-      /* 如果pde不存在,或者pte不存在就分配内存.
-       * pde的判断要在pte之前,否则pde若不存在会导致
-       * 判断pte时缺页异常 */
-      if (!(*pde & 0x00000001) || !(*pte & 0x00000001)) {
-		if (get_a_page(PF_USER, vaddr_page) == NULL) {
-			return false;
-		}
-      } // 如果原进程的页表已经分配了,利用现有的物理页,直接覆盖进程体
-      vaddr_page += PG_SIZE;
-      page_idx++;
+/* 将文件描述符fd指向的文件中偏移为offset、大小为filesz的段映射到虚拟地址vaddr,内存中共占memsz字节.
+ * 这里只登记映射,页在第一次访问时才由页错误处理从文件读入,memsz超出filesz的部分(bss)填0.
+ * 只有p_flags带PF_W的段可写,代码段等装入后是只读的 */
+static bool segment_load(int32_t fd, uint32_t offset, uint32_t filesz, uint32_t memsz, uint32_t vaddr, uint32_t p_flags) {
+   if (memsz < filesz) {
+      return false;
+   }
+   if (memsz == 0) {	 // 空段不用映射
+      return true;
    }
-   sys_lseek(fd, offset, SEEK_SET);
-   sys_read(fd, (void*)vaddr, filesz);
-   return true;
+   struct task_struct* cur = running_thread();
+   /* 一个vm_area只能描述一段文件内容,两个段共用一页时后一段的内容会被填成0,
+    * 所以要求各段不共用页,不满足的程序拒绝加载 */
+   if (vma_find(cur, vaddr & 0xfffff000) != NULL || vma_find(cur, (vaddr + memsz - 1) & 0xfffff000) != NULL) {
+      return false;
+   }
+   struct inode* inode = file_table[cur->fd_table[fd]].fd_inode;
+   return vma_map_file(vaddr, memsz, inode, offset, filesz, (p_flags & PF_W) ? VM_WRITE : 0) == 0;
 }
 
 /* 从文件系统上加载用户程序pathname,成功则返回程序的起始地址,否则返回-1 */
 static int32_t load(const char* pathname) {
    int32_t ret = -1;
+   bool old_image_released = false;
    struct Elf32_Ehdr elf_header;
    struct Elf32_Phdr prog_header;
    memset(&elf_header, 0, sizeof(struct Elf32_Ehdr));
@@ -115,6 +88,20 @@ static int32_t load(const char* pathname) {
       goto done;
    }
 
+   /* 原进程的整个用户空间都不要了:共享映射的脏页写回后,
+    * 进程体、堆和栈的页框连同虚拟地址的占用记录一并释放,堆描述符也要重置 */
+   struct task_struct* cur = running_thread();
+   vma_release_all(cur);
+   user_space_release();
+   block_desc_init(cur->u_block_desc);
+   old_image_released = true;
+
+   /* 为新进程体准备用户栈 */
+   if (get_a_page(PF_USER, USER_STACK3_VADDR) == NULL) {
+      ret = -1;
+      goto done;
+   }
+
    Elf32_Off prog_header_offset = elf_header.e_phoff; 
    Elf32_Half prog_header_size = elf_header.e_phentsize;
 
@@ -134,7 +121,7 @@ static int32_t load(const char* pathname) {
 
       /* 如果是可加载段就调用segment_load加载到内存 */
       if (PT_LOAD == prog_header.p_type) {
-		if (!segment_load(fd, prog_header.p_offset, prog_header.p_filesz, prog_header.p_vaddr)) {
+		if (!segment_load(fd, prog_header.p_offset, prog_header.p_filesz, prog_header.p_memsz, prog_header.p_vaddr, prog_header.p_flags)) {
 			ret = -1;
 			goto done;
 		}
@@ -147,6 +134,10 @@ static int32_t load(const char* pathname) {
    ret = elf_header.e_entry;
 done:
    sys_close(fd);
+   /* 原进程体已释放,失败时已无处可返回,只能结束进程 */
+   if (ret == -1 && old_image_released) {
+      sys_exit(-1);
+   }
    return ret;
 }
 
@@ -162,6 +153,7 @@ int32_t sys_execv(const char* path, const char* argv[]) {
    }
    
    struct task_struct* cur = running_thread();
+
    /* 修改进程名 */
    memcpy(cur->name, path, TASK_NAME_LEN);
    cur->name[TASK_NAME_LEN-1] = 0;
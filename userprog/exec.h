@@ -1,5 +1,27 @@
 #ifndef __USERPROG_EXEC_H
 #define __USERPROG_EXEC_H
 #include "stdint.h"
+
+typedef uint32_t Elf32_Word, Elf32_Addr, Elf32_Off;
+typedef uint16_t Elf32_Half;
+
+/* 32位elf头 */
+struct Elf32_Ehdr {
+   unsigned char e_ident[16];
+   Elf32_Half    e_type;
+   Elf32_Half    e_machine;
+   Elf32_Word    e_version;
+   Elf32_Addr    e_entry;
+   Elf32_Off     e_phoff;
+   Elf32_Off     e_shoff;
+   Elf32_Word    e_flags;
+   Elf32_Half    e_ehsize;
+   Elf32_Half    e_phentsize;
+   Elf32_Half    e_phnum;
+   Elf32_Half    e_shentsize;
+   Elf32_Half    e_shnum;
+   Elf32_Half    e_shstrndx;
+};
+
 int32_t sys_execv(const char* path, const char*  argv[]);
 #endif
@@ -6,75 +6,46 @@
 #include "thread.h"    
 #include "string.h"
 #include "file.h"
+#include "vma.h"
 
 extern void intr_exit(void);
 
-/* 将父进程的pcb、虚拟地址位图拷贝给子进程 */
-static int32_t copy_pcb_vaddrbitmap_stack0(struct task_struct* child_thread, struct task_struct* parent_thread) {
+/* 将父进程的pcb、虚拟地址池拷贝给子进程 */
+static int32_t copy_pcb_vaddrpool_stack0(struct task_struct* child_thread, struct task_struct* parent_thread) {
 /* a 复制pcb所在的整个页,里面包含进程pcb信息及特级0极的栈,里面包含了返回地址, 然后再单独修改个别部分 */
    memcpy(child_thread, parent_thread, PG_SIZE);
    child_thread->pid = fork_pid();
-   child_thread->elapsed_ticks = 0;
+   if (child_thread->pid == -1) {	 // pid已用完
+      return -1;
+   }
+   child_thread->cpu_ns = 0;
    child_thread->status = TASK_READY;
-   child_thread->ticks = child_thread->priority;   // 为新进程把时间片充满
+   child_thread->ticks = MLFQ_SLICE(child_thread->level);   // 子进程沿用父进程的级别,把时间片充满
    child_thread->parent_pid = parent_thread->pid;
    child_thread->general_tag.prev = child_thread->general_tag.next = NULL;
+   child_thread->queue = NULL;
+   /* 锁不随fork继承,子进程从自身优先级开始 */
+   list_init(&child_thread->held_locks);
+   child_thread->blocked_on = NULL;
+   child_thread->priority = child_thread->base_priority;
+   if (child_thread->level < prio2level(child_thread->priority)) {
+      child_thread->level = prio2level(child_thread->priority);
+      child_thread->ticks = MLFQ_SLICE(child_thread->level);
+   }
    child_thread->all_list_tag.prev = child_thread->all_list_tag.next = NULL;
-   block_desc_init(child_thread->u_block_desc);
-/* b 复制父进程的虚拟地址池的位图 */
-   uint32_t bitmap_pg_cnt = DIV_ROUND_UP((0xc0000000 - USER_VADDR_START) / PG_SIZE / 8 , PG_SIZE);
-   void* vaddr_btmp = get_kernel_pages(bitmap_pg_cnt);
-   if (vaddr_btmp == NULL) return -1;
-   /* 此时child_thread->userprog_vaddr.vaddr_bitmap.bits还是指向父进程虚拟地址的位图地址
-    * 下面将child_thread->userprog_vaddr.vaddr_bitmap.bits指向自己的位图vaddr_btmp */
-   memcpy(vaddr_btmp, child_thread->userprog_vaddr.vaddr_bitmap.bits, bitmap_pg_cnt * PG_SIZE);
-   child_thread->userprog_vaddr.vaddr_bitmap.bits = vaddr_btmp;
+   /* 父进程magazine里的内核堆块仍归父进程,子进程从空的magazine开始 */
+   memset(child_thread->k_mags, 0, sizeof(child_thread->k_mags));
+/* b 复制父进程虚拟地址池中的已占用区间 */
+   /* 此时child_thread->userprog_vaddr.region_list还挂着父进程的区间节点,要换成自己的一份 */
+   if (user_vaddr_fork(&child_thread->userprog_vaddr, &parent_thread->userprog_vaddr) == -1) {
+      return -1;
+   }
    /* 调试用 */
    ASSERT(strlen(child_thread->name) < 11);	// pcb.name的长度是16,为避免下面strcat越界
    strcat(child_thread->name,"_fork");
    return 0;
 }
 
-/* 复制子进程的进程体(代码和数据)及用户栈 */
-static void copy_body_stack3(struct task_struct* child_thread, struct task_struct* parent_thread, void* buf_page) {
-   uint8_t* vaddr_btmp = parent_thread->userprog_vaddr.vaddr_bitmap.bits;
-   uint32_t btmp_bytes_len = parent_thread->userprog_vaddr.vaddr_bitmap.btmp_bytes_len;
-   uint32_t vaddr_start = parent_thread->userprog_vaddr.vaddr_start;
-   uint32_t idx_byte = 0;
-   uint32_t idx_bit = 0;
-   uint32_t prog_vaddr = 0;
-
-   /* 在父进程的用户空间中查找已有数据的页 */
-   while (idx_byte < btmp_bytes_len) {
-      if (vaddr_btmp[idx_byte]) {
-		idx_bit = 0;
-		while (idx_bit < 8) {
-			if ((BITMAP_MASK << idx_bit) & vaddr_btmp[idx_byte]) {
-				prog_vaddr = (idx_byte * 8 + idx_bit) * PG_SIZE + vaddr_start;
-				/* 下面的操作是将父进程用户空间中的数据通过内核空间做中转,最终复制到子进程的用户空间 */
-		
-				/* a 将父进程在用户空间中的数据复制到内核缓冲区buf_page,
-				目的是下面切换到子进程的页表后,还能访问到父进程的数据*/
-				memcpy(buf_page, (void*)prog_vaddr, PG_SIZE);
-		
-				/* b 将页表切换到子进程,目的是避免下面申请内存的函数将pte及pde安装在父进程的页表中 */
-				page_dir_activate(child_thread);
-				/* c 申请虚拟地址prog_vaddr */
-				get_a_page_without_opvaddrbitmap(PF_USER, prog_vaddr);
-		
-				/* d 从内核缓冲区中将父进程数据复制到子进程的用户空间 */
-				memcpy((void*)prog_vaddr, buf_page, PG_SIZE);
-		
-				/* e 恢复父进程页表 */
-				page_dir_activate(parent_thread);
-			}
-		idx_bit++;
-		}
-      }
-      idx_byte++;
-   }
-}
-
 /* 为子进程构建thread_stack和修改返回值 */
 static int32_t build_child_stack(struct task_struct* child_thread) {
 /* a 使子进程pid返回值为0 */
@@ -125,14 +96,8 @@ static void update_inode_open_cnts(struct task_struct* thread) {
 
 /* 拷贝父进程本身所占资源给子进程 */
 static int32_t copy_process(struct task_struct* child_thread, struct task_struct* parent_thread) {
-   /* 内核缓冲区,作为父进程用户空间的数据复制到子进程用户空间的中转 */
-   void* buf_page = get_kernel_pages(1);
-   if (buf_page == NULL) {
-      return -1;
-   }
-
-   /* a 复制父进程的pcb、虚拟地址位图、内核栈到子进程 */
-   if (copy_pcb_vaddrbitmap_stack0(child_thread, parent_thread) == -1) {
+   /* a 复制父进程的pcb、虚拟地址池、内核栈到子进程 */
+   if (copy_pcb_vaddrpool_stack0(child_thread, parent_thread) == -1) {
       return -1;
    }
 
@@ -142,16 +107,26 @@ static int32_t copy_process(struct task_struct* child_thread, struct task_struct
       return -1;
    }
 
-   /* c 复制父进程进程体及用户栈给子进程 */
-   copy_body_stack3(child_thread, parent_thread, buf_page);
+   /* c 子进程以写时复制的方式共享父进程的进程体及用户栈,只复制页表 */
+   if (user_space_cow_share(child_thread->pgdir) == -1) {
+      return -1;
+   }
+   /* 还没装入的页仍按父进程的映射在子进程中按需装入 */
+   if (vma_fork(child_thread, parent_thread) == -1) {
+      return -1;
+   }
+
+   /* 子进程继承父进程的堆,在子进程页表下把堆中arena改挂到子进程自己的描述符上.
+    * 这里写到的堆页会经页错误处理复制一份给子进程 */
+   page_dir_activate(child_thread);
+   block_desc_fork(child_thread->u_block_desc, parent_thread->u_block_desc);
+   page_dir_activate(parent_thread);
 
    /* d 构建子进程thread_stack和修改返回值pid */
    build_child_stack(child_thread);
 
    /* e 更新文件inode的打开数 */
    update_inode_open_cnts(child_thread);
-
-   mfree_page(PF_KERNEL, buf_page, 1);
    return 0;
 }
 
@@ -169,8 +144,7 @@ pid_t sys_fork(void) {
    }
 
    /* 添加到就绪线程队列和所有线程队列,子进程由调试器安排运行 */
-   ASSERT(!elem_find(&thread_ready_list, &child_thread->general_tag));
-   list_append(&thread_ready_list, &child_thread->general_tag);
+   thread_ready_add(child_thread);
    ASSERT(!elem_find(&thread_all_list, &child_thread->all_list_tag));
    list_append(&thread_all_list, &child_thread->all_list_tag);
    
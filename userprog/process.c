@@ -11,6 +11,8 @@
 
 extern void intr_exit(void);
 
+uint32_t cr3_load_cnt;	 // 重新加载cr3的次数,sys_ps中显示
+
 /* 构建用户进程初始上下文信息 */
 void start_process(void* filename_) {
     void* function = filename_;
@@ -45,13 +47,22 @@ void page_dir_activate(struct task_struct* p_thread) {
 
     /* 更新页目录寄存器cr3,使新页表生效 */
     asm volatile ("movl %0, %%cr3" : : "r" (pagedir_phy_addr) : "memory");
+    cr3_load_cnt++;
 }
 
 /* 激活线程或进程的页表,更新tss中的esp0为进程的特权级0的栈 */
 void process_activate(struct task_struct* p_thread) {
     ASSERT(p_thread != NULL);
-    /* 激活该进程或线程的页表 */
-    page_dir_activate(p_thread);
+    /* 激活该进程的页表.内核线程只访问内核空间,而各页目录的内核部分都相同,
+     * 沿用上一个任务的页目录即可;要换上的页目录已在cr3中时也不必重新加载,
+     * 以免白白冲掉tlb.进程释放页目录前须确保它不在cr3中 */
+    if (p_thread->pgdir != NULL) {
+        uint32_t cr3;
+        asm volatile ("movl %%cr3, %0" : "=r" (cr3));
+        if ((cr3 & 0xfffff000) != addr_v2p((uint32_t)p_thread->pgdir)) {
+            page_dir_activate(p_thread);
+        }
+    }
 
     /* 内核线程特权级本身就是0特权级,处理器进入中断时并不会从tss中获取0特权级栈地址,故不需要更新esp0 */
     if (p_thread->pgdir) {
@@ -60,6 +71,19 @@ void process_activate(struct task_struct* p_thread) {
     }
 }
 
+/* 释放进程p_thread的页目录.内核线程沿用上一个任务的页目录,
+ * 这个页目录可能还在cr3中,要先换成内核的页目录再释放 */
+void page_dir_release(struct task_struct* p_thread) {
+    uint32_t cr3;
+    asm volatile ("movl %%cr3, %0" : "=r" (cr3));
+    if ((cr3 & 0xfffff000) == addr_v2p((uint32_t)p_thread->pgdir)) {
+        asm volatile ("movl %0, %%cr3" : : "r" (0x100000) : "memory");
+        cr3_load_cnt++;
+    }
+    mfree_page(PF_KERNEL, p_thread->pgdir, 1);
+    p_thread->pgdir = NULL;
+}
+
 /* 创建页目录表,将当前页表的表示内核空间的pde复制,
  * 成功则返回页目录的虚拟地址,否则返回-1 */
 uint32_t* create_page_dir(void) {
@@ -84,13 +108,11 @@ uint32_t* create_page_dir(void) {
     return page_dir_vaddr;
 }
 
-/* 创建用户进程虚拟地址位图 */
-void create_user_vaddr_bitmap(struct task_struct* user_prog) {
+/* 创建用户进程虚拟地址池.已占用的虚拟地址按区间记录,一开始是空的,
+ * 不再为整个3G空间分配位图 */
+void create_user_vaddr_pool(struct task_struct* user_prog) {
     user_prog->userprog_vaddr.vaddr_start = USER_VADDR_START;
-    uint32_t bitmap_pg_cnt = DIV_ROUND_UP((0xc0000000 - USER_VADDR_START) / PG_SIZE / 8 , PG_SIZE);
-    user_prog->userprog_vaddr.vaddr_bitmap.bits = get_kernel_pages(bitmap_pg_cnt);
-    user_prog->userprog_vaddr.vaddr_bitmap.btmp_bytes_len = (0xc0000000 - USER_VADDR_START) / PG_SIZE / 8;
-    bitmap_init(&user_prog->userprog_vaddr.vaddr_bitmap);
+    list_init(&user_prog->userprog_vaddr.region_list);
 }
 /*
 ###需要注意:
@@ -107,17 +129,17 @@ void process_execute(void* filename, char* name) {
     /* pcb内核的数据结构,由内核来维护进程信息,因此要在内核内存池中申请 */
     struct task_struct* thread = get_kernel_pages(1);
     init_thread(thread, name, default_prio); 
-    create_user_vaddr_bitmap(thread);
+    create_user_vaddr_pool(thread);
     thread_create(thread, start_process, filename);//start_process(filename)
     thread->pgdir = create_page_dir();
 	
 //~~~~~~~~~~~~~~~~~~第12章e~~~~~~~~~~~~~~~~~~~~~~~
 	block_desc_init(thread->u_block_desc);
+	list_init(&thread->vma_list);
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
     enum intr_status old_status = intr_disable();
-    ASSERT(!elem_find(&thread_ready_list, &thread->general_tag));
-    list_append(&thread_ready_list, &thread->general_tag);
+    thread_ready_add(thread);
 
     ASSERT(!elem_find(&thread_all_list, &thread->all_list_tag));
     list_append(&thread_all_list, &thread->all_list_tag);
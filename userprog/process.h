@@ -9,6 +9,8 @@ void process_execute(void* filename, char* name);
 void start_process(void* filename_);
 void process_activate(struct task_struct* p_thread);
 void page_dir_activate(struct task_struct* p_thread);
+void page_dir_release(struct task_struct* p_thread);
 uint32_t* create_page_dir(void);
-void create_user_vaddr_bitmap(struct task_struct* user_prog);
+void create_user_vaddr_pool(struct task_struct* user_prog);
+extern uint32_t cr3_load_cnt;
 #endif
@@ -9,6 +9,9 @@
 #include "fs.h"
 #include "fork.h"
 #include "exec.h"
+#include "vma.h"
+#include "wait_exit.h"
+#include "timer.h"
 
 #define syscall_nr 32 
 
@@ -36,7 +39,7 @@ void syscall_init(void) {
    
    syscall_table[SYS_GETPID] 	= sys_getpid; //##SYS_GETPID是列舉值，在此為0
    syscall_table[SYS_WRITE] 	= sys_write;
-   syscall_table[SYS_MALLOC] 	= sys_malloc;
+   syscall_table[SYS_MALLOC] 	= sys_malloc;	// 用户的malloc不清0,要清0用calloc
    syscall_table[SYS_FREE] 		= sys_free;
    syscall_table[SYS_FORK]    	= sys_fork;
    syscall_table[SYS_READ]   	= sys_read;
@@ -57,6 +60,15 @@ void syscall_init(void) {
    syscall_table[SYS_STAT]	 	= sys_stat;
    syscall_table[SYS_PS]	 	= sys_ps;
    syscall_table[SYS_EXECV]	 	= sys_execv;
+   syscall_table[SYS_MEMINFO]	= sys_meminfo;
+   syscall_table[SYS_CALLOC]	= sys_calloc;
+   syscall_table[SYS_MMAP]	= sys_mmap;
+   syscall_table[SYS_MUNMAP]	= sys_munmap;
+   syscall_table[SYS_WAIT]	= sys_wait;
+   syscall_table[SYS_EXIT]	= sys_exit;
+   syscall_table[SYS_NICE]	= sys_nice;
+   syscall_table[SYS_SLEEP]	= sys_sleep;
+   syscall_table[SYS_CLOCK_GETTIME] = sys_clock_gettime;
    
    put_str("syscall_init done\n");
 }
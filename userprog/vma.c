@@ -0,0 +1,286 @@
+#include "vma.h"
+#include "thread.h"
+#include "memory.h"
+#include "interrupt.h"
+#include "string.h"
+#include "debug.h"
+#include "fs.h"
+#include "file.h"
+#include "inode.h"
+
+/* vm_area要被fork出的子进程和页错误处理共同访问,故从内核堆中分配 */
+static struct vm_area* vma_alloc(void) {
+   return kmalloc(sizeof(struct vm_area));
+}
+
+static void vma_free(struct vm_area* vma) {
+   kfree(vma);
+}
+
+/* 释放当前进程[start, end)中已装入的页框,页表项清0 */
+static void vma_unmap_range(uint32_t start, uint32_t end) {
+   uint32_t vaddr;
+   for (vaddr = start; vaddr < end; vaddr += PG_SIZE) {
+      user_page_release(vaddr);
+   }
+}
+
+/* 把共享映射vma中page_vaddr这一页属于文件的部分写回文件 */
+static void vma_page_writeback(struct vm_area* vma, uint32_t page_vaddr) {
+   uint32_t copy_start = page_vaddr > vma->vm_file_start ? page_vaddr : vma->vm_file_start;
+   uint32_t copy_end = page_vaddr + PG_SIZE < vma->vm_file_end ? page_vaddr + PG_SIZE : vma->vm_file_end;
+   if (copy_start >= copy_end) {
+      return;
+   }
+   struct file file;
+   file.fd_pos = vma->vm_file_off + (copy_start - vma->vm_file_start);
+   file.fd_flag = O_WRONLY;
+   file.fd_inode = vma->vm_inode;
+   file_overwrite(&file, (void*)copy_start, copy_end - copy_start);
+}
+
+/* 撤销当前进程vma中[start, end)这部分:共享映射的脏页先写回文件,
+ * 再释放已装入的页框并归还虚拟地址 */
+static void vma_release_range(struct vm_area* vma, uint32_t start, uint32_t end) {
+   if (vma->vm_flags & VM_SHARED) {
+      uint32_t vaddr;
+      for (vaddr = start; vaddr < end; vaddr += PG_SIZE) {
+	 if (user_page_dirty(vaddr)) {
+	    vma_page_writeback(vma, vaddr);
+	 }
+      }
+   }
+   vma_unmap_range(start, end);
+   user_vaddr_unmark(start, end);
+}
+
+/* 为当前进程登记一段从vaddr开始、长memsz字节的按需调页映射.
+ * 文件inode中从file_off起的filesz字节对应vaddr处,其余部分(如bss)填0.
+ * flags为VM_WRITE和VM_SHARED的组合.
+ * 此范围内原有的页一并释放,成功返回0,失败返回-1 */
+int32_t vma_map_file(uint32_t vaddr, uint32_t memsz, struct inode* inode, uint32_t file_off, uint32_t filesz, uint32_t flags) {
+   ASSERT(filesz <= memsz);
+   struct task_struct* cur = running_thread();
+   struct vm_area* vma = vma_alloc();
+   if (vma == NULL) {
+      return -1;
+   }
+   vma->vm_start = vaddr & 0xfffff000;
+   vma->vm_end = DIV_ROUND_UP(vaddr + memsz, PG_SIZE) * PG_SIZE;
+   vma->vm_inode = inode == NULL ? NULL : inode_open(cur_part, inode->i_no);
+   vma->vm_file_off = file_off;
+   vma->vm_file_start = vaddr;
+   vma->vm_file_end = vaddr + filesz;
+   vma->vm_flags = flags;
+
+   /* 占住这段虚拟地址,免得堆分配到这里 */
+   if (user_vaddr_mark(vma->vm_start, vma->vm_end) == -1) {
+      if (vma->vm_inode != NULL) {
+	 inode_close(vma->vm_inode);
+      }
+      vma_free(vma);
+      return -1;
+   }
+   vma_unmap_range(vma->vm_start, vma->vm_end);
+   list_append(&cur->vma_list, &vma->vma_tag);
+   return 0;
+}
+
+/* 撤销当前进程[start, end)内的映射,start和end须页对齐.
+ * 只有一部分落在范围内的映射被截短,范围在映射中间时拆成两段.
+ * 成功返回0,拆分时内存不足返回-1 */
+int32_t vma_unmap(uint32_t start, uint32_t end) {
+   struct task_struct* cur = running_thread();
+   struct list_elem* elem = cur->vma_list.head.next;
+   while (elem != &cur->vma_list.tail) {
+      struct list_elem* next = elem->next;
+      struct vm_area* vma = elem2entry(struct vm_area, vma_tag, elem);
+      if (vma->vm_end <= start || vma->vm_start >= end) {
+	 elem = next;
+	 continue;
+      }
+      uint32_t cut_start = start > vma->vm_start ? start : vma->vm_start;
+      uint32_t cut_end = end < vma->vm_end ? end : vma->vm_end;
+
+      if (cut_start > vma->vm_start && cut_end < vma->vm_end) {
+	 /* 从中间挖掉一段,后半段另起一个vm_area,文件偏移的记法不变 */
+	 struct vm_area* tail_vma = vma_alloc();
+	 if (tail_vma == NULL) {
+	    return -1;
+	 }
+	 memcpy(tail_vma, vma, sizeof(struct vm_area));
+	 tail_vma->vm_start = cut_end;
+	 if (tail_vma->vm_inode != NULL) {
+	    tail_vma->vm_inode->i_open_cnts++;
+	 }
+	 list_append(&cur->vma_list, &tail_vma->vma_tag);
+	 vma_release_range(vma, cut_start, cut_end);
+	 vma->vm_end = cut_start;
+      } else if (cut_start == vma->vm_start && cut_end == vma->vm_end) {
+	 vma_release_range(vma, cut_start, cut_end);
+	 list_remove(&vma->vma_tag);
+	 if (vma->vm_inode != NULL) {
+	    inode_close(vma->vm_inode);
+	 }
+	 vma_free(vma);
+      } else {
+	 vma_release_range(vma, cut_start, cut_end);
+	 if (cut_start == vma->vm_start) {
+	    vma->vm_start = cut_end;
+	 } else {
+	    vma->vm_end = cut_start;
+	 }
+      }
+      elem = next;
+   }
+   return 0;
+}
+
+/* 返回pthread中包含vaddr的映射,没有则返回NULL */
+struct vm_area* vma_find(struct task_struct* pthread, uint32_t vaddr) {
+   struct list_elem* elem = pthread->vma_list.head.next;
+   while (elem != &pthread->vma_list.tail) {
+      struct vm_area* vma = elem2entry(struct vm_area, vma_tag, elem);
+      if (vaddr >= vma->vm_start && vaddr < vma->vm_end) {
+	 return vma;
+      }
+      elem = elem->next;
+   }
+   return NULL;
+}
+
+/* 由page_fault_handler调用:vaddr所在页还没装入时,若它属于某段映射就在此装入.
+ * 返回false表示vaddr不在任何映射中 */
+bool vma_fault(uint32_t vaddr) {
+   struct task_struct* cur = running_thread();
+   if (cur->pgdir == NULL) {
+      return false;
+   }
+   struct vm_area* vma = vma_find(cur, vaddr);
+   if (vma == NULL) {
+      return false;
+   }
+   uint32_t page_vaddr = vaddr & 0xfffff000;
+   if (get_a_page_without_opvaddrbitmap(PF_USER, page_vaddr) == NULL) {
+      PANIC("vma_fault: out of memory");
+   }
+   memset((void*)page_vaddr, 0, PG_SIZE);
+
+   /* 此页中属于文件内容的部分为[copy_start, copy_end),从文件中读入 */
+   uint32_t copy_start = page_vaddr > vma->vm_file_start ? page_vaddr : vma->vm_file_start;
+   uint32_t copy_end = page_vaddr + PG_SIZE < vma->vm_file_end ? page_vaddr + PG_SIZE : vma->vm_file_end;
+   if (vma->vm_inode != NULL && copy_start < copy_end) {
+      struct file file;
+      file.fd_pos = vma->vm_file_off + (copy_start - vma->vm_file_start);
+      file.fd_flag = O_RDONLY;
+      file.fd_inode = vma->vm_inode;
+      /* 页错误走的是中断门,进来时IF为0.读盘要阻塞在信号量上等硬盘中断,先开中断再读.
+       * 页框此时已挂进页表,读盘期间被换下也不会有别人碰这一页;硬盘通道由ide_read中的锁保护 */
+      enum intr_status old_status = intr_enable();
+      file_read(&file, (void*)copy_start, copy_end - copy_start);
+      intr_set_status(old_status);
+   }
+
+   /* 装入时内核写过此页,清掉脏位,之后再脏才是进程写的 */
+   uint32_t* pte = pte_ptr(page_vaddr);
+   *pte &= ~PG_DIRTY;
+   if (vma->vm_flags & VM_SHARED) {
+      *pte |= PG_SHARED;
+   }
+   if (!(vma->vm_flags & VM_WRITE)) {
+      *pte &= ~PG_RW_W;
+   }
+   asm volatile ("invlpg %0"::"m" (*(char*)page_vaddr):"memory");
+   return true;
+}
+
+/* 撤销pthread的全部映射,只能对当前进程调用.已装入的页框一并释放,共享映射的脏页写回文件 */
+void vma_release_all(struct task_struct* pthread) {
+   ASSERT(pthread == running_thread());
+   while (!list_empty(&pthread->vma_list)) {
+      struct vm_area* vma = elem2entry(struct vm_area, vma_tag, list_pop(&pthread->vma_list));
+      vma_release_range(vma, vma->vm_start, vma->vm_end);
+      if (vma->vm_inode != NULL) {
+	 inode_close(vma->vm_inode);
+      }
+      vma_free(vma);
+   }
+}
+
+/* fork时为子进程复制一份映射链表,已装入的页由页表写时复制共享,共享映射的页直接共用 */
+int32_t vma_fork(struct task_struct* child_thread, struct task_struct* parent_thread) {
+   list_init(&child_thread->vma_list);
+   struct list_elem* elem = parent_thread->vma_list.head.next;
+   while (elem != &parent_thread->vma_list.tail) {
+      struct vm_area* parent_vma = elem2entry(struct vm_area, vma_tag, elem);
+      struct vm_area* vma = vma_alloc();
+      if (vma == NULL) {
+	 return -1;
+      }
+      memcpy(vma, parent_vma, sizeof(struct vm_area));
+      if (vma->vm_inode != NULL) {
+	 vma->vm_inode->i_open_cnts++;
+      }
+      list_append(&child_thread->vma_list, &vma->vma_tag);
+      elem = elem->next;
+   }
+   return 0;
+}
+
+/* mmap系统调用:把文件fd从offset起的length字节映射到当前进程的用户空间,
+ * 页在第一次访问时才从文件读入.MAP_SHARED的映射在munmap、exec时把脏页写回文件,
+ * MAP_PRIVATE的映射写入只留在内存中.成功返回映射的起始地址,失败返回MAP_FAILED */
+void* sys_mmap(const struct mmap_args* args) {
+   if (args->length == 0 || args->offset % PG_SIZE != 0 || \
+       (args->flags != MAP_SHARED && args->flags != MAP_PRIVATE)) {
+      return MAP_FAILED;
+   }
+   if (args->fd <= stderr_no || args->fd >= MAX_FILES_OPEN_PER_PROC) {	 // 标准输入输出不是文件
+      return MAP_FAILED;
+   }
+   struct task_struct* cur = running_thread();
+   int32_t global_fd = cur->fd_table[args->fd];
+   if (global_fd == -1) {
+      return MAP_FAILED;
+   }
+   struct file* file = &file_table[global_fd];
+   uint32_t flags = 0;
+   if (args->prot & PROT_WRITE) {
+      flags |= VM_WRITE;
+   }
+   if (args->flags == MAP_SHARED) {
+      /* 可写的共享映射会写回文件,文件须以可写方式打开 */
+      if ((flags & VM_WRITE) && !(file->fd_flag & (O_WRONLY | O_RDWR))) {
+	 return MAP_FAILED;
+      }
+      flags |= VM_SHARED;
+   }
+
+   uint32_t pg_cnt = DIV_ROUND_UP(args->length, PG_SIZE);
+   void* vaddr = user_vaddr_get(pg_cnt);
+   if (vaddr == NULL) {
+      return MAP_FAILED;
+   }
+   /* 文件末尾之后的部分填0 */
+   uint32_t filesz = 0;
+   if (args->offset < file->fd_inode->i_size) {
+      filesz = file->fd_inode->i_size - args->offset;
+      if (filesz > args->length) {
+	 filesz = args->length;
+      }
+   }
+   if (vma_map_file((uint32_t)vaddr, pg_cnt * PG_SIZE, file->fd_inode, args->offset, filesz, flags) == -1) {
+      user_vaddr_unmark((uint32_t)vaddr, (uint32_t)vaddr + pg_cnt * PG_SIZE);
+      return MAP_FAILED;
+   }
+   return vaddr;
+}
+
+/* munmap系统调用:撤销[addr, addr + length)内的映射,addr须页对齐.成功返回0,失败返回-1 */
+int32_t sys_munmap(void* addr, uint32_t length) {
+   uint32_t start = (uint32_t)addr;
+   if (start % PG_SIZE != 0 || length == 0 || start >= 0xc0000000 || length > 0xc0000000 - start) {
+      return -1;
+   }
+   return vma_unmap(start, start + DIV_ROUND_UP(length, PG_SIZE) * PG_SIZE);
+}
@@ -0,0 +1,51 @@
+#ifndef __USERPROG_VMA_H
+#define __USERPROG_VMA_H
+#include "stdint.h"
+#include "list.h"
+#include "global.h"
+
+struct task_struct;
+struct inode;
+
+/* vm_area.vm_flags */
+#define VM_WRITE   1	 // 可写,否则装入的页是只读的
+#define VM_SHARED  2	 // 共享映射:fork后父子进程共用页框,脏页在撤销映射时写回文件
+
+/* mmap的prot和flags */
+#define PROT_READ    1
+#define PROT_WRITE   2
+#define MAP_SHARED   1
+#define MAP_PRIVATE  2
+#define MAP_FAILED   ((void*)-1)
+
+/* mmap的参数超过了系统调用能传的3个,打包成结构体传地址 */
+struct mmap_args {
+   void* addr;		 // 仅作提示,目前总是由内核挑选地址
+   uint32_t length;
+   uint32_t prot;
+   uint32_t flags;
+   int32_t fd;
+   uint32_t offset;	 // 须是页大小的整数倍
+};
+
+/* 进程用户空间中的一段映射,页在第一次访问时才由page_fault_handler装入 */
+struct vm_area {
+   uint32_t vm_start;		 // 起始虚拟地址,页对齐
+   uint32_t vm_end;		 // 结束虚拟地址(不含),页对齐
+   struct inode* vm_inode;	 // 映射的文件,为NULL时整段填0
+   uint32_t vm_file_off;	 // 文件中从此偏移处的内容映射到vm_file_start
+   uint32_t vm_file_start;	 // [vm_file_start, vm_file_end)是文件内容,段内其余部分填0
+   uint32_t vm_file_end;
+   uint32_t vm_flags;
+   struct list_elem vma_tag;	 // 用于挂在task_struct的vma_list上
+};
+
+int32_t vma_map_file(uint32_t vaddr, uint32_t memsz, struct inode* inode, uint32_t file_off, uint32_t filesz, uint32_t flags);
+int32_t vma_unmap(uint32_t start, uint32_t end);
+struct vm_area* vma_find(struct task_struct* pthread, uint32_t vaddr);
+bool vma_fault(uint32_t vaddr);
+void vma_release_all(struct task_struct* pthread);
+int32_t vma_fork(struct task_struct* child_thread, struct task_struct* parent_thread);
+void* sys_mmap(const struct mmap_args* args);
+int32_t sys_munmap(void* addr, uint32_t length);
+#endif
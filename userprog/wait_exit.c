@@ -0,0 +1,127 @@
+#include "wait_exit.h"
+#include "global.h"
+#include "debug.h"
+#include "thread.h"
+#include "list.h"
+#include "memory.h"
+#include "interrupt.h"
+#include "fs.h"
+#include "vma.h"
+
+/* 释放用户进程资源:
+ * 1 映射及其打开的文件
+ * 2 用户空间中的页框、页表和虚拟地址池中的区间,堆的arena也在其中
+ * 3 打开的文件
+ * 4 magazine中缓存的内核堆块
+ * 页目录和pcb要等父进程wait时才回收 */
+static void release_prog_resource(struct task_struct* release_thread) {
+   /* 共享映射的脏页要在页表还在时写回文件 */
+   vma_release_all(release_thread);
+   user_space_release();
+
+   uint8_t local_fd = 3;
+   while (local_fd < MAX_FILES_OPEN_PER_PROC) {
+      if (release_thread->fd_table[local_fd] != -1) {
+	 sys_close(local_fd);
+      }
+      local_fd++;
+   }
+
+   /* 上面释放时可能又往magazine里放了块,所以放到最后 */
+   k_mags_drain(release_thread->k_mags);
+}
+
+/* list_traversal的回调函数,
+ * 查找pelem的parent_pid是否是ppid,成功返回true,失败则返回false */
+static bool find_child(struct list_elem* pelem, int32_t ppid) {
+   struct task_struct* pthread = elem2entry(struct task_struct, all_list_tag, pelem);
+   return pthread->parent_pid == ppid;
+}
+
+/* list_traversal的回调函数,
+ * 查找状态为TASK_HANGING的任务 */
+static bool find_hanging_child(struct list_elem* pelem, int32_t ppid) {
+   struct task_struct* pthread = elem2entry(struct task_struct, all_list_tag, pelem);
+   return pthread->parent_pid == ppid && pthread->status == TASK_HANGING;
+}
+
+/* list_traversal的回调函数,
+ * 将一个子进程过继给init */
+static bool init_adopt_a_child(struct list_elem* pelem, int32_t pid) {
+   struct task_struct* pthread = elem2entry(struct task_struct, all_list_tag, pelem);
+   if (pthread->parent_pid == pid) {
+      pthread->parent_pid = 1;
+   }
+   return false;	 // 让list_traversal继续遍历
+}
+
+/* 等待子进程调用exit,将子进程的退出状态保存到status指向的变量.
+ * 成功则返回子进程的pid,没有子进程时返回-1 */
+pid_t sys_wait(int32_t* status) {
+   struct task_struct* parent_thread = running_thread();
+
+   /* 查找和阻塞之间不能被子进程的exit插进来,否则唤醒会丢失 */
+   enum intr_status old_status = intr_disable();
+   while (1) {
+      /* 优先处理已经是挂起状态的任务 */
+      struct list_elem* child_elem = list_traversal(&thread_all_list, find_hanging_child, parent_thread->pid);
+      if (child_elem != NULL) {
+	 struct task_struct* child_thread = elem2entry(struct task_struct, all_list_tag, child_elem);
+	 int32_t child_status = child_thread->exit_status;
+	 pid_t child_pid = child_thread->pid;
+
+	 /* 回收子进程的页目录、pcb和pid */
+	 thread_exit(child_thread);
+	 intr_set_status(old_status);
+
+	 /* 写用户内存可能引起页错误,放到开中断之后 */
+	 if (status != NULL) {
+	    *status = child_status;
+	 }
+	 return child_pid;
+      }
+
+      /* 判断是否有子进程 */
+      child_elem = list_traversal(&thread_all_list, find_child, parent_thread->pid);
+      if (child_elem == NULL) {	 // 没有子进程则出错返回
+	 intr_set_status(old_status);
+	 return -1;
+      }
+      /* 若子进程还未运行完,则将自己挂起,直到子进程在执行exit时将自己唤醒 */
+      thread_block(TASK_WAITING);
+   }
+}
+
+/* 子进程用来结束自己时调用 */
+void sys_exit(int32_t status) {
+   struct task_struct* child_thread = running_thread();
+   child_thread->exit_status = status;
+   if (child_thread->parent_pid == -1) {
+      PANIC("sys_exit: child_thread->parent_pid is -1\n");
+   }
+
+   /* 将进程child_thread的所有子进程都过继给init */
+   list_traversal(&thread_all_list, init_adopt_a_child, child_thread->pid);
+
+   /* 回收进程child_thread的资源 */
+   release_prog_resource(child_thread);
+
+   /* 唤醒父进程和挂起自己之间不能被打断,否则父进程可能在自己挂起前就查找完并再次阻塞 */
+   intr_disable();
+
+   /* 过继来的子进程可能已经退出了,若init正在等待要把它叫醒 */
+   struct task_struct* init_proc = pid2thread(1);
+   if (init_proc->status == TASK_WAITING && \
+       list_traversal(&thread_all_list, find_hanging_child, 1) != NULL) {
+      thread_unblock(init_proc);
+   }
+
+   /* 如果父进程正在等待子进程退出,将父进程唤醒 */
+   struct task_struct* parent_thread = pid2thread(child_thread->parent_pid);
+   if (parent_thread->status == TASK_WAITING) {
+      thread_unblock(parent_thread);
+   }
+
+   /* 将自己挂起,等待父进程获取其status,并回收其pcb */
+   thread_block(TASK_HANGING);
+}